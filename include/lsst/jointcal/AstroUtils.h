@@ -24,6 +24,9 @@ WARNING : The flux of the returned BaseStar's is in fact a magnitude. */
   bool UsnoCollect(const Frame &usnoFrame, const TanPix2RaDec &Wcs, 
 		   BaseStarList &UsnoCat);
 
+  //! converts the magnitudes read by UsnoRead into fluxes (0 for missing magnitudes).
+  void ConvertMagToFlux(BaseStarList &List, const double Zp);
+
   //! accepts both sexagesimal and decimal values.
   double RaStringToDeg(const std::string RaString);
 
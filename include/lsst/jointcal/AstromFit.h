@@ -8,6 +8,7 @@
 #include "lsst/jointcal/CcdImage.h"
 #include "lsst/jointcal/Eigenstuff.h"
 #include "lsst/jointcal/Tripletlist.h"
+#include "lsst/jointcal/SparseAssembler.h"
 #include "lsst/jointcal/DistortionModel.h"
 #include "lsst/jointcal/Chi2.h"
 
@@ -64,7 +65,8 @@ class AstromFit {
   std::string _WhatToFit;
   bool _fittingDistortions, _fittingPos, _fittingRefrac, _fittingPM;
   DistortionModel * _distortionModel;
-  int _LastNTrip; // last triplet count, used to speed up allocation
+  SparseAssembler _jacobianAssembler; // recycles the Jacobian sparsity pattern
+  size_t _jacobianBudget; // bytes allowed for Jacobian triplets (0 : no limit)
   double _referenceColor, _sigCol; // average and r.m.s color
   unsigned _nRefrac;
   std::vector<double> _refracCoefficient; // fit parameter
@@ -89,6 +91,14 @@ class AstromFit {
     algebra. */
   unsigned Minimize(const std::string &WhatToFit, const double NSigRejCut=0);
 
+  //! Iterates damped (Levenberg-Marquardt) steps until convergence, with outlier rejection at NSigRejCut (if >0) in between.
+  /*! Returns 0 on convergence, 1 if chi2 could not be decreased, 2 if
+    the factorization failed, 3 if MaxIter was reached. Chi2Tol is the
+    relative variation of chi2/ndof (and relative expected decrease
+    of chi2) under which the fit is considered as converged. */
+  unsigned MinimizeLM(const std::string &WhatToFit, const double NSigRejCut=0,
+		      const unsigned MaxIter=20, const double Chi2Tol=1e-4);
+
   //! Compute derivatives of measurement terms for this CcdImage
   void LSDerivatives1(const CcdImage &Ccd,
 		      TripletList &TList, Eigen::VectorXd &Rhs,
@@ -113,6 +123,12 @@ class AstromFit {
     fit, which can be useful. */
   void FreezeErrorScales() {_distortionModel->FreezeErrorScales();}
 
+  //! Bounds the memory (in bytes) used to stage the Jacobian. 0 (the default) means no bound.
+  /*! With a bound, the Hessian is accumulated from batches of
+    CcdImages whose Jacobian fits in the budget, rather than from the
+    whole Jacobian at once. This trades some CPU for memory. */
+  void SetJacobianMemoryBudget(const size_t Bytes) { _jacobianBudget = Bytes;}
+
 
   //! Offsest the parameters by the requested quantities. The used parameter layout is the one from the last call to AssignIndices or Minimize().
   /*! There is no easy way to check that the current setting of
@@ -167,6 +183,22 @@ class AstromFit {
 			    const double &RefractionCoeff,
 			    const double &Jd) const;
 
+  //! Same as above, with F already projected to the tangent plane.
+  Point TransformFittedStar(const FittedStar &F,
+			    const Point &ProjectedFittedStar,
+			    const Point &RefractionVector,
+			    const double &RefractionCoeff,
+			    const double &Jd) const;
+
+  //! Upper bound of the number of Jacobian entries, and number of measurement blocks.
+  void CountTriplets(size_t &NEntries, size_t &NBlocks) const;
+
+  //! Hessian and gradient for the current WhatToFit setting.
+  void HessianAndGradient(Eigen::SparseMatrix<double> &Hessian, Eigen::VectorXd &Grad);
+
+  //! Same as above, staging the Jacobian by batches of CcdImages within _jacobianBudget.
+  void AccumulateHessianByBatches(Eigen::SparseMatrix<double> &Hessian, Eigen::VectorXd &Grad);
+
   template <class ListType, class Accum>
     void AccumulateStatImageList(ListType &L, Accum &A) const;
 
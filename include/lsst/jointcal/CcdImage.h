@@ -247,7 +247,8 @@ class CcdImage : public RefCount
   //! returns wether "this" overlaps with Other.
   //  bool Overlaps(const CcdImage &Other) const;
   
-  //! CcdImage index
+  //! CcdImage index: rank in the Associations image list (dense, starting at 0), -1 if not set.
+  /*! Models use it to store their per-CcdImage data in vectors. */
   int     Index() const { return index; }
   void    SetIndex(int idx) { index = idx; }
   
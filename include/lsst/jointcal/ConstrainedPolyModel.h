@@ -17,6 +17,7 @@ class CcdImage;
 
 
 #include <map>
+#include <vector>
 
 
 namespace lsst {
@@ -25,13 +26,17 @@ namespace jointcal {
 class CcdImageList;
 
 //! This is the model used to fit mappings as the combination of a transformation depending on the chip number (instrument model) and a transformation per shoot (anamorphism). The two-transformation Mapping required for this model is TwoTransfoMapping.
-/*! This modeling of distortions is meant for set of images from a single mosaic imager. */
+/*! This modeling of distortions is meant for set of images from a single mosaic imager.
+  The chip and shoot transfos are monomial polynomials (of fixed degree, see
+  DistortionDegree): unlike SimplePolyModel, there is no Chebyshev option,
+  because ProduceSipWcs composes the two transfos as GtransfoPoly's. */
 class ConstrainedPolyModel : public DistortionModel
 {
   /* using ref counts here allows us to not write a destructor nor a copy
      constructor. I could *not* get it to work using std::auto_ptr. */
-  typedef std::map<const CcdImage*, std::unique_ptr<TwoTransfoMapping> > mappingMapType;
-  mappingMapType _mappings;
+  typedef std::vector<std::unique_ptr<TwoTransfoMapping> > mappingMapType;
+  mappingMapType _mappings; // indexed by CcdImage::Index()
+  std::vector<const CcdImage*> _owners; // the CcdImage of each _mappings entry
   typedef std::map<unsigned, std::unique_ptr<SimpleGtransfoMapping> > chipMapType;
   chipMapType _chipMap;
   typedef std::map<ShootIdType, std::unique_ptr<SimpleGtransfoMapping> > shootMapType;
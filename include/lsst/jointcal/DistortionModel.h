@@ -1,6 +1,7 @@
 #ifndef DISTORTIONSMODEL__H
 #define DISTORTIONSMODEL__H
 
+#include "lsst/base.h" // for PTR
 #include "lsst/jointcal/Eigenstuff.h"
 #include "lsst/jointcal/Mapping.h"
 
@@ -9,6 +10,7 @@ namespace jointcal {
 
 class CcdImage;
 class Gtransfo;
+class TanSipPix2RaDec;
 
 //! Interface class between AstromFit and an actual model for the Mapping (s) from pixels to some tangent plane (aka distortions).
 /* For an implementation example, see SimplePolyModel, and the comments at
@@ -37,6 +39,9 @@ public :
   //!
   virtual void FreezeErrorScales() = 0;
 
+  //! The WCS (pixels to sky) of a CcdImage, as currently fitted. NULL if it cannot be represented as a TAN-SIP WCS.
+  virtual PTR(TanSipPix2RaDec) ProduceSipWcs(const CcdImage &Ccd) const = 0;
+
   virtual ~DistortionModel() {};
 
 };
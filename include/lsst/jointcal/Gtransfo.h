@@ -14,6 +14,7 @@
 
 
 #include "lsst/jointcal/FatPoint.h"
+#include "lsst/jointcal/Frame.h" // for GtransfoChebyshev
 #include "lsst/jointcal/CountedRef.h"
 
 namespace lsst {
@@ -57,6 +58,13 @@ public:
       {double xout, yout; apply(Pin.x, Pin.y, xout,yout);
       return Point(xout,yout);}
 
+  //! Transforms N points given as coordinate arrays. Xout (Yout) may be the same array as Xin (Yin).
+  /*! The default calls apply for every point. Derived classes may
+    provide tighter loops, which then cost a single virtual call for
+    the whole set of points. */
+  virtual void TransformArrays(const double *Xin, const double *Yin,
+			       double *Xout, double *Yout, const unsigned N) const;
+
   //! dumps the transfo coefficients to stream.
   virtual void dump(std::ostream &stream = std::cout) const = 0;
 
@@ -88,6 +96,14 @@ public:
   virtual void Derivative(const Point &Where, GtransfoLin &Der,
 			  const double Step = 0.01) const;
 
+  //! Same as Derivative, as 4 numbers: A12 is d(xout)/d(yin).
+  /*! The default goes through Derivative. Overloaded by transfos
+    that can do without allocating a GtransfoLin, which then makes
+    this routine allocation-free and usable from several threads. */
+  virtual void DerivativeMatrix(const Point &Where, double &A11, double &A12,
+				double &A21, double &A22,
+				const double Step = 0.01) const;
+
   //! linear (local) approximation.
   virtual GtransfoLin LinearApproximation(const Point &Where,
 					  const double step = 0.01) const;
@@ -105,6 +121,17 @@ public:
   virtual Gtransfo* InverseTransfo(const double Precision,
 				   const Frame& Region) const;
 
+  //! returns an inverse transfo which is a polynomial over Region, accurate to Precision there.
+  /*! The polynomial degree is raised until the maximum error, measured
+    on a grid over Region, is below Precision. Outside Region, the
+    returned transfo resorts to the iterative solver of
+    InverseTransfo. If no polynomial (up to degree 9) is accurate
+    enough, this is the same as InverseTransfo. Meant for inverses
+    evaluated many times: within Region, it costs one polynomial
+    evaluation rather than a few iterations. */
+  virtual Gtransfo* PolyInverseTransfo(const double Precision,
+				       const Frame& Region) const;
+
 
   //! Params should be at least Npar() long
   void GetParams(double *Params) const;
@@ -150,6 +177,18 @@ std::ostream & operator << (std::ostream &stream, const Gtransfo & T);
 
 Gtransfo *GtransfoCompose(const Gtransfo *Left, const Gtransfo *Right);
 
+//! Returns a transfo equivalent to T, where compositions are flattened and reduced as much as possible. Deletion of returned value to be done by caller.
+/*! Adjacent polynomial stages are merged when one of them is linear,
+  TAN WCS's are split into their pixel-to-tangent-plane polynomial and
+  their deprojection, and a deprojection followed by a projection is
+  replaced by the equivalent tangent plane to tangent plane
+  (projective) transformation, into which adjacent linear stages are
+  absorbed. When a single polynomial (or non-reducible) stage remains,
+  it is returned as such, otherwise the stages are evaluated in turn
+  by a single object, with analytic derivatives. Meant for transfos
+  evaluated many times, e.g. the ones held by CcdImage. */
+Gtransfo *GtransfoFlatten(const Gtransfo *T);
+
 
 /*=============================================================*/
 //! A do-nothing transformation. It anyway has dummy routines to mimick a Gtransfo
@@ -182,6 +221,11 @@ public:
     void Derivative(const Point &Where, GtransfoLin &Derivative,
 		    const double Step = 0.01) const;
 
+    void DerivativeMatrix(const Point &/* Where */, double &A11, double &A12,
+			  double &A21, double &A22,
+			  const double /* Step */ = 0.01) const
+      {A11 = A22 = 1; A12 = A21 = 0;}
+
     //! linear approximation.
     virtual GtransfoLin LinearApproximation(const Point &Where,
 					    const double Step = 0.01) const;
@@ -242,10 +286,19 @@ public :
   void apply(const double Xin, const double Yin,
 	     double &Xout, double &Yout) const;
 
+  //! same results as apply, without the per-point call overhead.
+  void TransformArrays(const double *Xin, const double *Yin,
+		       double *Xout, double *Yout, const unsigned N) const;
+
   //! specialised analytic routine
   void Derivative(const Point &Where, GtransfoLin &Der,
 		  const double Step = 0.01) const;
 
+  //! Same as Derivative, without allocating a GtransfoLin: A12 is d(xout)/d(yin).
+  void DerivativeMatrix(const Point &Where, double &A11, double &A12,
+			double &A21, double &A22,
+			const double Step = 0.01) const;
+
   //! a mix of apply and Derivative
   virtual void TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const;
 
@@ -315,9 +368,19 @@ public :
   void Read(std::istream &s);
 
 
+  //! Number of threads used to accumulate the normal equations in fit(). 0 means one per core. Default is 1.
+  /*! Applies to all GtransfoPoly's. Only large match lists get split
+    (see Gtransfo.cc). Can be called while other threads fit: a fit
+    reads the count once, when it starts. */
+  static void SetFitNThreads(const unsigned NThreads);
+
 private :
-  double do_the_fit(const StarMatchList &List, const Gtransfo &InTransfo,
-		    const bool UseErrors);
+  struct FitData; // matches packed for do_the_fit (see Gtransfo.cc)
+
+  void pack_matches(const StarMatchList &List, const Gtransfo &ShiftToCenter,
+		    FitData &Data) const;
+
+  double do_the_fit(const FitData &Data, const bool UseErrors);
 
 };
 
@@ -326,6 +389,111 @@ GtransfoPoly *InversePolyTransfo(const Gtransfo &Direct, const Frame &F, const d
 
 GtransfoLin NormalizeCoordinatesTransfo(const Frame & F);
 
+/*=============================================================*/
+//! Polynomial transfo expanded on products of Chebyshev polynomials T_i(x)T_j(y), with i+j <= degree.
+/*! The input coordinates are mapped from the domain (a Frame given at
+  construction) onto [-1,1]x[-1,1] before the basis is evaluated. Over
+  this domain, the basis is much better conditioned than monomials, so
+  that high degrees (6 or 7) can be fitted. The basis functions are
+  ordered as the monomials of GtransfoPoly (by total degree). The
+  domain is not a parameter: the transfo is defined (but loses its
+  good properties) outside of it. */
+class GtransfoChebyshev : public Gtransfo
+{
+public :
+  using Gtransfo::apply; // to unhide Gtransfo::apply(const Point &)
+
+private:
+  unsigned deg;
+  unsigned nterms; // number of parameters per coordinate
+  Frame domain;
+  double xCenter, yCenter, xScale, yScale; // domain -> [-1,1]
+  std::vector<double> coeffs; // x coefficients, then y coefficients
+
+public :
+  //! The identity, expanded up to Deg over Domain.
+  GtransfoChebyshev(const unsigned Deg, const Frame &Domain);
+
+  //! Constructs a "Chebyshev image" of T over Domain (least squares on a grid of about NPoint points).
+  GtransfoChebyshev(const Gtransfo* T,
+		    const Frame &Domain,
+		    unsigned Degree,
+		    unsigned NPoint=1000);
+
+  void apply(const double Xin, const double Yin,
+	     double &Xout, double &Yout) const;
+
+  //! specialised analytic routine
+  void Derivative(const Point &Where, GtransfoLin &Der,
+		  const double Step = 0.01) const;
+
+  //! Allocation-free analytic routine
+  void DerivativeMatrix(const Point &Where, double &A11, double &A12,
+			double &A21, double &A22,
+			const double Step = 0.01) const;
+
+  //! a mix of apply and Derivative
+  void TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const;
+
+  //! Values of the basis functions at Where, and (if not NULL) their derivatives w.r.t. x and y.
+  /*! Arrays should be at least NTerms() long. Bx and By account for the
+    domain normalization. */
+  void ComputeBasis(const Point &Where, double *B,
+		    double *Bx = NULL, double *By = NULL) const;
+
+  //! Sums the coefficients weighted by B, as computed by ComputeBasis.
+  /*! With the basis values, this yields the transformed position, with
+    their derivatives, the columns of the jacobian. */
+  void ApplyBasis(const double *B, double &Xout, double &Yout) const;
+
+  unsigned Degree() const { return deg;}
+
+  //! number of basis functions (i.e. of parameters per coordinate)
+  unsigned NTerms() const { return nterms;}
+
+  const Frame& Domain() const { return domain;}
+
+  //! total number of parameters
+  int Npar() const { return 2*nterms;}
+
+  //! access to coefficients of T_Degx(x)T_Degy(y)
+  double Coeff(const unsigned Degx, const unsigned Degy,
+	       const unsigned WhichCoord) const;
+
+  //! write access
+  double& Coeff(const unsigned Degx, const unsigned Degy,
+		const unsigned WhichCoord);
+
+  //! The same transfo, expanded on monomials of the (non-normalized) input coordinates.
+  GtransfoPoly ToPoly() const;
+
+  void dump(std::ostream &stream = std::cout) const;
+
+  //! Unweighted least-squares fit. The domain is not changed.
+  double fit(const StarMatchList &List);
+
+  Gtransfo *Clone() const {return new GtransfoChebyshev(*this);}
+
+  //!
+  double ParamRef(const int i) const;
+
+  //!
+  double& ParamRef(const int i);
+
+  //! Derivative w.r.t parameters. Same layout as GtransfoPoly::ParamDerivatives
+  void ParamDerivatives(const Point &Where, double *Dx, double *Dy) const;
+
+  void Write(std::ostream &s) const;
+  void Read(std::istream &s);
+
+private :
+  void set_domain(const Frame &Domain);
+
+  double least_squares(const std::vector<double> &Xin, const std::vector<double> &Yin,
+		       const std::vector<double> &Xout, const std::vector<double> &Yout);
+};
+
+
 /*=============================================================*/
 //! implements the linear transformations (6 real coefficients).
 class GtransfoLin : public GtransfoPoly {
@@ -474,6 +642,10 @@ public :
   void apply(const double Xin, const double Yin,
 	     double &Xout, double &Yout) const;
 
+  //! batch version of apply, with the tangent point trigonometry done once.
+  void TransformArrays(const double *Xin, const double *Yin,
+		       double *Xout, double *Yout, const unsigned N) const;
+
   //! The tangent point (in degrees)
   Point TangentPoint() const;
 
@@ -495,6 +667,20 @@ public :
   //! Transforms from pixel space to tangent plane. deferred to actual implementations
   virtual void Pix2TP(const double &Xpix, const double &Ypix, double &Xtp, double & Ytp) const = 0;
 
+  //! Pix2TP for N points. Xtp (Ytp) may be the same array as Xpix (Ypix). The default calls Pix2TP for every point.
+  virtual void Pix2TPArrays(const double *Xpix, const double *Ypix,
+			    double *Xtp, double *Ytp, const unsigned N) const;
+
+  //! Pix2TP and its derivative at Where. The default derives Pix2TP numerically.
+  virtual void Pix2TPDerivative(const Point &Where, Point &Tp, GtransfoLin &Der) const;
+
+  //! analytic derivative (Step is ignored).
+  void Derivative(const Point &Where, GtransfoLin &Der,
+		  const double Step = 0.01) const;
+
+  //! a mix of apply and Derivative
+  void TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const;
+
   ~BaseTanWcs();
 
 };
@@ -520,6 +706,13 @@ public:
   virtual void Pix2TP(const double &Xpix, const double &Ypix,
 		      double &Xtp, double & Ytp) const;
 
+  //! calls the batch routines of the linear part and corrections.
+  virtual void Pix2TPArrays(const double *Xpix, const double *Ypix,
+			    double *Xtp, double *Ytp, const unsigned N) const;
+
+  //! analytic derivative of Pix2TP.
+  virtual void Pix2TPDerivative(const Point &Where, Point &Tp, GtransfoLin &Der) const;
+
   TanPix2RaDec();
 
     //! composition with GtransfoLin
@@ -538,6 +731,10 @@ public:
   Gtransfo* InverseTransfo(const double Precision,
 			   const Frame& Region) const;
 
+  //! Same as InverseTransfo if there are no corrections.
+  Gtransfo* PolyInverseTransfo(const double Precision,
+			       const Frame& Region) const;
+
     
   Gtransfo *Clone() const;
   
@@ -566,6 +763,13 @@ public:
   virtual void Pix2TP(const double &Xpix, const double &Ypix,
 		      double &Xtp, double & Ytp) const;
 
+  //! calls the batch routines of the linear part and corrections.
+  virtual void Pix2TPArrays(const double *Xpix, const double *Ypix,
+			    double *Xtp, double *Ytp, const unsigned N) const;
+
+  //! analytic derivative of Pix2TP.
+  virtual void Pix2TPDerivative(const Point &Where, Point &Tp, GtransfoLin &Der) const;
+
   TanSipPix2RaDec();
 
 
@@ -620,10 +824,18 @@ class TanRaDec2Pix : public Gtransfo
     //!
     void apply(const double Xin, const double Yin, double &Xout, double &Yout) const;
 
+    //! batch version of apply, with the tangent point trigonometry done once.
+    void TransformArrays(const double *Xin, const double *Yin,
+			 double *Xout, double *Yout, const unsigned N) const;
+
     //! transform with analytical derivatives
     void TransformPosAndErrors(const FatPoint &In,
 			       FatPoint &Out) const;
 
+    //! analytic derivative (Step is ignored).
+    void Derivative(const Point &Where, GtransfoLin &Der,
+		    const double Step = 0.01) const;
+
 
 
     //! exact typed inverse:
@@ -25,6 +25,9 @@ class Histo2d {
 
   void Fill(float x, float y, float weight=1.);
 
+  //! The bin Fill(X,Y) contributes to, as a single index. -1 if outside.
+  int BinCode(float X, float Y) const;
+
   double MaxBin(double &x, double &y) const ;
 
   void BinWidth(double &Hdx, double &Hdy) const { Hdx = 1./scalex; Hdy = 1./scaley;}
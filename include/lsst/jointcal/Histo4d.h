@@ -1,23 +1,34 @@
 #ifndef HISTO4D__H
 #define HISTO4D__H
 
+#include <vector>
+#include <unordered_map>
+#include <utility>
+
 namespace lsst {
 namespace jointcal {
 
 
-//! A class to histogram in 4 dimensions. Uses Sparse storage. The number of bin is limited to 256 per dimension. Used in ListMatch.cc
+//! A class to histogram in 4 dimensions. Uses Sparse storage. The total number of bins is limited to INT_MAX. Used in ListMatch.cc
+/*! Bin contents are kept in a hash table (so that Fill is O(1)), and
+  the non-empty bins are ordered in a heap when the maximum is first
+  requested. ZeroBin leaves a stale entry in the heap, which is
+  discarded by the next MaxBin, so that repeated (MaxBin, ZeroBin)
+  sequences cost O(log(#bins)) each. Ties are resolved in favor of the
+  lowest bin code. */
 class SparseHisto4d {
 
  private:
-  int *data;
-  int ndata; int dataSize;
+  std::unordered_map<int,int> counts; // code -> content
+  std::vector<std::pair<int,int> > heap; // (content, code)
+  bool heapValid;
+  int ndata;
   int n[4];
   double minVal[4],maxVal[4];
   double scale[4];
-  bool sorted;
-  
+
  public:
-  SparseHisto4d() {}
+  SparseHisto4d() : heapValid(false), ndata(0) {}
   // obvious meanings. NEntries is used as the size of the primary allocation.
   SparseHisto4d(const int N1, double Min1, double Max1,
 		const int N2, double Min2, double Max2,
@@ -28,6 +39,8 @@ class SparseHisto4d {
   void Fill(const double X[4]);
   //!
   void Fill(const double X1, const double X2, const double X3, const double X4);
+  //! Adds entries given by their codes (as provided by code_value()). Negative codes are ignored.
+  void FillCodes(const int *Codes, const int N);
   //!
   int MaxBin(double X[4]);
 
@@ -40,14 +53,15 @@ class SparseHisto4d {
   //!
   int NEntries() const { return ndata;}
 
-  ~SparseHisto4d() { delete [] data;}
-
   // private:
   int code_value(const double X[4]) const;
   void inverse_code(const int ACode, double X[4]) const;
-  void sort();
   void dump() const;
 
+ private:
+  void add_code(const int Code);
+  void build_heap();
+
 };
 
 }} // end of namespaces
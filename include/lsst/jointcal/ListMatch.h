@@ -10,7 +10,7 @@ namespace lsst {
 namespace jointcal {
 
 
-class Gtransfo; class GtransfoLin;
+class Gtransfo; class GtransfoLin; class FastFinder;
 
 //! Parameters to be provided to combinatorial searches
 struct MatchConditions
@@ -21,7 +21,9 @@ struct MatchConditions
   double MaxShiftX, MaxShiftY;
   double SizeRatio, DeltaSizeRatio, MinMatchRatio;
   int PrintLevel;
-  int Algorithm;
+  int Algorithm; //!< 1, 2 : segment pairs voting (2 is faster), 3 : triangle hashing
+  int NThreads; //!< threads used to histogram segment pairs (default 1; 0 : as many as cores)
+  double AcceptNSigmas; //!< stop the trials at the first candidate that beats chance coincidences by that many sigmas (0 : never)
 
   MatchConditions(/* const std::string &DatacardsName = ""*/ );
 
@@ -62,6 +64,14 @@ closest star in L2, and builds a match if closer than MaxDist). */
 
 StarMatchList *ListMatchCollect(const BaseStarList &L1, const BaseStarList &L2,const Gtransfo *Guess, const double MaxDist);
 
+//! same as above, filling Matches (which is cleared first), with a locator on L2 built by the caller.
+/*! Meant for repeated collections against the same L2 : neither the
+  locator nor the match list are reallocated. */
+
+void ListMatchCollect(const BaseStarList &L1, const FastFinder &Finder2,
+		      const Gtransfo *Guess, const double MaxDist,
+		      StarMatchList &Matches);
+
 //! same as before except that the transfo is the identity
 
 StarMatchList *ListMatchCollect(const BaseStarList &L1, const BaseStarList &L2, const double MaxDist);
@@ -76,6 +86,11 @@ GtransfoLin *ListMatchupShift(const BaseStarList &L1,
 			      double MaxShift, double BinSize = 0);
 
 
+//! fills View with the NKeep (0 : all) brightest stars of L, by decreasing flux. Stars are shared, not copied.
+
+void FluxOrderedView(const BaseStarList &L, BaseStarList &View, const size_t NKeep=0);
+
+
 Gtransfo* ListMatchCombinatorial(const BaseStarList &List1,
 				 const BaseStarList &List2,
 				 const MatchConditions& Conditions=MatchConditions());
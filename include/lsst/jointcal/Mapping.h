@@ -15,6 +15,11 @@ class FatPoint;
 class Point;
 
 //! virtual class needed in the abstraction of the distortion model
+/*! The const routines (ComputeTransformAndDerivatives,
+  TransformPosAndErrors, PosDerivative) may be called concurrently on
+  the same Mapping: implementations should only use stack (preferably
+  fixed-size) temporaries and the H provided by the caller, and never
+  mutable members. */
 class Mapping
 {
 
@@ -34,6 +39,17 @@ class Mapping
     virtual void ComputeTransformAndDerivatives(const FatPoint &Where,
 						FatPoint &OutPos,
 						Eigen::MatrixX2d &H) const = 0;
+
+    //! Same as above, for the measurement at position Rank in the catalog of its CcdImage.
+    /*! Mappings may use Rank to retrieve quantities cached for this
+        measurement, provided they check that they refer to Where. The
+        default ignores Rank. */
+    virtual void ComputeTransformAndDerivatives(const FatPoint &Where,
+						FatPoint &OutPos,
+						Eigen::MatrixX2d &H,
+						const unsigned Rank) const
+    { ComputeTransformAndDerivatives(Where, OutPos, H);}
+
     //! The same as above but without the parameter derivatives (used to evaluate chi^2)
     virtual void TransformPosAndErrors(const FatPoint &Where,
 				       FatPoint &OutPos) const = 0;
@@ -6,12 +6,16 @@
 #include "lsst/jointcal/ChipArrangement.h"
 #include "lsst/jointcal/CountedRef.h"
 
+#include <vector>
+
 namespace lsst {
 namespace jointcal {
     
   class ExposureCatalog;
   class Point;
+  class Frame;
   struct SimAstromControl;
+  class RefCatalog;
 
   // prefer this to a typedef because it saves a %template declaration to swig.
   struct ExposureSolutionType : public std::map<unsigned, lsst::jointcal::CountedRef<Gtransfo> >
@@ -20,6 +24,23 @@ namespace jointcal {
 
   //! Routine to astrometrically match a whole exposure at once, relying on a ChipArrangement. The ourine returns mappings from pixel space to tangent plane.
 ExposureSolutionType MatchExposure(ExposureCatalog &EC, const Point &TangentPoint, const JointcalControl &Control);
+
+  //! Same as above, collecting reference stars from a catalog read and indexed beforehand, rather than reading files at every call.
+  /*! Reference stars are read from the files when the catalog does not cover the needed sky region (see ExposureSkyFrame). */
+ExposureSolutionType MatchExposure(ExposureCatalog &EC, const Point &TangentPoint, const JointcalControl &Control,
+				   const RefCatalog &RefCat);
+
+  //! The sky region (ra,dec in degrees) where MatchExposure first collects the reference stars of the exposure.
+Frame ExposureSkyFrame(ExposureCatalog &EC, const Point &TangentPoint);
+
+  //! Matches a batch of exposures (pointed at TangentPoints) concurrently, using NThreads threads (0 : as many as cores).
+  /*! Returns one solution per exposure, in the input order. The
+    solution of an exposure that could not be matched is empty. */
+std::vector<ExposureSolutionType> MatchExposures(const std::vector<ExposureCatalog*> &ECs,
+						 const std::vector<Point> &TangentPoints,
+						 const JointcalControl &Control,
+						 const RefCatalog &RefCat,
+						 const unsigned NThreads=0);
     
 }}
 
@@ -111,6 +111,9 @@ class MeasuredStarList : public StarList<MeasuredStar> {
   void SetZeroPoint(const double &ZP);
 
   void SetCcdImage(const CcdImage *C);
+
+  //! Discards the measurements from the fits: invalidates them and updates the measurement counts of their FittedStar's.
+  void RemoveFromFits();
 };
 
 
@@ -9,6 +9,7 @@
 #include "lsst/jointcal/CcdImage.h"
 #include "lsst/jointcal/Eigenstuff.h"
 #include "lsst/jointcal/Tripletlist.h"
+#include "lsst/jointcal/SparseAssembler.h"
 #include "lsst/jointcal/PhotomModel.h"
 #include "lsst/jointcal/Chi2.h"
 
@@ -34,7 +35,7 @@ class PhotomFit {
   unsigned _nParModel, _nParFluxes, _nParTot;
   PhotomModel * _photomModel;
   double _fluxError;
-  int _LastNTrip; // last triplet count, used to speed up allocation
+  SparseAssembler _jacobianAssembler; // recycles the Jacobian sparsity pattern
 
 
   
@@ -49,6 +50,11 @@ class PhotomFit {
     algebra. */
   bool Minimize(const std::string &WhatToFit);
 
+  //! Iterates damped (Levenberg-Marquardt) steps until convergence, with outlier rejection at NSigRejCut (if >0) in between.
+  /*! Return codes are the ones of AstromFit::MinimizeLM. */
+  unsigned MinimizeLM(const std::string &WhatToFit, const double NSigRejCut=0,
+		      const unsigned MaxIter=20, const double Chi2Tol=1e-4);
+
   //! Derivatives of the Chi2
   void LSDerivatives(TripletList &TList, Eigen::VectorXd &Rhs) const;
 
@@ -77,6 +83,12 @@ void LSDerivatives(const CcdImage &Ccd,
   template <class ListType, class Accum>
     void AccumulateStat(ListType &L, Accum &A) const;
 
+  //! Counts the triplets and measurement blocks LSDerivatives will produce.
+  void CountTriplets(size_t &NEntries, size_t &NBlocks) const;
+
+  //! Hessian (J*Jt) and gradient for the current WhatToFit setting. Grad should come in zeroed.
+  void HessianAndGradient(Eigen::SparseMatrix<double> &Hessian, Eigen::VectorXd &Grad);
+
 
   void OutliersContributions(MeasuredStarList &Outliers,
 			     TripletList &TList,
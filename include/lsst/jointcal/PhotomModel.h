@@ -34,6 +34,9 @@ public :
 					std::vector<unsigned> &Indices,
 					Eigen::VectorXd &D) = 0;
 
+  //! Number of parameters GetIndicesAndDerivatives provides for measurements of Ccd.
+  virtual unsigned GetNpar(const CcdImage &Ccd) const = 0;
+
 
   virtual ~PhotomModel() {};
 
@@ -0,0 +1,62 @@
+// This may look like C code, but it is really -*- C++ -*-
+#ifndef REFCATALOG__H
+#define REFCATALOG__H
+
+#include <vector>
+
+#include "lsst/jointcal/BaseStar.h"
+#include "lsst/jointcal/Frame.h"
+
+namespace lsst {
+namespace jointcal {
+
+  class TanPix2RaDec;
+
+//! A reference catalog, read once and indexed, meant to be shared by many MatchExposure calls.
+/*! Stars are stored in (ra,dec) degrees, sorted in declination bands
+  and by ra within each band, so that a region query only scans the
+  relevant stars. Queries return copies, sorted by decreasing flux (the
+  order used by the combinatorial matchers), so that the catalog itself
+  is never altered and can be queried concurrently. */
+class RefCatalog
+{
+  std::vector<CountedRef<BaseStar> > _stars; // sorted by band, then ra
+  std::vector<double> _ra; // ra of the above, for binary searches
+  std::vector<unsigned> _bandStart; // index of the first star of every band (+ end)
+  Frame _frame; // the sky region read
+  double _decMin, _bandHeight;
+
+ public :
+  //! Reads (once) the reference stars in the given sky region, the way UsnoCollect does.
+  RefCatalog(const double RaMin, const double RaMax,
+	     const double DecMin, const double DecMax);
+
+  //! Indexes a catalog provided by the caller. x and y are ra and dec (degrees).
+  RefCatalog(const BaseStarList &SkyStars);
+
+  //! Stars within SkyFrame, in (ra,dec). Handles frames extending beyond ra=0 or ra=360.
+  /*! Throws if SkyFrame is not entirely covered by the catalog (see Covers). */
+  void Query(const Frame &SkyFrame, BaseStarList &Out) const;
+
+  //! Same as UsnoCollect: stars within SkyFrame, transported through the inverse of Wcs.
+  bool Collect(const Frame &SkyFrame, const TanPix2RaDec &Wcs, BaseStarList &Out) const;
+
+  //! Whether SkyFrame lies within the sky region covered by the catalog (modulo 360 in ra).
+  bool Covers(const Frame &SkyFrame) const;
+
+  //! The sky region covered by the catalog.
+  const Frame& SkyFrame() const { return _frame;}
+
+  unsigned size() const { return _stars.size();}
+
+ private :
+  void build_index(const BaseStarList &SkyStars);
+  void query_ra_range(const double RaMin, const double RaMax,
+		      const double DecMin, const double DecMax,
+		      const double RaShift, BaseStarList &Out) const;
+
+};
+
+}} // end of namespaces
+
+#endif /* REFCATALOG__H */
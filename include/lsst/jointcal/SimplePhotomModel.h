@@ -3,7 +3,7 @@
 
 #include "lsst/jointcal/Eigenstuff.h"
 #include "lsst/jointcal/PhotomModel.h"
-#include <map>
+#include <vector>
 
 namespace lsst {
 namespace jointcal {
@@ -22,11 +22,12 @@ class Point;
     unsigned index;
     double factor;
     bool fixed;
-  PhotomStuff(const unsigned I=0, const double F=1) : index(I), factor(F), fixed(false) {};
+    const CcdImage *ccdImage; // NULL for CcdImage's absent from the model
+  PhotomStuff(const unsigned I=0, const double F=1) : index(I), factor(F), fixed(false), ccdImage(NULL) {};
   };
 
-  typedef std::map<const CcdImage*,PhotomStuff> mapType;
-  mapType _myMap;
+  typedef std::vector<PhotomStuff> mapType;
+  mapType _myMap; // indexed by CcdImage::Index()
 
   PhotomStuff& find(const CcdImage &C);
   const PhotomStuff& find(const CcdImage &C) const;
@@ -51,6 +52,9 @@ public :
 					std::vector<unsigned> &Indices,
 					Eigen::VectorXd &D);
 
+  //! 1, or 0 if the factor of Ccd is fixed.
+  unsigned GetNpar(const CcdImage &Ccd) const;
+
 };
 
 
@@ -25,10 +25,9 @@ class SimpleGtransfoMapping : public Mapping
      some routines in Mapping and Gtransfo have the same name */
   std::shared_ptr<Gtransfo> transfo;
 
+  /* The const routines only use stack temporaries (see Mapping.h),
+     so that they can be called from several threads at once */
   std::shared_ptr<Gtransfo> errorProp;
-  /* to avoid allocation at every call of PosDerivatives.
-     use a pointer for constness */
-  std::unique_ptr<GtransfoLin> lin;
 
 
 #ifdef STORAGE
@@ -40,12 +39,11 @@ class SimpleGtransfoMapping : public Mapping
 
  public :
 
- SimpleGtransfoMapping(const Gtransfo &T, bool ToFit=true) : toFit(ToFit), transfo(T.Clone()), errorProp(transfo), lin(new GtransfoLin)
+ SimpleGtransfoMapping(const Gtransfo &T, bool ToFit=true) : toFit(ToFit), transfo(T.Clone()), errorProp(transfo)
   {
     // in this order:
     // take a copy of the input transfo,
     // assign the transformation used to propagate errors to the transfo itself
-    // reserve some memory space to compute the derivatives (efficiency).
   }
 
   virtual void FreezeErrorScales()
@@ -86,17 +84,18 @@ class SimpleGtransfoMapping : public Mapping
   void  PosDerivative(const Point &Where, Eigen::Matrix2d &Der,
 		      const double & Eps) const
   {
-    errorProp->Derivative(Where, *lin, Eps);
-    Der(0,0) = lin->Coeff(1,0,0);
+    double a11, a12, a21, a22;
+    errorProp->DerivativeMatrix(Where, a11, a12, a21, a22, Eps);
+    Der(0,0) = a11;
     //
     /* This does not work : it was proved by rotating the frame
        see the compilation switch ROTATE_T2 in constrainedpolymodel.cc
-    Der(1,0) = lin->Coeff(1,0,1);
-    Der(0,1) = lin->Coeff(0,1,0);
+    Der(1,0) = a21;
+    Der(0,1) = a12;
     */
-    Der(1,0) = lin->Coeff(0,1,0);
-    Der(0,1) = lin->Coeff(1,0,1);
-    Der(1,1) = lin->Coeff(0,1,1);
+    Der(1,0) = a12;
+    Der(0,1) = a21;
+    Der(1,1) = a22;
   }
 
   //!
@@ -111,12 +110,24 @@ class SimpleGtransfoMapping : public Mapping
   //!
   void  SetIndex(unsigned I) {index=I;}
   
-  virtual void ComputeTransformAndDerivatives(const FatPoint &Where,
-					      FatPoint &OutPos,
-					      Eigen::MatrixX2d &H) const
+  //! Writes the parameter derivatives into H (through TransformAndParamDerivatives).
+  void ComputeTransformAndDerivatives(const FatPoint &Where,
+				      FatPoint &OutPos,
+				      Eigen::MatrixX2d &H) const
+  {
+    TransformAndParamDerivatives(Where, OutPos, &H(0,0), &H(0,1));
+  }
+
+  //! Same as ComputeTransformAndDerivatives, with the derivatives of xout and yout w.r.t. parameters written at Hx and Hy.
+  /*! Hx and Hy should have room for Npar() values each. This is the
+    routine derived classes overload. It allows TwoTransfoMapping to
+    have the derivatives of both its mappings written into its own H. */
+  virtual void TransformAndParamDerivatives(const FatPoint &Where,
+					    FatPoint &OutPos,
+					    double *Hx, double *Hy) const
   {
     TransformPosAndErrors(Where,OutPos);
-    transfo->ParamDerivatives(Where, &H(0,0), &H(0,1));
+    transfo->ParamDerivatives(Where, Hx, Hy);
   }
 
   //! Access to the (fitted) transfo
@@ -135,7 +146,8 @@ class SimplePolyMapping : public SimpleGtransfoMapping
   
   /* Where we store the combination. We use a pointer for
   constness. Could not get it to work with smart pointers.
-  */
+  Only used by Transfo(), which is not meant to be called
+  concurrently. */
   GtransfoPoly* actualResult;
 
  public:
@@ -175,41 +187,59 @@ class SimplePolyMapping : public SimpleGtransfoMapping
 		      const double & Eps) const
   {
     Point tmp = _centerAndScale.apply(Where);
-    errorProp->Derivative(tmp, *lin, Eps);
-    Der(0,0) = lin->Coeff(1,0,0);
-    //
-    /* This does not work : it was proved by rotating the frame
-       see the compilation switch ROTATE_T2 in constrainedpolymodel.cc
-    Der(1,0) = lin->Coeff(1,0,1);
-    Der(0,1) = lin->Coeff(0,1,0);
-    */
-    Der(1,0) = lin->Coeff(0,1,0);
-    Der(0,1) = lin->Coeff(1,0,1);
-    Der(1,1) = lin->Coeff(0,1,1);
+    double a11, a12, a21, a22;
+    errorProp->DerivativeMatrix(tmp, a11, a12, a21, a22, Eps);
+    // same convention as SimpleGtransfoMapping::PosDerivative
+    Der(0,0) = a11;
+    Der(1,0) = a12;
+    Der(0,1) = a21;
+    Der(1,1) = a22;
     Der = preDer*Der;
   }
 
 
 
   //! Calls the transforms and implements the centering and scaling of coordinates
-  /* We should put the computation of error propagation and
-     parameter derivatives into the same Gtransfo routine because
-     it could be significantly faster */
-  virtual void ComputeTransformAndDerivatives(const FatPoint &Where,
-					      FatPoint &OutPos,
-					      Eigen::MatrixX2d &H) const
+  void TransformAndParamDerivatives(const FatPoint &Where,
+				    FatPoint &OutPos,
+				    double *Hx, double *Hy) const
     {
-      FatPoint mid;
-      _centerAndScale.TransformPosAndErrors(Where,mid);
-      transfo->TransformPosAndErrors(mid,OutPos);
-      FatPoint tmp;
-      errorProp->TransformPosAndErrors(mid,tmp);
-      OutPos.vx = tmp.vx;
-      OutPos.vy = tmp.vy;
-      OutPos.vxy = tmp.vxy;
-      transfo->ParamDerivatives(mid, &H(0,0), &H(0,1));
+      TransformAndDerivatives(Where, OutPos, Hx, Hy, NULL);
     }
 
+  //! Everything TwoTransfoMapping needs at once, without any allocation.
+  /*! Same position and errors as TransformPosAndErrors. If Hx is not
+    NULL, the derivatives of xout and yout w.r.t. the parameters are
+    written at Hx and Hy (Npar() values each). If PosDer is not NULL,
+    it receives the same derivative as PosDerivative. */
+  void TransformAndDerivatives(const FatPoint &Where, FatPoint &OutPos,
+			       double *Hx, double *Hy,
+			       Eigen::Matrix2d *PosDer) const
+  {
+    FatPoint mid;
+    _centerAndScale.TransformPosAndErrors(Where,mid);
+    // Cannot fail given the contructor (and FreezeErrorScales):
+    const GtransfoPoly &poly = static_cast<const GtransfoPoly&>(*transfo);
+    const GtransfoPoly &err = static_cast<const GtransfoPoly&>(*errorProp);
+    FatPoint res; // nothing forbids &Where == &OutPos
+    poly.apply(mid.x, mid.y, res.x, res.y);
+    double a11, a12, a21, a22;
+    err.DerivativeMatrix(mid, a11, a12, a21, a22);
+    // same as GtransfoPoly::TransformPosAndErrors
+    res.vx = a11*(a11*mid.vx + 2*a12*mid.vxy) + a12*a12*mid.vy;
+    res.vy = a21*a21*mid.vx + a22*a22*mid.vy + 2.*a21*a22*mid.vxy;
+    res.vxy = a21*a11*mid.vx + a22*a12*mid.vy + (a21*a12+a11*a22)*mid.vxy;
+    if (Hx) poly.ParamDerivatives(mid, Hx, Hy);
+    if (PosDer)
+      {
+	Eigen::Matrix2d der;
+	// same (transposed) convention as PosDerivative
+	der << a11, a21, a12, a22;
+	PosDer->noalias() = preDer*der;
+      }
+    OutPos = res;
+  }
+
   //! Implements as well the centering and scaling of coordinates
   void TransformPosAndErrors(const FatPoint &Where,
 			     FatPoint &OutPos) const
@@ -236,6 +266,111 @@ class SimplePolyMapping : public SimpleGtransfoMapping
 
 };
 
+//! Mapping implementation for a GtransfoChebyshev.
+/*! The domain normalization is part of the transfo, so that there is
+  no need for the _centerAndScale trick of SimplePolyMapping. The basis
+  functions are evaluated once per call, and serve for the position,
+  the error propagation and the parameter derivatives. Since they only
+  depend on the measured position, they can also be evaluated once
+  per measurement (CacheBasis) and reused at every fit iteration. */
+class SimpleChebyshevMapping : public SimpleGtransfoMapping
+{
+  /* basis values and their x and y derivatives (3*NTerms() values
+     per measurement), at the positions stored in basisWhere. Only
+     written by CacheBasis, so the const routines remain usable from
+     several threads. */
+  std::vector<double> basisCache;
+  std::vector<Point> basisWhere;
+
+  /* Output position and errors and parameter derivatives from the basis
+     values B and their derivatives Bx and By, at Where. Hx may be B. */
+  void apply_basis(const FatPoint &Where, const double *B,
+		   const double *Bx, const double *By,
+		   FatPoint &OutPos, double *Hx, double *Hy) const
+  {
+    const GtransfoChebyshev &cheb = static_cast<const GtransfoChebyshev&>(*transfo);
+    // errorProp is either transfo itself or a frozen copy of it
+    const GtransfoChebyshev &errCheb = static_cast<const GtransfoChebyshev&>(*errorProp);
+    unsigned nterms = cheb.NTerms();
+    /* The parameter derivatives are the basis values (see
+       GtransfoChebyshev::ParamDerivatives). */
+    for (unsigned k=0; k<nterms; ++k)
+      {
+	Hx[k] = Hy[nterms+k] = B[k];
+	Hx[nterms+k] = Hy[k] = 0;
+      }
+    FatPoint res; // nothing forbids &Where == &OutPos
+    cheb.ApplyBasis(B, res.x, res.y);
+    double a11, a12, a21, a22;
+    errCheb.ApplyBasis(Bx, a11, a21);
+    errCheb.ApplyBasis(By, a12, a22);
+    // same as GtransfoChebyshev::TransformPosAndErrors
+    res.vx = a11*(a11*Where.vx + 2*a12*Where.vxy) + a12*a12*Where.vy;
+    res.vy = a21*a21*Where.vx + a22*a22*Where.vy + 2.*a21*a22*Where.vxy;
+    res.vxy = a21*a11*Where.vx + a22*a12*Where.vy + (a21*a12+a11*a22)*Where.vxy;
+    OutPos = res;
+  }
+
+ public:
+
+  SimpleChebyshevMapping(const GtransfoChebyshev& Transfo) :
+    SimpleGtransfoMapping(Transfo)
+  {
+    // check of matrix indexing (once for all)
+    MatrixX2d H(3,2);
+    assert((&H(1,0) - &H(0,0)) == 1);
+  }
+
+  //! Evaluates and stores the basis at the positions of Catalog, in catalog order.
+  /*! The basis does not depend on the parameters, and the fitting
+    loops then only read it back (see ComputeTransformAndDerivatives
+    with a Rank). Costs 3*NTerms() doubles per measurement. */
+  void CacheBasis(const MeasuredStarList &Catalog)
+  {
+    const GtransfoChebyshev &cheb = static_cast<const GtransfoChebyshev&>(*transfo);
+    unsigned nterms = cheb.NTerms();
+    basisWhere.clear();
+    basisCache.resize(3*nterms*Catalog.size());
+    double *b = basisCache.data();
+    for (auto i = Catalog.begin(); i != Catalog.end(); ++i, b += 3*nterms)
+      {
+	basisWhere.push_back(**i);
+	cheb.ComputeBasis(**i, b, b+nterms, b+2*nterms);
+      }
+  }
+
+  void TransformAndParamDerivatives(const FatPoint &Where,
+				    FatPoint &OutPos,
+				    double *Hx, double *Hy) const
+  {
+    unsigned nterms = static_cast<const GtransfoChebyshev&>(*transfo).NTerms();
+    // the basis values are computed in place
+    double *b = Hx;
+    double bxy[2*nterms]; // VLA, as in GtransfoPoly
+    static_cast<const GtransfoChebyshev&>(*transfo).ComputeBasis(Where, b, bxy, bxy+nterms);
+    apply_basis(Where, b, bxy, bxy+nterms, OutPos, Hx, Hy);
+  }
+
+  using SimpleGtransfoMapping::ComputeTransformAndDerivatives;
+
+  //! Uses the basis cached by CacheBasis if it was evaluated at Where.
+  void ComputeTransformAndDerivatives(const FatPoint &Where,
+				      FatPoint &OutPos,
+				      Eigen::MatrixX2d &H,
+				      const unsigned Rank) const
+  {
+    if (Rank < basisWhere.size() && basisWhere[Rank].x == Where.x
+	&& basisWhere[Rank].y == Where.y)
+      {
+	unsigned nterms = static_cast<const GtransfoChebyshev&>(*transfo).NTerms();
+	const double *b = &basisCache[3*nterms*Rank];
+	apply_basis(Where, b, b+nterms, b+2*nterms, OutPos, &H(0,0), &H(0,1));
+      }
+    else ComputeTransformAndDerivatives(Where, OutPos, H);
+  }
+
+};
+
 
 #ifdef STORAGE
 /*! "do nothing" mapping. The Ccdimage's that "use" this one impose the
@@ -9,7 +9,7 @@
 #include "lsst/jointcal/Gtransfo.h"
 #include "lsst/jointcal/SimplePolyMapping.h"
 #include "lsst/jointcal/Projectionhandler.h"
-#include <map>
+#include <vector>
 
 namespace lsst {
 namespace jointcal {
@@ -30,18 +30,25 @@ class SimplePolyModel : public DistortionModel
 {
   /* using ref counts here allows us to not write a destructor nor a copy
      constructor. I could *not* get it to work using std::auto_ptr. */
-  typedef std::map<const CcdImage*, std::unique_ptr<SimpleGtransfoMapping> > mapType;
-  mapType _myMap;
+  typedef std::vector<std::unique_ptr<SimpleGtransfoMapping> > mapType;
+  mapType _myMap; // indexed by CcdImage::Index(), NULL for ignored images
+  std::vector<const CcdImage*> _owners; // the CcdImage of each _myMap entry
   const ProjectionHandler* _sky2TP;
 
+  SimpleGtransfoMapping* find_mapping(const CcdImage &C) const;
+
 public :
 
   //! Sky2TP is just a name, it can be anything
+  /*! With Chebyshev, the distortions are expanded on Chebyshev
+    polynomials over the CCD frames (see GtransfoChebyshev) rather
+    than on monomials, which is advised for degrees beyond 5. */
   SimplePolyModel(const CcdImageList &L,
 		  const ProjectionHandler* ProjH,
 		  bool InitFromWCS,
 		  unsigned NNotFit=0,
-          unsigned degree=3);
+          unsigned degree=3,
+		  bool Chebyshev=false);
 
   // The following routines are the interface to AstromFit
   //!
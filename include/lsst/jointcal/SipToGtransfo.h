@@ -1,6 +1,8 @@
 #ifndef SIPTOGTRANSFO__H
 #define SIPTOGTRANSFO__H
 
+#include <vector>
+
 #include "lsst/afw/image/TanWcs.h"
 #include "lsst/jointcal/Gtransfo.h"
 
@@ -19,6 +21,25 @@ TanSipPix2RaDec ConvertTanWcs(const boost::shared_ptr<lsst::afw::image::TanWcs>
    GtransfoToTanWcs(const lsst::jointcal::TanSipPix2RaDec WcsTransfo,
 		    const lsst::jointcal::Frame &CcdFrame,
 		    const bool NoLowOrderSipTerms=false);
+
+//! Conversions by the two routines above are cached (keyed on WCS content). This empties the caches.
+void ClearWcsConversionCaches();
+
+  class DistortionModel;
+  class CcdImageList;
+
+//! GtransfoToTanWcs of Model.ProduceSipWcs(), for all CcdImages of L, in the same order.
+/*! Model.ProduceSipWcs() is called by the calling thread. The SIP
+  polynomials (including the inverse ones, which dominate the cost)
+  are then computed concurrently by NThreads threads (0 : as many as
+  cores). The TanWcs's themselves are then built by the calling
+  thread. Entries are NULL for CcdImages for which the model cannot
+  produce a SIP WCS. */
+std::vector<PTR(lsst::afw::image::TanWcs)>
+  ProduceTanWcsList(const DistortionModel &Model,
+		    const CcdImageList &L,
+		    const bool NoLowOrderSipTerms=false,
+		    const unsigned NThreads=0);
     
 }} // end of namespaces
 
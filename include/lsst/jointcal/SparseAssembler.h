@@ -0,0 +1,204 @@
+#ifndef SPARSEASSEMBLER__H
+#define SPARSEASSEMBLER__H
+
+#include "Eigen/Sparse"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <functional>
+#include <cmath>
+
+#include "lsst/jointcal/Tripletlist.h"
+#include "lsst/jointcal/Chi2.h"
+
+namespace lsst {
+namespace jointcal {
+
+
+//! Converts triplet lists into a sparse matrix, recycling the sparsity pattern across calls.
+/*! The first assembly goes through Eigen's setFromTriplets, and
+  records, for every triplet, the slot it lands into in the
+  compressed storage. Later assemblies with the same pattern
+  (same dimensions and same (row,col) sequence of triplets) just
+  zero the values and accumulate the triplet values into their
+  slots: no sort. If the pattern changed (e.g. because outliers were
+  discarded), the assembly starts over from scratch.
+  The matrix is owned by the assembler. The pattern is stored apart
+  from it, so that the matrix (in particular its values) can be freed
+  with ReleaseMatrix() once used, e.g. before factorizing J*Jt, while
+  the pattern survives until the next assembly. */
+class SparseAssembler
+{
+  typedef Eigen::SparseMatrix<double> MatrixType;
+
+  MatrixType _matrix;
+  // the cached pattern :
+  unsigned _rows, _cols;
+  std::vector<int> _outer, _inner; // the compressed storage indices
+  std::vector<int> _slots; // triplet -> position in the compressed storage
+  unsigned _nRecycled;
+
+  bool Refill(const TripletList &TList);
+  void Build(const TripletList &TList, const unsigned NRows, const unsigned NCols);
+
+ public :
+  SparseAssembler() : _rows(0), _cols(0), _nRecycled(0) {};
+
+  //! Assembles the triplets into a NRows x NCols matrix. Duplicates are summed.
+  const MatrixType& Assemble(const TripletList &TList,
+			     const unsigned NRows, const unsigned NCols);
+
+  //! The last assembled matrix.
+  const MatrixType& Matrix() const { return _matrix;}
+
+  //! how many times the cached pattern was recycled.
+  unsigned NRecycled() const { return _nRecycled;}
+
+  //! frees the matrix, but keeps the cached pattern. Matrix() is then empty.
+  void ReleaseMatrix();
+
+  //! frees the matrix and the cached pattern.
+  void Release();
+};
+
+//! Marquardt damping of a Hessian: H_kk = (1+Lambda)*max(Diag_k, floor).
+/*! Diag is the undamped diagonal. The (tiny) floor keeps parameters
+  that no term constrains from making the damped system singular. All diagonal terms are assumed to
+  be present in H, so that the sparsity pattern is left unchanged and
+  the symbolic analysis of the factorization can be recycled. */
+void DampDiagonal(Eigen::SparseMatrix<double> &H, const Eigen::VectorXd &Diag,
+		  const double Lambda);
+
+//! What LevenbergMarquardt needs from a fit (AstromFit, PhotomFit).
+struct LMFitCallbacks
+{
+  //! Hessian (J*Jt) and gradient at the current parameters. Grad comes in zeroed.
+  std::function<void(Eigen::SparseMatrix<double> &Hessian, Eigen::VectorXd &Grad)> HessianAndGradient;
+  //! chi2 at the current parameters.
+  std::function<Chi2()> ComputeChi2;
+  //! offsets the parameters (in the layout of the Hessian).
+  std::function<void(const Eigen::VectorXd &Delta)> OffsetParams;
+  //! removes the outliers beyond NSigCut from the fit, and returns their number.
+  std::function<unsigned(const double NSigCut)> RemoveOutliers;
+};
+
+//! Levenberg-Marquardt iterations, shared by AstromFit::MinimizeLM and PhotomFit::MinimizeLM.
+/*! Each iteration computes derivatives once and factorizes the
+  (damped) Hessian with a Solver (an Eigen sparse LDLt-like
+  decomposition), recycling the symbolic analysis when the damping
+  has to be raised. Steps go through a backtracking line search (full
+  step, then halved twice). Damping starts at 0 (the problems are
+  almost linear), goes to 1e-3 and then x10 when chi2 goes up, and is
+  relaxed by x0.1 after an accepted step (down to 0 below 1e-6).
+  Outliers (if NSigRejCut>0) are removed in between iterations.
+  Convergence is declared when no outliers were removed and either
+  the relative variation of chi2/ndof or the expected chi2 decrease
+  of the step (relative to chi2) falls below Chi2Tol.
+  return code:
+  0 : fit has converged - no more outliers
+  1 : chi2 could not be decreased, even with strong damping
+  2 : factorization failed
+  3 : MaxIter reached before convergence
+  Name prefixes the log messages. */
+template <class Solver>
+unsigned LevenbergMarquardt(const LMFitCallbacks &Fit, const unsigned NPar,
+			    const std::string &Name,
+			    const double NSigRejCut,
+			    const unsigned MaxIter,
+			    const double Chi2Tol)
+{
+  typedef Eigen::SparseMatrix<double> SpMat;
+  double lambda = 0;
+  const double maxLambda = 1e4;
+  Chi2 current = Fit.ComputeChi2();
+  unsigned tot_outliers = 0;
+  unsigned nFactor = 0;
+
+  for (unsigned iter = 0; iter < MaxIter; ++iter)
+    {
+      Eigen::VectorXd grad(NPar);  grad.setZero();
+      SpMat hessian;
+      Fit.HessianAndGradient(hessian, grad);
+      // make sure that the diagonal is part of the pattern
+      for (int k=0; k<hessian.outerSize(); ++k) hessian.coeffRef(k,k) += 0;
+      hessian.makeCompressed();
+      Eigen::VectorXd diag = hessian.diagonal();
+
+      Solver chol;
+      chol.analyzePattern(hessian);
+
+      Chi2 before = current;
+      double stepSize = 0;
+      bool accepted = false;
+      while (!accepted)
+	{
+	  if (lambda > 0) DampDiagonal(hessian, diag, lambda);
+	  chol.factorize(hessian);
+	  nFactor++;
+	  if (chol.info() != Eigen::Success)
+	    {
+	      std::cout << "ERROR: " << Name << " : factorization failed " << std::endl;
+	      return 2;
+	    }
+	  Eigen::VectorXd delta = chol.solve(grad);
+	  // backtracking line search : full step, then halve it.
+	  double applied = 0;
+	  double scale = 1;
+	  for (unsigned ls = 0; ls < 3; ++ls, scale *= 0.5)
+	    {
+	      Fit.OffsetParams((scale-applied)*delta);
+	      applied = scale;
+	      Chi2 trial = Fit.ComputeChi2();
+	      if (trial.chi2 <= before.chi2)
+		{
+		  current = trial;
+		  accepted = true;
+		  // expected chi2 decrease of the step.
+		  stepSize = scale*delta.dot(grad);
+		  break;
+		}
+	    }
+	  if (accepted) break;
+	  // back to where we were, and damp more.
+	  Fit.OffsetParams(-applied*delta);
+	  lambda = (lambda == 0) ? 1e-3 : lambda*10;
+	  std::cout << "INFO: " << Name << " : chi2 went up, lambda = " << lambda << std::endl;
+	  if (lambda > maxLambda)
+	    {
+	      std::cout << "WARNING: " << Name << " : chi2 cannot be decreased, giving up" << std::endl;
+	      return 1;
+	    }
+	}
+      // the step was accepted: relax the damping
+      lambda = (lambda > 1e-6) ? lambda*0.1 : 0;
+      std::cout << "INFO: iteration " << iter << ' ' << current << std::endl;
+
+      double oldRed = before.chi2/before.ndof;
+      double newRed = current.chi2/current.ndof;
+      bool converged = (std::fabs(oldRed-newRed) < Chi2Tol*newRed ||
+			stepSize < Chi2Tol*current.chi2);
+
+      unsigned n_outliers = 0;
+      if (NSigRejCut > 0)
+	{
+	  n_outliers = Fit.RemoveOutliers(NSigRejCut);
+	  tot_outliers += n_outliers;
+	  if (n_outliers) current = Fit.ComputeChi2();
+	}
+      if (converged && n_outliers == 0)
+	{
+	  std::cout << "INFO: " << Name << " converged after " << iter+1
+		    << " iterations, " << nFactor << " factorizations, "
+		    << tot_outliers << " outliers" << std::endl;
+	  return 0;
+	}
+    }
+  std::cout << "WARNING: " << Name << " : no convergence after "
+	    << MaxIter << " iterations (" << tot_outliers << " outliers)" << std::endl;
+  return 3;
+}
+
+}} // end of namespaces
+
+#endif /* SPARSEASSEMBLER__H */
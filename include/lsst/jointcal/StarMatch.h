@@ -7,6 +7,7 @@
 #include <algorithm> // for swap
 #include <string>
 #include <list>
+#include <vector>
 
 #include "lsst/jointcal/Point.h"
 #include "lsst/jointcal/CountedRef.h"
@@ -169,6 +170,52 @@ capabilities.  NStarMatchList is a generalization of this 2-match to n-matches.
 std::ostream& operator << (std::ostream &stream, const StarMatchList &List);
 #endif
 
+class StarMatchList;
+
+//! A contiguous copy of the points of a StarMatchList, for residual and chi2 computations.
+/*! Coordinates and variances are stored as separate arrays (structure
+  of arrays), so that loops over matches do not chase list pointers,
+  and the first points of all matches are transformed by a single call
+  to Gtransfo::TransformArrays. Per-match outputs are in list order.
+  The object owns its work arrays, so that reloading it for a list of
+  similar size does not allocate, and it only has to be reloaded when
+  the list changes. */
+class StarMatchArrays {
+
+  std::vector<double> x1, y1, vx1, vy1, vxy1;
+  std::vector<double> x2, y2, vx2, vy2, vxy2;
+  std::vector<double> tx, ty, tvx, tvy, tvxy; // transformed first points
+
+ public :
+  StarMatchArrays() {}
+
+  explicit StarMatchArrays(const StarMatchList &L) { Load(L);}
+
+  //! copies the points of L.
+  void Load(const StarMatchList &L);
+
+  unsigned size() const { return x1.size();}
+
+  //! squared distances from T(p1) to p2.
+  void Dist2(const Gtransfo &T, std::vector<double> &Out);
+
+  //! chi2's of the matches, as StarMatch::Chi2 computes them.
+  void Chi2(const Gtransfo &T, std::vector<double> &Out);
+
+  //! chi2's and squared distances, with a single transformation.
+  void Chi2AndDist2(const Gtransfo &T, std::vector<double> &Chi2s,
+		    std::vector<double> &Dist2s);
+
+  //! sum of squared distances.
+  double SumDist2(const Gtransfo &T);
+
+  //! sum of chi2's.
+  double SumChi2(const Gtransfo &T);
+
+ private :
+  void transform(const Gtransfo &T, const bool WithErrors);
+};
+
 class StarMatchList : public std::list<StarMatch> {
 
   private :
@@ -272,6 +319,16 @@ class StarMatchList : public std::list<StarMatch> {
   //! computes the chi2 even when there is no fit.
   void SetChi2();
 
+  //! sorts and removes the ambiguities, using the distances already set.
+  unsigned remove_ambiguities(const int Which);
+
+#ifndef SWIG
+  /* work arrays of RefineTransfo, SetDistance and SetChi2, kept from
+     call to call so that their storage is reused. */
+  StarMatchArrays arrays;
+  std::vector<double> chi2s, dist2s, work;
+#endif
+
 
 
   StarMatchList(const StarMatchList&); // copies nor properly handled
@@ -280,6 +337,9 @@ class StarMatchList : public std::list<StarMatch> {
 
 };
 
+//! median of Values, using partial sorting. Work is used as scratch.
+double Median(const std::vector<double> &Values, std::vector<double> &Work);
+
 //! r.m.s of 1 dim residual plots (corrected for fit d.o.f)
 double FitResidual(const double Dist2, const StarMatchList &S, const Gtransfo &T);
 
@@ -292,5 +352,9 @@ double ComputeDist2(const StarMatchList &S, const Gtransfo &T);
 //! the actual chi2
 double ComputeChi2(const StarMatchList &L, const Gtransfo &T);
 
+//! same as above, with caller-provided work arrays, to be reused across calls.
+double ComputeChi2(const StarMatchList &L, const Gtransfo &T,
+		   StarMatchArrays &Arrays);
+
 }} // end of namespaces
 #endif /* STARMATCH__H */
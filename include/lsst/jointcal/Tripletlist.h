@@ -4,24 +4,66 @@
 #include "Eigen/Sparse"
 
 #include <vector>
+#include <cassert>
+#include <stdint.h>
 
 namespace lsst {
 namespace jointcal {
 
 
-typedef Eigen::Triplet<double> Trip;
+/* Jacobian entries are staged in double by default, i.e. 12 bytes
+   per entry (a 32 bit row and the value), instead of the 16 bytes of
+   an Eigen::Triplet<double>. Compiling with -DFLOAT_JACOBIAN stages
+   them in float, i.e. 8 bytes per entry, half of the Eigen triplet
+   footprint. The gradient is always accumulated in
+   double, so that this only affects the Hessian, not the solution
+   the fit converges to. */
+#ifdef FLOAT_JACOBIAN
+typedef float TripletValue;
+#else
+typedef double TripletValue;
+#endif
 
-// at the moment this class implements the eigen format.
-// it would be wise to implement it differently if talking to cholmod
-class TripletList : public std::vector<Trip>
+//! Compact storage of the Jacobian entries produced by the LSDerivatives routines.
+/*! Triplets come in blocks that address at most 2 consecutive
+  columns (i.e. the terms of a given measurement). The column is hence
+  stored once per block, and every entry only carries its row (a 32 bit
+  index, whose top bit tells which of the 2 columns it belongs to) and
+  its value. Iterating provides entries with row(), col() and value()
+  accessors, so that a TripletList can be handed over directly to
+  Eigen's setFromTriplets. */
+class TripletList
 {
+  struct Block
+  {
+    unsigned start; // first entry of the block
+    unsigned col;
+    Block(const unsigned Start, const unsigned Col) : start(Start), col(Col) {};
+  };
+
+  std::vector<uint32_t> _rows;
+  std::vector<TripletValue> _values;
+  std::vector<Block> _blocks;
   unsigned nextFreeIndex;
+
  public :
-  TripletList(int Count) {nextFreeIndex = 0; reserve(Count);};
-    
+  TripletList(int Count) {nextFreeIndex = 0; Reserve(Count);};
+
+  //! The block count guess assumes that measurements have ~10 entries.
+  void Reserve(const size_t NEntries, const size_t NBlocks=0)
+  {
+    _rows.reserve(NEntries);
+    _values.reserve(NEntries);
+    _blocks.reserve((NBlocks) ? NBlocks : NEntries/10);
+  }
+
   void AddTriplet(const unsigned i, const unsigned j, double val)
   {
-    push_back(Trip(i,j,val));
+    assert(i < 0x80000000u);
+    if (_blocks.empty() || j < _blocks.back().col || j > _blocks.back().col+1)
+      _blocks.push_back(Block(_rows.size(), j));
+    _rows.push_back(i | ((j-_blocks.back().col) << 31));
+    _values.push_back(val);
   }
 
   unsigned NextFreeIndex() const
@@ -34,6 +76,47 @@ class TripletList : public std::vector<Trip>
     nextFreeIndex = Index;
   }
 
+  size_t size() const { return _rows.size();}
+
+  //! clears the entries, but keeps the allocated storage. Does not reset NextFreeIndex.
+  void clear() { _rows.clear(); _values.clear(); _blocks.clear();}
+
+  //! Memory used per entry (without block overhead).
+  static size_t EntrySize() { return sizeof(uint32_t)+sizeof(TripletValue);}
+
+  //! forward iterator over entries
+  class const_iterator
+  {
+    const TripletList *_l;
+    size_t _k;
+    size_t _b;
+
+  public :
+    const_iterator(const TripletList *L, const size_t K, const size_t B) :
+      _l(L), _k(K), _b(B) {};
+
+    int row() const { return _l->_rows[_k] & 0x7fffffffu;}
+    int col() const { return _l->_blocks[_b].col + (_l->_rows[_k] >> 31);}
+    double value() const { return _l->_values[_k];}
+
+    // setFromTriplets uses it->row() ...
+    const const_iterator* operator->() const { return this;}
+    const const_iterator& operator*() const { return *this;}
+
+    const_iterator& operator++()
+    {
+      ++_k;
+      if (_b+1 < _l->_blocks.size() && _k >= _l->_blocks[_b+1].start) ++_b;
+      return *this;
+    }
+
+    bool operator==(const const_iterator &R) const { return _k == R._k;}
+    bool operator!=(const const_iterator &R) const { return _k != R._k;}
+  };
+
+  const_iterator begin() const { return const_iterator(this, 0, 0);}
+  const_iterator end() const { return const_iterator(this, _rows.size(), 0);}
+
 };
 
 }} // end of namespaces
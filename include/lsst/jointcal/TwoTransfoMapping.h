@@ -12,17 +12,15 @@ namespace lsst {
 namespace jointcal {
 
 //! The mapping with two transfos in a row.
+/*! The derivatives of both transfos are written straight into the H
+  of the caller, so that this mapping holds no temporaries and can be
+  used from several threads at once. */
 class TwoTransfoMapping: public Mapping
 {
   SimpleGtransfoMapping *_m1, *_m2;
+  // both non NULL if both mappings are polynomials (see ComputeTransformAndDerivatives)
+  const SimplePolyMapping *_poly1, *_poly2;
   unsigned _nPar1, _nPar2;
-  struct tmpVars // just there to get around constness issues
-  {
-    Eigen::MatrixX2d h1,h2;
-    Eigen::Matrix2d dt2dx;
-  };
-
-  std::unique_ptr<tmpVars> tmp;
   
   // forbid copies
   TwoTransfoMapping(const TwoTransfoMapping&);
@@ -72,6 +70,9 @@ class TwoTransfoMapping: public Mapping
  void FreezeErrorScales();
 
  private:
+ void poly_transform_and_derivatives(const FatPoint &Where,
+				     FatPoint &OutPos,
+				     Eigen::MatrixX2d &H) const;
 
  friend class ConstrainedPolyModel;
  //!
@@ -44,7 +44,8 @@ import lsst.pex.exceptions as pexExceptions
 
 #from .dataIds import PerTractCcdDataIdContainer
 
-from lsst.jointcal.jointcalLib import JointcalControl, ExposureCatalog, PolyMappingArrangement, ChipArrangement, MatchExposure, Point
+from lsst.jointcal.jointcalLib import JointcalControl, ExposureCatalog, PolyMappingArrangement, ChipArrangement, MatchExposure, Point, RefCatalog, \
+    MatchExposures, ExposureCatalogList, PointList, ExposureSkyFrame, Frame
 
 __all__ = ["MatchExposureConfig", "MatchExposureTask"]
 
@@ -120,6 +121,18 @@ class MatchExposureConfig(pexConfig.Config):
         dtype = str,
         default = "base_SdssShape", 
     )
+    nThreads = pexConfig.Field(
+        doc = "Number of threads used to match visits concurrently (0: as many as cores). "
+              "Only used with a shared reference catalog (see refCatHalfSize)",
+        dtype = int,
+        default = 0,
+    )
+    refCatHalfSize = pexConfig.Field(
+        doc = "Half size (degrees on the sky) of the reference catalog region read once and reused for all "
+              "exposures within it (0: read the reference catalog for every exposure)",
+        dtype = float,
+        default = 0.,
+    )
 
 class MatchExposureTask(pipeBase.CmdLineTask):
  
@@ -130,6 +143,69 @@ class MatchExposureTask(pipeBase.CmdLineTask):
     def __init__(self, *args, **kwargs):
         pipeBase.Task.__init__(self, *args, **kwargs)
 #        self.makeSubtask("select")
+        self.refCat = None
+
+    def getRefCat(self, skyFrame):
+        """Return the shared reference catalog, (re)reading it if it does not cover skyFrame
+
+        The region read is centered on skyFrame, refCatHalfSize (on the sky) wide on every side,
+        or larger if skyFrame is larger.
+        """
+        halfSize = self.config.refCatHalfSize
+        if halfSize <= 0:
+            return None
+        if self.refCat is not None and self.refCat.Covers(skyFrame):
+            return self.refCat
+        center = skyFrame.Center()
+        cosDec = max(np.cos(np.radians(center.y)), 1e-3)
+        halfRa = max(halfSize/cosDec, skyFrame.Width()/2)
+        halfDec = max(halfSize, skyFrame.Height()/2)
+        self.refCat = RefCatalog(center.x-halfRa, center.x+halfRa,
+                                 max(center.y-halfDec, -90.), min(center.y+halfDec, 90.))
+        return self.refCat
+
+    def groupVisits(self, visits, skyFrames):
+        """Group the visits whose sky frames fit together in a reference catalog region (see refCatHalfSize)
+
+        Returns a list of [visit list, union of their sky frames].
+        """
+        halfSize = self.config.refCatHalfSize
+        groups = []
+        for v in visits:
+            for group in groups:
+                union = group[1] + skyFrames[v]
+                cosDec = max(np.cos(np.radians(union.Center().y)), 1e-3)
+                if union.Width()*cosDec <= 2*halfSize and union.Height() <= 2*halfSize:
+                    group[0].append(v)
+                    group[1] = union
+                    break
+            else:
+                groups.append([[v], skyFrames[v]])
+        return groups
+
+    def matchWithRefCats(self, visits, expCats, tangentPoints, astromControl):
+        """Match the visits, reading one reference catalog per group of visits it covers
+
+        Returns the solutions, indexed by visit.
+        """
+        sols = {}
+        skyFrames = dict((v, ExposureSkyFrame(expCats[v], tangentPoints[v])) for v in visits)
+        for group, skyFrame in self.groupVisits(visits, skyFrames):
+            refCat = self.getRefCat(skyFrame)
+            print "%d visit(s) share a reference catalog of %d stars"%(len(group), refCat.size())
+            if len(group) == 1:
+                sols[group[0]] = MatchExposure(expCats[group[0]], tangentPoints[group[0]], astromControl, refCat)
+                continue
+            # the visits of the group are matched concurrently
+            catList = ExposureCatalogList()
+            pointList = PointList()
+            for v in group :
+                catList.append(expCats[v])
+                pointList.append(tangentPoints[v])
+            groupSols = MatchExposures(catList, pointList, astromControl, refCat, self.config.nThreads)
+            for v, sol in zip(group, groupSols):
+                sols[v] = sol
+        return sols
 
 # We don't need to persist config and metadata at this stage. In this way, we don't need to put a specific entry in the
 # camera mapper policy file
@@ -167,16 +243,18 @@ class MatchExposureTask(pipeBase.CmdLineTask):
         # The file path has to come from the butler presumably. 
         # For the time being:
         chipArrangement = PolyMappingArrangement("my_arrangement.txt")
-        expCat = ExposureCatalog(chipArrangement)
-        tangentPoint = Point(-1,0)
+        # one catalog (and tangent point) per visit
+        expCats = {}
+        tangentPoints = {}
         
         for dataRef in ref :
             
             print dataRef.dataId
+            visit = dataRef.dataId["visit"]
             
             src = dataRef.get("src", immediate=True, flags=afwTable.SOURCE_IO_NO_FOOTPRINTS)
-            # pick a tangent point in the first image
-            if tangentPoint.x ==-1. :
+            # pick a tangent point in the first image of the visit
+            if visit not in tangentPoints :
                 md = dataRef.get("calexp_md", immediate=True)
                 ra = md.get("RA")
                 ra = afwGeom.radToDeg(float(afwCoord.hmsStringToAngle(ra)))
@@ -186,8 +264,9 @@ class MatchExposureTask(pipeBase.CmdLineTask):
 #                tanwcs = afwImage.TanWcs.cast(afwImage.makeWcs(md))
 #                tp = tanwcs.getSkyOrigin().getPosition()
 #                tangentPoint.x ,tangentPoint.y  = tp[0], tp[1]
-                tangentPoint.x ,tangentPoint.y  = ra, dec
-                print "assumed tangent point ra=%f dec=%f"%(tangentPoint.x, tangentPoint.y)
+                tangentPoints[visit] = Point(ra, dec)
+                expCats[visit] = ExposureCatalog(chipArrangement)
+                print "assumed tangent point ra=%f dec=%f"%(ra, dec)
 
             newSrc = ss.select(src, None)
             if len(newSrc) == 0 :
@@ -195,10 +274,15 @@ class MatchExposureTask(pipeBase.CmdLineTask):
                 continue
             print "%d sources selected in visit %d - ccd %d (out of %d)"%(len(newSrc), dataRef.dataId["visit"], dataRef.dataId["ccd"], len(src))
             
-            expCat.AddCalexp(newSrc, dataRef.dataId['ccd'], astromControl.sourceFluxField)
-
+            expCats[visit].AddCalexp(newSrc, dataRef.dataId['ccd'], astromControl.sourceFluxField)
 
-        sol = MatchExposure(expCat, tangentPoint, astromControl)
+        visits = sorted(expCats.keys())
+        if len(visits) == 0 :
+            return
+        if self.config.refCatHalfSize <= 0:
+            sols = dict((v, MatchExposure(expCats[v], tangentPoints[v], astromControl)) for v in visits)
+        else:
+            sols = self.matchWithRefCats(visits, expCats, tangentPoints, astromControl)
         # code to write WCS's here
 
 
@@ -72,6 +72,21 @@ class JointcalConfig(pexConfig.Config):
         dtype = int,
         default = 3,
     )
+    chebyshevDistortions = pexConfig.Field(
+        doc = "Expand distortions on Chebyshev polynomials rather than monomials (advised for polyOrder > 5)",
+        dtype = bool,
+        default = False,
+    )
+    jacobianMemoryMB = pexConfig.Field(
+        doc = "Memory budget (in MB) for staging the astrometric Jacobian (0 : no limit)",
+        dtype = int,
+        default = 0,
+    )
+    wcsExportThreads = pexConfig.Field(
+        doc = "Number of threads computing the output WCSs (0 : as many as cores)",
+        dtype = int,
+        default = 0,
+    )
     sourceFluxField = pexConfig.Field(
         doc = "Type of source flux",
         dtype = str,
@@ -203,9 +218,12 @@ class JointcalTask(pipeBase.CmdLineTask):
         assoc.SelectFittedStars()
         assoc.DeprojectFittedStars() # required for AstromFit
         sky2TP = jointcalLib.OneTPPerShoot(assoc.TheCcdImageList())
-        spm = jointcalLib.SimplePolyModel(assoc.TheCcdImageList(), sky2TP, True, 0, self.config.polyOrder)
+        spm = jointcalLib.SimplePolyModel(assoc.TheCcdImageList(), sky2TP, True, 0, self.config.polyOrder,
+                                          self.config.chebyshevDistortions)
 
         fit = jointcalLib.AstromFit(assoc, spm, self.config.posError)
+        if self.config.jacobianMemoryMB > 0 :
+            fit.SetJacobianMemoryBudget(self.config.jacobianMemoryMB*1024*1024)
         fit.Minimize("Distortions")
         chi2 = fit.ComputeChi2()
         print(chi2)
@@ -216,38 +234,30 @@ class JointcalTask(pipeBase.CmdLineTask):
         chi2 = fit.ComputeChi2()
         print(chi2)
 
-        for i in range(20) :
-            r = fit.Minimize("Distortions Positions",5) # outliers removal at 5 sigma.
-            chi2 = fit.ComputeChi2()
-            print(chi2)
-            if r == 0 :
-                print("fit has converged - no more outliers - redo minimixation one more time in case we have lost accuracy in rank update")
-                # Redo minimization one more time in case we have lost accuracy in rank update
-                r = fit.Minimize("Distortions Positions",5) # outliers removal at 5 sigma.
-                chi2 = fit.ComputeChi2()
-                print(chi2)
-                break
-            elif r == 2 :
-                print("minimization failed")
-            elif r == 1 :
-                print("still some ouliers but chi2 increases - retry")
-            else :
-                break
-                print("unxepected return code from Minimize")
+        # Damped iterations with outlier removal at 5 sigma, all in C++
+        r = fit.MinimizeLM("Distortions Positions", 5)
+        chi2 = fit.ComputeChi2()
+        print(chi2)
+        if r == 1 :
+            print("chi2 could not be decreased any further")
+        elif r == 2 :
+            print("minimization failed")
+        elif r == 3 :
+            print("fit did not converge within the allowed number of iterations")
 
         # Fill reference and measurement n-tuples for each tract
         tupleName = "res_" + str(dataRef.dataId["tract"]) + ".list"
         fit.MakeResTuple(tupleName)
 
-        # Build an updated wcs for each calexp
+        # Build an updated wcs for each calexp (all at once, in C++)
         imList = assoc.TheCcdImageList()
+        tanWcsList = jointcalLib.ProduceTanWcsList(spm, imList, False, self.config.wcsExportThreads)
 
-        for im in imList :
-            tanSip = spm.ProduceSipWcs(im)
-            frame = im.ImageFrame()
-            tanWcs = afwImage.TanWcs.cast(jointcalLib.GtransfoToTanWcs(tanSip, frame, False))
-
+        for im, tanWcs in zip(imList, tanWcsList) :
             name = im.Name()
+            if tanWcs is None :
+                self.log.warn('Could not produce a Wcs for ' + name)
+                continue
             visit, ccd = name.split('_')
             for dataRef in ref :
                 if dataRef.dataId["visit"] == int(visit) and dataRef.dataId["ccd"] == int(ccd) :
@@ -39,6 +39,8 @@ Python interface to lsst::jointcal classes
 #include "lsst/jointcal/PhotomFit.h"
 #include "lsst/jointcal/SimplePhotomModel.h"
 #include "lsst/jointcal/MatchExposure.h"
+#include "lsst/jointcal/Frame.h"
+#include "lsst/jointcal/RefCatalog.h"
 #include "lsst/jointcal/ChipArrangement.h"
 #include "lsst/jointcal/ExposureCatalog.h"
 %}
@@ -122,6 +124,12 @@ namespace jointcal {
 %include "lsst/jointcal/PhotomFit.h"
 %include "lsst/jointcal/SimplePhotomModel.h"
 
+%include "lsst/jointcal/Frame.h"
+%include "lsst/jointcal/RefCatalog.h"
 %include "lsst/jointcal/MatchExposure.h"
 %include "lsst/jointcal/ChipArrangement.h"
 %include "lsst/jointcal/ExposureCatalog.h"
+
+%template(ExposureCatalogList) std::vector<lsst::jointcal::ExposureCatalog*>;
+%template(PointList) std::vector<lsst::jointcal::Point>;
+%template(ExposureSolutionList) std::vector<lsst::jointcal::ExposureSolutionType>;
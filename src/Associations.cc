@@ -2,6 +2,7 @@
 //
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #include "lsst/jointcal/Associations.h"
 #include "lsst/jointcal/CcdImage.h"
@@ -74,6 +75,7 @@ bool Associations::AddImage(lsst::afw::table::SortedCatalogT<lsst::afw::table::S
     
   boost::shared_ptr<CcdImage> ccdImage(new CcdImage(Ri, commonTangentPoint, wcs, meta, bbox, filter, calib, visit, ccd, camera, control->sourceFluxField));
 //  CcdImage *ccdImage = new CcdImage(Ri, commonTangentPoint, wcs, meta, bbox, filter, calib, visit, ccd, camera, control->sourceFluxField);
+  ccdImage->SetIndex(ccdImageList.size());
   ccdImageList.push_back(ccdImage);
   std::cout << " we have " << ccdImage->WholeCatalog().size()
 	    << " objects in this catalog " << visit << " " << ccd << std::endl;
@@ -465,7 +467,29 @@ void Associations::DeprojectFittedStars()
     }
 
   TanPix2RaDec ctp2Sky(GtransfoLin(), CommonTangentPoint());
-  fittedStarList.ApplyTransfo(ctp2Sky);
+  /* positions go through the batch deprojection. The errors only need
+     the (algebraic) derivative at the tangent plane position, so we
+     transform them one by one before overwriting the positions. */
+  unsigned n = fittedStarList.size();
+  std::vector<double> x(n), y(n);
+  unsigned k = 0;
+  for (FittedStarIterator fi = fittedStarList.begin();
+       fi != fittedStarList.end(); ++fi, ++k)
+    {
+      FittedStar &f = **fi;
+      x[k] = f.x; y[k] = f.y;
+      double vIn[3] = {f.vx, f.vy, f.vxy};
+      double vOut[3];
+      ctp2Sky.TransformErrors(f, vIn, vOut);
+      f.vx = vOut[0]; f.vy = vOut[1]; f.vxy = vOut[2];
+    }
+  if (n) ctp2Sky.TransformArrays(&x[0], &y[0], &x[0], &y[0], n);
+  k = 0;
+  for (FittedStarIterator fi = fittedStarList.begin();
+       fi != fittedStarList.end(); ++fi, ++k)
+    {
+      (*fi)->x = x[k]; (*fi)->y = y[k];
+    }
   fittedStarList.inTangentPlaneCoordinates = false;
 }
 
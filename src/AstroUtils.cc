@@ -355,10 +355,10 @@ static void actual_usno_read(const std::string &usnodir,
 }
 
 
-static void ConvertMagToFlux(BaseStarList *List, const double Zp)
+void ConvertMagToFlux(BaseStarList &List, const double Zp)
 {
   
-  for (auto si = List->begin(); si != List->end(); ++si)
+  for (auto si = List.begin(); si != List.end(); ++si)
     {
       BaseStar &s = *(*si);
       if (s.flux < 40)  s.flux = pow(10., -(s.flux-Zp)*0.4);
@@ -379,7 +379,7 @@ bool UsnoCollect(const Frame &usnoFrame, const TanPix2RaDec &Wcs, BaseStarList &
       return false;
     }
 
-  ConvertMagToFlux( &UsnoCat, 0.); 
+  ConvertMagToFlux(UsnoCat, 0.); 
 
   TanRaDec2Pix UsnoToPix = Wcs.invert();
 
@@ -12,6 +12,7 @@
 #include "lsst/pex/exceptions.h"
 #include <fstream>
 #include "lsst/jointcal/Tripletlist.h"
+#include "lsst/jointcal/SparseAssembler.h"
 
 typedef Eigen::SparseMatrix<double> SpMat;
 
@@ -146,7 +147,7 @@ namespace jointcal {
 AstromFit::AstromFit(Associations &A, DistortionModel *D, double PosError) :
   _assoc(A),  _distortionModel(D), _posError(PosError)
 {
-  _LastNTrip = 0;
+  _jacobianBudget = 0;
   _JDRef = 0;
 
   _posError = PosError;
@@ -192,7 +193,17 @@ Point AstromFit::TransformFittedStar(const FittedStar &F,
 				     const double &RefractionCoeff,
 				     const double &Jd) const
 {
-  Point fittedStarInTP =  Sky2TP->apply(F);
+  return TransformFittedStar(F, Sky2TP->apply(F), RefractionVector,
+			     RefractionCoeff, Jd);
+}
+
+Point AstromFit::TransformFittedStar(const FittedStar &F,
+				     const Point &ProjectedFittedStar,
+				     const Point &RefractionVector,
+				     const double &RefractionCoeff,
+				     const double &Jd) const
+{
+  Point fittedStarInTP = ProjectedFittedStar;
   if (F.mightMove)
     {
       fittedStarInTP.x += F.pmx*Jd;
@@ -223,6 +234,26 @@ static void TweakAstromMeasurementErrors(FatPoint &P, const MeasuredStar &Ms, do
   P.vy += increment;
 }
 
+/* Projects the fitted stars of the valid measurements of Catalog
+   through Sky2TP in one batch call, in catalog order. The per
+   measurement loops consume X and Y in the same order. */
+static void project_fitted_stars(const MeasuredStarList &Catalog,
+				 const Gtransfo *Sky2TP,
+				 vector<double> &X, vector<double> &Y)
+{
+  X.clear(); Y.clear();
+  for (auto i = Catalog.begin(); i!= Catalog.end(); ++i)
+    {
+      const MeasuredStar& ms = **i;
+      if (!ms.IsValid()) continue;
+      const FittedStar *fs = ms.GetFittedStar();
+      X.push_back(fs->x);
+      Y.push_back(fs->y);
+    }
+  if (X.size())
+    Sky2TP->TransformArrays(&X[0], &Y[0], &X[0], &Y[0], X.size());
+}
+
 static bool heavyDebug = false;
 static unsigned fsIndexDebug = 0;
 
@@ -277,11 +308,19 @@ void AstromFit::LSDerivatives1(const CcdImage &Ccd,
   // current position in the Jacobian
   unsigned kTriplets = TList.NextFreeIndex();
   const MeasuredStarList &catalog = (M) ? *M : Ccd.CatalogForFit();
-
-  for (auto i = catalog.begin(); i!= catalog.end(); ++i)
+  vector<double> xTP, yTP;
+  project_fitted_stars(catalog, sky2TP, xTP, yTP);
+  unsigned kValid = 0;
+  /* the rank of measurements in the CcdImage catalog allows mappings
+     to use quantities they cached for them */
+  unsigned rank = 0;
+
+  for (auto i = catalog.begin(); i!= catalog.end(); ++i, ++rank)
     {
       const MeasuredStar& ms = **i;
       if (!ms.IsValid()) continue;
+      Point projected(xTP[kValid], yTP[kValid]);
+      ++kValid;
       // tweak the measurement errors
       FatPoint inPos = ms;
       TweakAstromMeasurementErrors(inPos, ms, _posError);
@@ -289,7 +328,8 @@ void AstromFit::LSDerivatives1(const CcdImage &Ccd,
       FatPoint outPos;
       // should *not* fill h if WhatToFit excludes mapping parameters.
       if (_fittingDistortions)
-	  mapping->ComputeTransformAndDerivatives(inPos, outPos, h);
+	  mapping->ComputeTransformAndDerivatives(inPos, outPos, h,
+						  (M) ? unsigned(-1) : rank);
       else mapping->TransformPosAndErrors(inPos,outPos);
 
       unsigned ipar = npar_mapping;
@@ -313,7 +353,7 @@ void AstromFit::LSDerivatives1(const CcdImage &Ccd,
       
       const FittedStar *fs = ms.GetFittedStar();
 
-      Point fittedStarInTP = TransformFittedStar(*fs, sky2TP,
+      Point fittedStarInTP = TransformFittedStar(*fs, projected,
 						 refractionVector,
 						 refractionCoefficient,
 						 jd);
@@ -495,6 +535,42 @@ void AstromFit::LSDerivatives(TripletList &TList, Eigen::VectorXd &Rhs) const
 }
 
 
+/*! Counting pre-pass for the Jacobian staging: it provides an upper
+  bound of the number of triplets that LSDerivatives will produce
+  (LSDerivatives1 drops null derivatives), and the number of
+  measurement blocks, for the current WhatToFit setting. */
+void AstromFit::CountTriplets(size_t &NEntries, size_t &NBlocks) const
+{
+  NEntries = 0;
+  NBlocks = 0;
+  auto L = _assoc.TheCcdImageList();
+  for (auto im=L.cbegin(); im!=L.end() ; ++im)
+    {
+      const CcdImage &ccd = **im;
+      const Mapping *mapping = _distortionModel->GetMapping(ccd);
+      // same counts as in LSDerivatives1
+      unsigned npar_tot = ((_fittingDistortions) ? mapping->Npar() : 0)
+	+ ((_fittingPos) ? 2 : 0) + ((_fittingRefrac) ? 1 : 0)
+	+ ((_fittingPM) ? NPAR_PM : 0);
+      if (npar_tot == 0) continue;
+      const MeasuredStarList &catalog = ccd.CatalogForFit();
+      for (auto i = catalog.cbegin(); i!= catalog.end(); ++i)
+	if ((*i)->IsValid())
+	  {
+	    NEntries += 2*npar_tot;
+	    NBlocks++;
+	  }
+    }
+  if (!_fittingPos) return;
+  const FittedStarList &fsl = _assoc.fittedStarList;
+  for (auto i = fsl.cbegin(); i!= fsl.end(); ++i)
+    if ((*i)->GetRefStar())
+      {
+	NEntries += 4;
+	NBlocks++;
+      }
+}
+
 // This is almost a selection of lines of LSDerivatives1(CcdImage ...)
 /* This routine (and the following one) is template because it is used
 both with its first argument as "const CCdImage &" and "CcdImage &",
@@ -521,10 +597,15 @@ void AstromFit::AccumulateStatImage(ImType &Ccd, Accum &Accu) const
   Eigen::Matrix2Xd transW(2,2);
 
   auto &catalog = Ccd.CatalogForFit();
+  vector<double> xTP, yTP;
+  project_fitted_stars(catalog, sky2TP, xTP, yTP);
+  unsigned kValid = 0;
   for (auto i = catalog.begin(); i!= catalog.end(); ++i)
     {
       auto &ms = **i;
       if (!ms.IsValid()) continue;
+      Point projected(xTP[kValid], yTP[kValid]);
+      ++kValid;
       // tweak the measurement errors
       FatPoint inPos = ms;
       TweakAstromMeasurementErrors(inPos, ms, _posError);
@@ -542,7 +623,7 @@ void AstromFit::AccumulateStatImage(ImType &Ccd, Accum &Accu) const
       transW(0,1) = transW(1,0) = -outPos.vxy/det;
 
       const FittedStar *fs = ms.GetFittedStar();
-      Point fittedStarInTP = TransformFittedStar(*fs, sky2TP,
+      Point fittedStarInTP = TransformFittedStar(*fs, projected,
 						 refractionVector,
 						 refractionCoefficient,
 						 jd);
@@ -793,13 +874,7 @@ unsigned AstromFit::FindOutliers(const double &NSigCut,
 
 void AstromFit::RemoveMeasOutliers(MeasuredStarList &Outliers)
 {
-  for (auto i = Outliers.begin(); i!= Outliers.end(); ++i)
-    {
-      MeasuredStar &ms = **i;
-      FittedStar *fs = const_cast<FittedStar *>(ms.GetFittedStar());
-      ms.SetValid(false);
-      fs->MeasurementCount()--; // could be put in SetValid
-    }
+  Outliers.RemoveFromFits();
 }
   
 
@@ -944,43 +1019,43 @@ static void write_vect_in_fits(const Eigen::VectorXd &V, const string &FitsName)
 #endif
 
 
-/*! This is a complete Newton Raphson step. Compute first and
-  second derivatives, solve for the step and apply it, without
-  a line search. */
-unsigned AstromFit::Minimize(const std::string &WhatToFit, const double NSigRejCut)
+/*! Fills the Hessian (J*Jt) and the gradient for the current
+  WhatToFit setting. Without a memory budget, the whole Jacobian is
+  assembled before being multiplied by itself. With a budget, the
+  Jacobian triplets are staged for batches of CcdImages that fit in
+  the budget, and the Hessian is accumulated batch after batch, so
+  that the full Jacobian never sits in memory. */
+void AstromFit::HessianAndGradient(SpMat &Hessian, Eigen::VectorXd &Grad)
 {
-  AssignIndices(WhatToFit);
-  
-  // return code can take 3 values :
-  // 0 : fit has converged - no more outliers
-  // 1 : still some ouliers but chi2 increases
-  // 2 : factorization failed
-  unsigned returnCode = 0;
-
-  // TODO : write a guesser for the number of triplets
-  unsigned nTrip = (_LastNTrip) ? _LastNTrip: 1e6;
-  TripletList tList(nTrip);
-  Eigen::VectorXd grad(_nParTot);  grad.setZero();
+  if (_jacobianBudget)
+    {
+      AccumulateHessianByBatches(Hessian, Grad);
+      return;
+    }
+  size_t nEntries, nBlocks;
+  CountTriplets(nEntries, nBlocks);
+  TripletList tList(0);
+  tList.Reserve(nEntries, nBlocks);
 
   //Fill the triplets
   clock_t tstart = clock();
-  LSDerivatives(tList, grad);
+  LSDerivatives(tList, Grad);
   clock_t tend = clock();
-  _LastNTrip = tList.size();
 
   cout << " INFO: End of triplet filling, ntrip = " << tList.size()
        << " CPU = " << float(tend-tstart)/float(CLOCKS_PER_SEC)
        << endl;
 
-  SpMat hessian;
   {
 #if (TRIPLET_INTERNAL_COORD == COL)
-    SpMat jacobian(_nParTot,tList.NextFreeIndex());
-    jacobian.setFromTriplets(tList.begin(), tList.end());
+    const SpMat &jacobian = _jacobianAssembler.Assemble(tList, _nParTot,
+							tList.NextFreeIndex());
     // release memory shrink_to_fit is C++11
     tList.clear(); //tList.shrink_to_fit();
     clock_t tstart = clock();
-    hessian = jacobian*jacobian.transpose();
+    Hessian = jacobian*jacobian.transpose();
+    // a factorization follows : only keep the pattern
+    _jacobianAssembler.ReleaseMatrix();
     clock_t tend = clock();
     std::cout << "INFO: CPU for J*Jt "
 	      << float(tend-tstart)/float(CLOCKS_PER_SEC) << std::endl;
@@ -991,17 +1066,73 @@ unsigned AstromFit::Minimize(const std::string &WhatToFit, const double NSigRejC
     // release memory shrink_to_fit is C++11
     tList.clear(); //tList.shrink_to_fit();
     cout << " starting H=JtJ " << endl;
-    hessian = jacobian.transpose()*jacobian;
+    Hessian = jacobian.transpose()*jacobian;
 #endif
   }// release the Jacobian
+}
+
+void AstromFit::AccumulateHessianByBatches(SpMat &Hessian, Eigen::VectorXd &Grad)
+{
+  size_t maxTrip = std::max(_jacobianBudget/TripletList::EntrySize(), size_t(1000));
+  size_t nEntries, nBlocks;
+  CountTriplets(nEntries, nBlocks);
+  TripletList tList(std::min(maxTrip, nEntries));
+  Hessian.resize(_nParTot, _nParTot);
+  Hessian.setZero();
+  unsigned nBatch = 0;
+  size_t lastBlock = 0; // size of the last CcdImage block, to anticipate the next one
 
+  clock_t tstart = clock();
+  auto flush = [&] ()
+    {
+      if (tList.size() == 0) return;
+      SpMat jacobian(_nParTot, tList.NextFreeIndex());
+      jacobian.setFromTriplets(tList.begin(), tList.end());
+      tList.clear();
+      tList.SetNextFreeIndex(0);
+      Hessian += jacobian*jacobian.transpose();
+      nBatch++;
+    };
+
+  auto L = _assoc.TheCcdImageList();
+  for (auto im=L.cbegin(); im!=L.end() ; ++im)
+    {
+      if (tList.size()+lastBlock > maxTrip) flush();
+      size_t before = tList.size();
+      LSDerivatives1(**im, tList, Grad);
+      lastBlock = tList.size()-before;
+    }
+  LSDerivatives2(_assoc.fittedStarList, tList, Grad);
+  flush();
+  clock_t tend = clock();
+  cout << "INFO: Hessian accumulated from " << nBatch << " Jacobian batches of at most "
+       << maxTrip << " triplets, CPU = " << float(tend-tstart)/float(CLOCKS_PER_SEC)
+       << endl;
+}
+
+/*! This is a complete Newton Raphson step. Compute first and
+  second derivatives, solve for the step and apply it, without
+  a line search. */
+unsigned AstromFit::Minimize(const std::string &WhatToFit, const double NSigRejCut)
+{
+  AssignIndices(WhatToFit);
+  
+  // return code can take 3 values :
+  // 0 : fit has converged - no more outliers
+  // 1 : still some ouliers but chi2 increases
+  // 2 : factorization failed
+  unsigned returnCode = 0;
+
+  Eigen::VectorXd grad(_nParTot);  grad.setZero();
+  SpMat hessian;
+  HessianAndGradient(hessian, grad);
 
   cout << "INFO: hessian : dim=" << hessian.rows()
        << " nnz=" << hessian.nonZeros()
        << " filling-frac = " << hessian.nonZeros()/sqr(hessian.rows()) << endl;
   cout << "INFO: starting factorization" << endl;
 
-  tstart = clock();
+  clock_t tstart = clock();
   CholmodSimplicialLDLT2<SpMat> chol(hessian);
   if (chol.info() != Eigen::Success)
     {
@@ -1009,7 +1140,7 @@ unsigned AstromFit::Minimize(const std::string &WhatToFit, const double NSigRejC
       return 2;
     }
 
-  tend = clock();
+  clock_t tend = clock();
   std::cout << "INFO: CPU for factorize-solve "
   	    << float(tend-tstart)/float(CLOCKS_PER_SEC) << std::endl;
   tstart = tend;
@@ -1065,6 +1196,36 @@ unsigned AstromFit::Minimize(const std::string &WhatToFit, const double NSigRejC
   return returnCode;
 }
 
+/*! Levenberg-Marquardt iterations, with outlier rejection
+  interleaved between iterations : see LevenbergMarquardt (in
+  SparseAssembler.h) for the algorithm, convergence criteria and
+  return codes. Factorizations go through cholmod. */
+unsigned AstromFit::MinimizeLM(const std::string &WhatToFit,
+			       const double NSigRejCut,
+			       const unsigned MaxIter,
+			       const double Chi2Tol)
+{
+  AssignIndices(WhatToFit);
+
+  LMFitCallbacks fit;
+  fit.HessianAndGradient = [this](SpMat &H, Eigen::VectorXd &G)
+    { HessianAndGradient(H, G);};
+  fit.ComputeChi2 = [this]() { return ComputeChi2();};
+  fit.OffsetParams = [this](const Eigen::VectorXd &Delta) { OffsetParams(Delta);};
+  fit.RemoveOutliers = [this](const double NSigCut)
+    {
+      MeasuredStarList moutliers;
+      FittedStarList foutliers;
+      unsigned n_outliers = FindOutliers(NSigCut, moutliers, foutliers);
+      RemoveMeasOutliers(moutliers);
+      RemoveRefOutliers(foutliers);
+      return n_outliers;
+    };
+  return LevenbergMarquardt<CholmodSimplicialLDLT2<SpMat> >(fit, _nParTot,
+							      "AstromFit::MinimizeLM",
+							      NSigRejCut, MaxIter, Chi2Tol);
+}
+
 /* DEBUGGING routine */
 void AstromFit::CheckStuff()
 {
@@ -98,6 +98,15 @@ static int getBandIndex(std::string const& band)
   return -1;
 }
 
+// GtransfoCompose, followed by GtransfoFlatten.
+static Gtransfo *flatten_composition(const Gtransfo *Left, const Gtransfo *Right)
+{
+  Gtransfo *composition = GtransfoCompose(Left, Right);
+  Gtransfo *flat = GtransfoFlatten(composition);
+  delete composition;
+  return flat;
+}
+
 
 CcdImage::CcdImage(lsst::afw::table::SortedCatalogT<lsst::afw::table::SourceRecord> &Ri,
             const Point &CommonTangentPoint,
@@ -136,7 +145,7 @@ CcdImage::CcdImage(lsst::afw::table::SortedCatalogT<lsst::afw::table::SourceReco
     // read wcs:
     const BaseTanWcs* tanWcs = readWcs.get();
 
-    inverseReadWcs = readWcs->InverseTransfo(0.01, imageFrame);
+    inverseReadWcs = readWcs->PolyInverseTransfo(0.01, imageFrame);
 
     band = filter;
     bandIndex = getBandIndex(band);
@@ -149,24 +158,27 @@ CcdImage::CcdImage(lsst::afw::table::SortedCatalogT<lsst::afw::table::SourceReco
 
   /* we don't assume here that we know the internals of TanPix2RaDec:
      to construct pix->TP, we do pix->sky->TP, although pix->sky
-     actually goes through TP */
+     actually goes through TP. GtransfoFlatten takes care of removing
+     the useless trip to the sky, and of turning TP to TP jumps into a
+     single projective transformation. sky2TP is left alone, since the
+     distortion models expect a TanRaDec2Pix. */
 
     GtransfoLin identity;
     TanRaDec2Pix raDec2TP(identity, tanWcs->TangentPoint());
-    pix2TP = GtransfoCompose(&raDec2TP, tanWcs);
+    pix2TP = flatten_composition(&raDec2TP, tanWcs);
     TanPix2RaDec CTP2RaDec(identity, CommonTangentPoint);
-    CTP2TP = GtransfoCompose(&raDec2TP, &CTP2RaDec);
+    CTP2TP = flatten_composition(&raDec2TP, &CTP2RaDec);
 
     // jump from one TP to an other:
     TanRaDec2Pix raDec2CTP(identity, CommonTangentPoint);
     //  TanPix2RaDec TP2RaDec(identity, tanWcs->TangentPoint());
     //  TP2CTP = GtransfoCompose(&raDec2CTP, &TP2RaDec);
     TanPix2RaDec TP2RaDec(identity, tanWcs->TangentPoint());
-    TP2CTP = GtransfoCompose(&raDec2CTP, &TP2RaDec);
+    TP2CTP = flatten_composition(&raDec2CTP, &TP2RaDec);
     sky2TP = new TanRaDec2Pix(identity, tanWcs->TangentPoint());
 
       // this one is needed for matches :
-    pix2CommonTangentPlane = GtransfoCompose(&raDec2CTP, tanWcs);
+    pix2CommonTangentPlane = flatten_composition(&raDec2CTP, tanWcs);
 
     // In the following we read informations directly from the fits header which is instrument dependent
     // We rely on the camera name which is not optimal as a camera can be mounted on different telescopes.
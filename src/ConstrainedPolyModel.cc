@@ -100,7 +100,15 @@ reference exposure, expect troubles" << std::endl;
 	  _chipMap[chip] = std::unique_ptr<SimplePolyMapping>( new SimplePolyMapping(norm,
 										     GtransfoPoly(degree)));
 	}
-      _mappings[&im] = std::unique_ptr<TwoTransfoMapping>(new TwoTransfoMapping(_chipMap[chip].get(), _shootMap[shoot].get()));
+      if (im.Index() < 0)
+	throw LSST_EXCEPT(pexExcept::InvalidParameterError,"ConstrainedPolyModel : CcdImage "+im.Name()+" has no index");
+      if (unsigned(im.Index()) >= _mappings.size())
+	{
+	  _mappings.resize(im.Index()+1);
+	  _owners.resize(im.Index()+1, NULL);
+	}
+      _owners[im.Index()] = &im;
+      _mappings[im.Index()] = std::unique_ptr<TwoTransfoMapping>(new TwoTransfoMapping(_chipMap[chip].get(), _shootMap[shoot].get()));
     
     }
   cout << "INFO: ConstrainedPolyModel : we have " << _chipMap.size() << " chip mappings " << endl;
@@ -113,9 +121,12 @@ reference exposure, expect troubles" << std::endl;
 
 const Mapping* ConstrainedPolyModel::GetMapping(const CcdImage &C) const
 {
-  mappingMapType::const_iterator i = _mappings.find(&C);
-  if  (i==_mappings.end()) return NULL;
-  return (i->second.get());
+  unsigned k = C.Index(); // -1 wraps around
+  if  (k >= _mappings.size()) return NULL;
+  /* Index() is only unique within one Associations */
+  if (_owners[k] != &C)
+    throw LSST_EXCEPT(pexExcept::InvalidParameterError,"ConstrainedPolyModel : never heard of CcdImage "+C.Name()+" (another CcdImage has the same index)");
+  return _mappings[k].get();
 }
 
 /*! This routine decodes "DistortionsChip" and "DistortionsShoot" in
@@ -158,7 +169,7 @@ mappings should be SimplePolyMappings");
   // Tell the mappings which derivatives they will have to fill:
   for (auto i = _mappings.begin(); i != _mappings.end() ; ++i)
     {
-      i->second->SetWhatToFit(_fittingChips, _fittingShoots);
+      if (*i) (*i)->SetWhatToFit(_fittingChips, _fittingShoots);
     }
   return index;
 }
@@ -232,9 +243,8 @@ const Gtransfo& ConstrainedPolyModel::GetShootTransfo(const ShootIdType &Shoot)
 
 PTR(TanSipPix2RaDec) ConstrainedPolyModel::ProduceSipWcs(const CcdImage &Ccd) const
 {
-  mappingMapType::const_iterator i = _mappings.find(&Ccd);
-  if  (i==_mappings.end()) return NULL;
-  const TwoTransfoMapping *m = i->second.get();
+  const TwoTransfoMapping *m = static_cast<const TwoTransfoMapping*>(GetMapping(Ccd));
+  if  (!m) return NULL;
   
   const GtransfoPoly &t1=dynamic_cast<const GtransfoPoly&>(m->T1());
   const GtransfoPoly &t2=dynamic_cast<const GtransfoPoly&>(m->T2());
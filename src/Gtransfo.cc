@@ -5,12 +5,17 @@
 #include <fstream>
 #include "assert.h"
 #include <sstream>
+#include <thread>
+#include <atomic>
+#include <functional> // for std::ref
+#include <algorithm>
 
 #include "lsst/jointcal/Gtransfo.h"
 #include "lsst/jointcal/Frame.h"
 #include "lsst/jointcal/StarMatch.h"
 #include "lsst/pex/exceptions.h"
 #include "Eigen/Cholesky"
+#include "Eigen/QR"
 
 namespace pexExcept = lsst::pex::exceptions; //?
 
@@ -91,6 +96,29 @@ void Gtransfo::Derivative(const Point &Where,
   Der.dy() = 0;
 }
 
+void Gtransfo::DerivativeMatrix(const Point &Where, double &A11, double &A12,
+				double &A21, double &A22, const double Step) const
+{
+  GtransfoLin der;
+  Derivative(Where, der, Step);
+  A11 = der.A11(); A12 = der.A12();
+  A21 = der.A21(); A22 = der.A22();
+}
+
+/* Der = Left*Der, for derivatives (i.e. without offsets). Avoids the
+   temporaries of GtransfoLin::operator*, which cost more than the
+   arithmetic. */
+static void left_multiply_derivative(const double L11, const double L12,
+				     const double L21, const double L22,
+				     GtransfoLin &Der)
+{
+  double a11 = Der.A11(), a12 = Der.A12(), a21 = Der.A21(), a22 = Der.A22();
+  Der.Coeff(1,0,0) = L11*a11 + L12*a21;
+  Der.Coeff(0,1,0) = L11*a12 + L12*a22;
+  Der.Coeff(1,0,1) = L21*a11 + L22*a21;
+  Der.Coeff(0,1,1) = L21*a12 + L22*a22;
+}
+
 GtransfoLin Gtransfo::LinearApproximation(const Point &Where,
 					  const double Step) const
 {
@@ -101,6 +129,13 @@ GtransfoLin Gtransfo::LinearApproximation(const Point &Where,
 }
 
 
+void Gtransfo::TransformArrays(const double *Xin, const double *Yin,
+			       double *Xout, double *Yout, const unsigned N) const
+{
+  for (unsigned k=0; k<N; ++k) apply(Xin[k], Yin[k], Xout[k], Yout[k]);
+}
+
+
 void Gtransfo::TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const
 {
   FatPoint res; // in case In and Out are the same address...
@@ -258,6 +293,10 @@ public:
   void apply(const double Xin, const double Yin,
 	     double &Xout, double  &Yout) const;
 
+  //! the inverse of the direct transfo derivative, at the transformed point.
+  void Derivative(const Point &Where, GtransfoLin &Der,
+		  const double Step = 0.01) const;
+
   void dump(ostream &stream) const;
 
   double fit(const StarMatchList &List);
@@ -357,6 +396,15 @@ void GtransfoInverse::apply(const double Xin, const double Yin,
   Yout = outGuess.y;
 }
 
+void GtransfoInverse::Derivative(const Point &Where, GtransfoLin &Der,
+				 const double Step) const
+{
+  Point out = Gtransfo::apply(Where);
+  GtransfoLin directDer;
+  direct->Derivative(out, directDer, Step);
+  Der = directDer.invert();
+}
+
 void GtransfoInverse::dump(ostream &stream) const
 {
   stream << " GtransfoInverse of  :" << endl
@@ -378,6 +426,149 @@ Gtransfo *GtransfoInverse::Clone() const
 }
 
 
+/******************* GtransfoPolyInverse ****************/
+/* inverse transformation, as a polynomial fitted over a region (the
+   input side of the direct transfo), with the iterative inverse as a
+   fallback outside of this region. Built by
+   Gtransfo::PolyInverseTransfo. */
+class GtransfoPolyInverse : public Gtransfo {
+
+private:
+  GtransfoLin normalize; // maps domain onto [-1,1]x[-1,1]
+  GtransfoPoly poly; // applies to normalized coordinates
+  Frame region; // where poly is accurate (output side)
+  Frame domain; // image of region by the direct transfo (input side)
+  Gtransfo *iterative;
+
+public:
+  GtransfoPolyInverse(const GtransfoLin &Normalize, const GtransfoPoly &Poly,
+		      const Frame &Region, const Frame &Domain, Gtransfo *Iterative) :
+    normalize(Normalize), poly(Poly), region(Region), domain(Domain),
+    iterative(Iterative) {}
+
+  /* Points out of the domain go to the iterative solver. So do points
+     that the polynomial maps out of the region: their inverse is
+     (nearly) out of the region as well, where the polynomial
+     extrapolates. */
+  void apply(const double Xin, const double Yin,
+	     double &Xout, double  &Yout) const
+  {
+    if (domain.InFrame(Xin,Yin))
+      {
+	double xn, yn;
+	normalize.apply(Xin, Yin, xn, yn);
+	poly.apply(xn, yn, Xout, Yout);
+	if (region.InFrame(Xout,Yout)) return;
+      }
+    iterative->apply(Xin, Yin, Xout, Yout);
+  }
+
+  //! derivative of what apply computes.
+  void Derivative(const Point &Where, GtransfoLin &Der,
+		  const double Step = 0.01) const
+  {
+    if (domain.InFrame(Where))
+      {
+	Point normalized = normalize.apply(Where);
+	if (region.InFrame(poly.apply(normalized)))
+	  {
+	    poly.Derivative(normalized, Der, Step);
+	    Der = Der*normalize;
+	    Der.Coeff(0,0,0) = Der.Coeff(0,0,1) = 0;
+	    return;
+	  }
+      }
+    iterative->Derivative(Where, Der, Step);
+  }
+
+  void dump(ostream &stream) const
+  {
+    stream << " GtransfoPolyInverse over " << region << ", polynomial :" << endl
+	   << poly << " iterative inverse outside:" << endl << *iterative;
+  }
+
+  double fit(const StarMatchList &List)
+  {
+    if (&List) {} // warning killer
+    std::cerr << " Trying to fit a GtransfoPolyInverse... \
+try to use StarMatchList::inverseTransfo instead "
+	      << std::endl;
+    return -1;
+  }
+
+  Gtransfo *Clone() const
+  {
+    return new GtransfoPolyInverse(normalize, poly, region, domain, iterative->Clone());
+  }
+
+  Gtransfo* InverseTransfo(const double Precision,
+			   const Frame& Region) const
+  {
+    return iterative->InverseTransfo(Precision, Region);
+  }
+
+  ~GtransfoPolyInverse() { delete iterative;}
+
+private:
+  GtransfoPolyInverse(const GtransfoPolyInverse &);
+  void operator = (const GtransfoPolyInverse &);
+
+};
+
+
+/* The polynomial is fitted on the centers of a 50x50 grid of
+   cells, and checked on the cell corners (which include the region
+   boundary), i.e. between the fit points, where the interpolation is
+   the worst. It applies to coordinates normalized over the image of
+   the region, because high degree polynomials of e.g. raw sky
+   coordinates suffer from rounding errors. */
+Gtransfo* Gtransfo::PolyInverseTransfo(const double Precision,
+				       const Frame& Region) const
+{
+  const unsigned n = 50;
+  double stepx = Region.Width()/n;
+  double stepy = Region.Height()/n;
+  std::vector<Point> fitIn, checkIn;
+  fitIn.reserve(n*n);
+  checkIn.reserve((n+1)*(n+1));
+  for (unsigned i=0 ;i<=n; ++i)
+    for (unsigned j=0; j<=n; ++j)
+      {
+	checkIn.push_back(Point(Region.xMin+i*stepx, Region.yMin+j*stepy));
+	if (i<n && j<n)
+	  fitIn.push_back(Point(Region.xMin+(i+0.5)*stepx, Region.yMin+(j+0.5)*stepy));
+      }
+  std::vector<Point> checkOut(checkIn.size());
+  for (unsigned k=0; k<checkIn.size(); ++k) apply(checkIn[k], checkOut[k]);
+  // the image of Region, slightly enlarged
+  Frame domain(checkOut[0], checkOut[0]);
+  for (auto &p : checkOut) domain += Frame(p, p);
+  domain = domain.Rescale(1.01);
+  GtransfoLin normalize = NormalizeCoordinatesTransfo(domain);
+  StarMatchList sm;
+  for (auto &in : fitIn)
+    sm.push_back(StarMatch(normalize.apply(apply(in)), in , NULL,NULL));
+  for (auto &p : checkOut) normalize.apply(p, p);
+
+  const unsigned maxDegree = 9;
+  for (unsigned degree = 1; degree <= maxDegree; ++degree)
+    {
+      GtransfoPoly poly(degree);
+      if (poly.fit(sm) < 0) break;
+      double maxError2 = 0;
+      for (unsigned k=0; k<checkIn.size(); ++k)
+	maxError2 = std::max(maxError2, checkIn[k].Dist2(poly.apply(checkOut[k])));
+      if (maxError2 < Precision*Precision)
+	return new GtransfoPolyInverse(normalize, poly, Region, domain,
+				       InverseTransfo(Precision, Region));
+    }
+  cout << "WARNING: PolyInverseTransfo : no polynomial up to degree " << maxDegree
+       << " reaches the requested precision = " << Precision
+       << ", resorting to the iterative inverse" << endl;
+  return InverseTransfo(Precision, Region);
+}
+
+
 /************* GtransfoComposition **************/
 
 
@@ -395,8 +586,22 @@ class GtransfoComposition : public Gtransfo {
     //! will pipe transfos
     GtransfoComposition(const Gtransfo *Second, const Gtransfo *First);
 
+    //! the transfo applied first
+    const Gtransfo *First() const { return first;}
+
+    //! the transfo applied last
+    const Gtransfo *Second() const { return second;}
+
     //! return Second(First(Xin,Yin))
     void apply(const double Xin, const double Yin, double &Xout, double &Yout) const;
+
+    //! chain rule : product of the derivatives of both parts.
+    void Derivative(const Point &Where, GtransfoLin &Der,
+		    const double Step = 0.01) const;
+
+    //! propagates through both parts (exact when both are exact).
+    void TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const;
+
     void dump(ostream &stream = cout) const;
 
     //!
@@ -424,6 +629,22 @@ first->apply(Xin,Yin, xout,yout);
 second->apply(xout,yout,Xout,Yout);
 }
 
+void GtransfoComposition::Derivative(const Point &Where, GtransfoLin &Der,
+				     const double Step) const
+{
+  GtransfoLin der2;
+  first->Derivative(Where, Der, Step);
+  second->Derivative(first->apply(Where), der2, Step);
+  left_multiply_derivative(der2.A11(), der2.A12(), der2.A21(), der2.A22(), Der);
+}
+
+void GtransfoComposition::TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const
+{
+  FatPoint mid;
+  first->TransformPosAndErrors(In, mid);
+  second->TransformPosAndErrors(mid, Out);
+}
+
 void GtransfoComposition::dump(ostream &stream) const
 {
 first->dump(stream); second->dump(stream);
@@ -636,6 +857,42 @@ void GtransfoPoly::apply(const double Xin, const double Yin,
 }
 
 
+/* The linear case (by far the most frequent one in the matching
+   and refine loops) gets a loop the compiler can vectorize. The
+   summation order is the one of apply (monomials 1, x, y), so that
+   results are bitwise identical. */
+void GtransfoPoly::TransformArrays(const double *Xin, const double *Yin,
+				   double *Xout, double *Yout, const unsigned N) const
+{
+  if (deg == 1)
+    {
+      const double cx0 = coeffs[0], cx1 = coeffs[1], cx2 = coeffs[2];
+      const double cy0 = coeffs[3], cy1 = coeffs[4], cy2 = coeffs[5];
+      for (unsigned k=0; k<N; ++k)
+	{
+	  double x = Xin[k];
+	  double y = Yin[k];
+	  Xout[k] = cx0 + x*cx1 + y*cx2;
+	  Yout[k] = cy0 + x*cy1 + y*cy2;
+	}
+      return;
+    }
+  double monomials[nterms]; // VLA
+  for (unsigned k=0; k<N; ++k)
+    {
+      compute_monomials(Xin[k], Yin[k], monomials);
+      double xout = 0, yout = 0;
+      const double *c = &coeffs[0];
+      const double *pm = &monomials[0];
+      for (int i=nterms; i--; ) xout +=  (*(pm++))*(*(c++));
+      pm = &monomials[0];
+      for (int i=nterms; i--; ) yout +=  (*(pm++))*(*(c++));
+      Xout[k] = xout;
+      Yout[k] = yout;
+    }
+}
+
+
 void GtransfoPoly::Derivative(const Point &Where,
 			      GtransfoLin &Der, const double Step) const
 { /* routine checked against numerical derivatives from Gtransfo::Derivative */
@@ -645,7 +902,20 @@ void GtransfoPoly::Derivative(const Point &Where,
       Der.dx() = Der.dy() = 0;
       return;
     }
+  Der.dx() = 0;
+  Der.dy() = 0;
+  DerivativeMatrix(Where, Der.a11(), Der.a12(), Der.a21(), Der.a22());
+}
 
+void GtransfoPoly::DerivativeMatrix(const Point &Where, double &A11, double &A12,
+				    double &A21, double &A22, const double Step) const
+{
+  if (deg == 1)
+    {
+      A11 = coeffs[1]; A12 = coeffs[2];
+      A21 = coeffs[4]; A22 = coeffs[5];
+      return;
+    }
   double dermx[2*nterms];   //VLA
   double *dermy = dermx+nterms;
   double xin = Where.x;
@@ -672,9 +942,6 @@ void GtransfoPoly::Derivative(const Point &Where,
     if (ix>=1) xxm1 *= xin;
     }
 
-  Der.dx() = 0;
-  Der.dy() = 0;
-
   const double *mx = &dermx[0];
   const double *my = &dermy[0];
   const double *c = &coeffs[0];
@@ -685,8 +952,8 @@ void GtransfoPoly::Derivative(const Point &Where,
       a11 += (*(mx++))*(*c);
       a12 += (*(my++))*(*(c++));
     }
-  Der.a11() = a11;
-  Der.a12() = a12;
+  A11 = a11;
+  A12 = a12;
   // dy'
   double a21 = 0, a22 = 0;
   mx = &dermx[0];
@@ -696,9 +963,8 @@ void GtransfoPoly::Derivative(const Point &Where,
       a21 += (*(mx++))*(*c);
       a22 += (*(my++))*(*(c++));
     }
-  Der.a21() = a21;
-  Der.a22() = a22;
-
+  A21 = a21;
+  A22 = a22;
 }
 
 void GtransfoPoly::TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const
@@ -987,60 +1253,177 @@ static GtransfoLin shift_and_normalize(const StarMatchList &List)
 }
 
 static double sq(const double &x) { return x*x;}
-  
-double GtransfoPoly::do_the_fit(const StarMatchList &List,
-				const Gtransfo &ShiftToCenter,
-				const bool UseErrors)
+
+/* The matches are packed once per fit (the centering does not change
+   between the do_the_fit iterations): one row per match, holding the
+   monomials of the centered first point and their derivatives w.r.t
+   x and y. Transformed positions and derivatives then come from
+   matrix-vector products, and the normal matrix from matrix-matrix
+   products, rather than from element-by-element updates. */
+struct GtransfoPoly::FitData
 {
-  Eigen::MatrixXd A(2*nterms,2*nterms);   A.setZero();
-  Eigen::VectorXd B(2*nterms);   B.setZero();
-  double sumr2 = 0;
-  double monomials[nterms];
-  for (auto it = List.begin(); it != List.end(); ++it)
+  Eigen::MatrixXd monom, dermx, dermy;
+  Eigen::VectorXd x2, y2, vx1, vy1, vxy1, vx2, vy2, vxy2;
+};
+
+void GtransfoPoly::pack_matches(const StarMatchList &List,
+				const Gtransfo &ShiftToCenter,
+				FitData &Data) const
+{
+  unsigned n = List.size();
+  Data.monom.resize(n, nterms);
+  Data.dermx.resize(n, nterms);
+  Data.dermy.resize(n, nterms);
+  Eigen::VectorXd *vectors[] = {&Data.x2, &Data.y2, &Data.vx1, &Data.vy1,
+				&Data.vxy1, &Data.vx2, &Data.vy2, &Data.vxy2};
+  for (auto v : vectors) v->resize(n);
+  unsigned row = 0;
+  for (auto it = List.begin(); it != List.end(); ++it, ++row)
     {
       const StarMatch &a_match = *it;
-      Point tmp = ShiftToCenter.apply(a_match.point1);
-      FatPoint point1(tmp, a_match.point1.vx, a_match.point1.vy,
-		      a_match.point1.vxy);
+      Point point1 = ShiftToCenter.apply(a_match.point1);
+      // same monomial ordering as compute_monomials
+      double xx = 1;
+      double xxm1 = 1; // xx^(ix-1)
+      for (unsigned ix = 0; ix<=deg; ++ix)
+	{
+	  double yy = 1;
+	  double yym1 = 1; // yy^(iy-1)
+	  unsigned k=ix*(ix+1)/2;
+	  for (unsigned iy = 0; iy<=deg-ix; ++iy)
+	    {
+	      Data.monom(row,k) = xx*yy;
+	      Data.dermx(row,k) = ix*xxm1*yy;
+	      Data.dermy(row,k) = iy*xx*yym1;
+	      if (iy>=1) yym1 *= point1.y;
+	      yy *= point1.y;
+	      k+= ix+iy+2;
+	    }
+	  if (ix>=1) xxm1 *= point1.x;
+	  xx *= point1.x;
+	}
+      Data.vx1(row) = a_match.point1.vx;
+      Data.vy1(row) = a_match.point1.vy;
+      Data.vxy1(row) = a_match.point1.vxy;
       const FatPoint &point2 = a_match.point2;
-      double wxx,wyy,wxy;
-      FatPoint tr1;
-      compute_monomials(point1.x, point1.y, monomials);
-      if (UseErrors)
+      Data.x2(row) = point2.x;
+      Data.y2(row) = point2.y;
+      Data.vx2(row) = point2.vx;
+      Data.vy2(row) = point2.vy;
+      Data.vxy2(row) = point2.vxy;
+    }
+}
+
+
+/* atomic, because fits may run in several threads (e.g. MatchExposures,
+   ProduceTanWcsList) while the count is changed. Every fit reads it
+   once. */
+static std::atomic<unsigned> fitNThreads(1);
+
+void GtransfoPoly::SetFitNThreads(const unsigned NThreads)
+{
+  fitNThreads = (NThreads) ? NThreads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+/* Contribution of the matches [First, First+Count[ to the normal
+   equations. Only the lower triangle of A is filled (it is what the
+   LDLT factorization reads). */
+static void accumulate_normal_equations(const Eigen::MatrixXd &Monom,
+					const Eigen::VectorXd &Wxx,
+					const Eigen::VectorXd &Wyy,
+					const Eigen::VectorXd &Wxy,
+					const Eigen::VectorXd &Bx,
+					const Eigen::VectorXd &By,
+					const unsigned First, const unsigned Count,
+					Eigen::MatrixXd &A, Eigen::VectorXd &B)
+{
+  unsigned nterms = Monom.cols();
+  A.setZero(2*nterms, 2*nterms);
+  B.resize(2*nterms);
+  auto m = Monom.middleRows(First, Count);
+  Eigen::MatrixXd wm(Count, nterms);
+  wm.noalias() = Wxx.segment(First, Count).asDiagonal()*m;
+  A.topLeftCorner(nterms, nterms).triangularView<Eigen::Lower>() = m.transpose()*wm;
+  wm.noalias() = Wyy.segment(First, Count).asDiagonal()*m;
+  A.bottomRightCorner(nterms, nterms).triangularView<Eigen::Lower>() = m.transpose()*wm;
+  wm.noalias() = Wxy.segment(First, Count).asDiagonal()*m;
+  A.bottomLeftCorner(nterms, nterms).noalias() = m.transpose()*wm;
+  B.head(nterms).noalias() = m.transpose()*Bx.segment(First, Count);
+  B.tail(nterms).noalias() = m.transpose()*By.segment(First, Count);
+}
+
+/* below this number of matches per thread, splitting costs more
+   than it saves. */
+static const unsigned minMatchesPerThread = 5000;
+
+double GtransfoPoly::do_the_fit(const FitData &Data, const bool UseErrors)
+{
+  unsigned n = Data.monom.rows();
+  Eigen::Map<const Eigen::VectorXd> cx(&coeffs[0], nterms);
+  Eigen::Map<const Eigen::VectorXd> cy(&coeffs[nterms], nterms);
+  Eigen::VectorXd resx = Data.x2 - Data.monom*cx;
+  Eigen::VectorXd resy = Data.y2 - Data.monom*cy;
+  Eigen::VectorXd wxx(n), wyy(n), wxy(n);
+  if (UseErrors)
+    {
+      Eigen::VectorXd a11 = Data.dermx*cx;
+      Eigen::VectorXd a12 = Data.dermy*cx;
+      Eigen::VectorXd a21 = Data.dermx*cy;
+      Eigen::VectorXd a22 = Data.dermy*cy;
+      for (unsigned k=0; k<n; ++k)
 	{
-	  TransformPosAndErrors(point1, tr1);// we might consider recycling the monomials
-	  double vxx = (tr1.vx+point2.vx);
-	  double vyy = (tr1.vy+point2.vy);
-	  double vxy = (tr1.vxy+point2.vxy);
+	  // same error propagation as TransformPosAndErrors
+	  double vx = a11(k)*(a11(k)*Data.vx1(k) + 2*a12(k)*Data.vxy1(k)) + a12(k)*a12(k)*Data.vy1(k);
+	  double vy = a21(k)*a21(k)*Data.vx1(k) + a22(k)*a22(k)*Data.vy1(k) + 2.*a21(k)*a22(k)*Data.vxy1(k);
+	  double vxy = a21(k)*a11(k)*Data.vx1(k) + a22(k)*a12(k)*Data.vy1(k) + (a21(k)*a12(k)+a11(k)*a22(k))*Data.vxy1(k);
+	  double vxx = vx + Data.vx2(k);
+	  double vyy = vy + Data.vy2(k);
+	  vxy += Data.vxy2(k);
 	  double det = vxx*vyy-vxy*vxy;
-	  wxx = vyy/det;
-	  wyy = vxx/det;
-	  wxy = -vxy/det;
+	  wxx(k) = vyy/det;
+	  wyy(k) = vxx/det;
+	  wxy(k) = -vxy/det;
 	}
-      else
+    }
+  else
+    {
+      wxx.setOnes(); wyy.setOnes(); wxy.setZero();
+    }
+  Eigen::VectorXd bx = wxx.cwiseProduct(resx) + wxy.cwiseProduct(resy);
+  Eigen::VectorXd by = wyy.cwiseProduct(resy) + wxy.cwiseProduct(resx);
+  double sumr2 = resx.dot(bx) + resy.dot(by);
+
+  Eigen::MatrixXd A;
+  Eigen::VectorXd B;
+  unsigned nThreads = std::min(fitNThreads.load(), std::max(1u, n/minMatchesPerThread));
+  if (nThreads <= 1)
+    accumulate_normal_equations(Data.monom, wxx, wyy, wxy, bx, by, 0, n, A, B);
+  else
+    {
+      std::vector<Eigen::MatrixXd> partA(nThreads);
+      std::vector<Eigen::VectorXd> partB(nThreads);
+      std::vector<std::thread> threads;
+      for (unsigned t=0; t<nThreads; ++t)
 	{
-	  wxx = wyy = 1; wxy = 0;
-	  apply(point1.x, point1.y ,tr1.x, tr1.y);
+	  unsigned first = (n*t)/nThreads;
+	  unsigned count = (n*(t+1))/nThreads - first;
+	  threads.push_back(std::thread(accumulate_normal_equations,
+					std::cref(Data.monom), std::cref(wxx),
+					std::cref(wyy), std::cref(wxy),
+					std::cref(bx), std::cref(by), first, count,
+					std::ref(partA[t]), std::ref(partB[t])));
 	}
-      double resx = point2.x - tr1.x;
-      double resy = point2.y - tr1.y;
-      sumr2 += wxx*sq(resx) + wyy*sq(resy)
-	+2*wxy*resx*resy;
-
-      double bxcoeff = wxx*resx + wxy*resy ;
-      double bycoeff = wyy*resy + wxy*resx;
-      for (unsigned j=0; j<nterms; ++j)
+      for (auto &th : threads) th.join();
+      // summed in a fixed order, so that results do not depend on scheduling
+      A = partA[0];
+      B = partB[0];
+      for (unsigned t=1; t<nThreads; ++t)
 	{
-	  for (unsigned i=j; i<nterms; ++i)
-	    {
-	      A(i,j) += wxx*monomials[i]*monomials[j];
-	      A(i+nterms,j+nterms) += wyy*monomials[i]*monomials[j];
-	      A(j,i+nterms) = A(i,j+nterms) += wxy*monomials[i]*monomials[j];
-	    }
-	  B(j)        += bxcoeff*monomials[j];
-	  B(j+nterms) += bycoeff*monomials[j];
+	  A += partA[t];
+	  B += partB[t];
 	}
-    } // end loop on points
+    }
+
   Eigen::LDLT<Eigen::MatrixXd, Eigen::Lower> factor(A);
   // should probably throw
   if (factor.info() != Eigen::Success)
@@ -1051,7 +1434,7 @@ double GtransfoPoly::do_the_fit(const StarMatchList &List,
   
   Eigen::VectorXd sol = factor.solve(B);
   for (unsigned k=0; k< 2*nterms; ++k) coeffs[k] += sol(k);
-  if (List.size() == nterms) return 0;
+  if (n == nterms) return 0;
   return (sumr2-B.dot(sol));
 }
 
@@ -1065,10 +1448,12 @@ double  GtransfoPoly::fit(const StarMatchList &List)
     }
 
   GtransfoPoly conditionner = shift_and_normalize(List);
+  FitData data;
+  pack_matches(List, conditionner, data);
 
-  do_the_fit(List, conditionner, false); // get a rough solution
-  do_the_fit(List, conditionner, true); // weight with it
-  double chi2 = do_the_fit(List, conditionner, true); // once more
+  do_the_fit(data, false); // get a rough solution
+  do_the_fit(data, true); // weight with it
+  double chi2 = do_the_fit(data, true); // once more
   
   (*this) = (*this)*conditionner;
   if (List.size() == nterms) return 0;
@@ -1288,38 +1673,403 @@ void GtransfoPoly::Read(istream &s)
 }
 
 
+/* The direct transfo is sampled once, at the centers of a 50x50
+   grid of cells covering F. Monomials are ordered by total degree (see
+   compute_monomials), so that the least-squares problem of every
+   degree involves the leading columns of a single design matrix, which
+   is factorized once (Householder QR, without pivoting, which would
+   break this property). The residuals of all degrees then come from
+   the trailing components of Q^T b, and only the degree that reaches
+   the precision has to be solved for. The fit is carried out in
+   normalized coordinates, for the sake of conditioning. */
 GtransfoPoly *InversePolyTransfo(const Gtransfo &Direct, const Frame &F, const double Prec)
 {
-  StarMatchList sm;
-  unsigned nx = 50;
-  double stepx = F.Width()/(nx+1);
-  unsigned ny = 50;
-  double stepy= F.Height()/(ny+1);
-  for (unsigned i=0 ;i<nx; ++i)
-    for (unsigned j=0; j<ny; ++j)
+  const unsigned n = 50;
+  const unsigned npairs = n*n;
+  double stepx = F.Width()/n;
+  double stepy = F.Height()/n;
+  std::vector<double> xin(npairs), yin(npairs), xout(npairs), yout(npairs);
+  for (unsigned i=0 ;i<n; ++i)
+    for (unsigned j=0; j<n; ++j)
       {
-	Point in((i+0.5)*stepx, (j+0.5)*stepy);
-	Point out(Direct.apply(in));
-	sm.push_back(StarMatch(out, in , NULL,NULL));
+	xin[i*n+j] = F.xMin+(i+0.5)*stepx;
+	yin[i*n+j] = F.yMin+(j+0.5)*stepy;
       }
-  unsigned npairs = sm.size();
-  int maxdeg = 9;
-  int degree;
-  GtransfoPoly *poly = NULL;
-  for (degree=1; degree<=maxdeg; ++degree)
+  Direct.TransformArrays(xin.data(), yin.data(), xout.data(), yout.data(), npairs);
+  Frame domain(Point(xout[0], yout[0]), Point(xout[0], yout[0]));
+  for (unsigned k=0; k<npairs; ++k) domain += Frame(Point(xout[k], yout[k]), Point(xout[k], yout[k]));
+  GtransfoLin normalize = NormalizeCoordinatesTransfo(domain);
+  normalize.TransformArrays(xout.data(), yout.data(), xout.data(), yout.data(), npairs);
+
+  const unsigned maxdeg = 9;
+  const unsigned nterms = (maxdeg+1)*(maxdeg+2)/2;
+  Eigen::MatrixXd a(npairs, nterms);
+  Eigen::MatrixXd b(npairs, 2);
+  double xx[maxdeg+1], yy[maxdeg+1];
+  xx[0] = yy[0] = 1;
+  for (unsigned k=0; k<npairs; ++k)
     {
-      delete poly;
-      poly = new GtransfoPoly(degree);
-      poly->fit(sm);
-      // compute the chi2 ignoring errors:
-      double chi2 = 0;
-      for (auto i=sm.cbegin(); i!= sm.end(); ++i)
-	chi2 +=  i->point2.Dist2(poly->apply((i->point1)));
-      if (chi2/npairs< Prec*Prec) break;
+      for (unsigned p=1; p<=maxdeg; ++p)
+	{
+	  xx[p] = xx[p-1]*xout[k];
+	  yy[p] = yy[p-1]*yout[k];
+	}
+      // x^ix y^iy goes to column (ix+iy)*(ix+iy+1)/2+iy, as in compute_monomials
+      for (unsigned ix=0; ix<=maxdeg; ++ix)
+	for (unsigned iy=0; iy<=maxdeg-ix; ++iy)
+	  a(k, (ix+iy)*(ix+iy+1)/2+iy) = xx[ix]*yy[iy];
+      b(k,0) = xin[k];
+      b(k,1) = yin[k];
+    }
+  /* factorizing for degree 9 costs about 10 times more than for
+     degree 5, which is often enough: try the latter first. */
+  Eigen::HouseholderQR<Eigen::MatrixXd> qr;
+  Eigen::MatrixXd qtb;
+  unsigned degree = 1;
+  unsigned k = 0;
+  bool reached = false;
+  for (unsigned lastDeg : {5u, maxdeg})
+    {
+      qr.compute(a.leftCols((lastDeg+1)*(lastDeg+2)/2));
+      qtb = qr.householderQ().adjoint()*b;
+      for (; degree<=lastDeg; ++degree)
+	{
+	  k = (degree+1)*(degree+2)/2;
+	  double chi2 = qtb.bottomRows(npairs-k).squaredNorm();
+	  if (chi2/npairs < Prec*Prec) { reached = true; break;}
+	}
+      if (reached) break;
+    }
+  if (!reached)
+    {
+      cout << " InversePolyTransfo : Reached  max degree without reaching  requested precision = " << Prec << endl;
+      degree = maxdeg;
+    }
+  Eigen::MatrixXd sol = qr.matrixQR().topLeftCorner(k,k).triangularView<Eigen::Upper>().solve(qtb.topRows(k));
+  GtransfoPoly poly(degree);
+  for (unsigned ix=0; ix<=degree; ++ix)
+    for (unsigned iy=0; iy<=degree-ix; ++iy)
+      {
+	unsigned m = (ix+iy)*(ix+iy+1)/2+iy;
+	poly.Coeff(ix,iy,0) = sol(m,0);
+	poly.Coeff(ix,iy,1) = sol(m,1);
+      }
+  return new GtransfoPoly(poly*normalize);
+}
+
+
+/*************** GtransfoChebyshev **********************************/
+
+/* T_0..T_Deg at X, and (if not NULL) their derivatives, from the
+   usual recurrences: T_n = 2xT_{n-1}-T_{n-2}, and its derivative. */
+static void chebyshev_values(const double X, const unsigned Deg,
+			     double *T, double *DT)
+{
+  T[0] = 1;
+  if (DT) DT[0] = 0;
+  if (Deg == 0) return;
+  T[1] = X;
+  if (DT) DT[1] = 1;
+  for (unsigned n=2; n<=Deg; ++n)
+    {
+      T[n] = 2*X*T[n-1]-T[n-2];
+      if (DT) DT[n] = 2*T[n-1]+2*X*DT[n-1]-DT[n-2];
+    }
+}
+
+void GtransfoChebyshev::set_domain(const Frame &Domain)
+{
+  domain = Domain;
+  Point center = Domain.Center();
+  xCenter = center.x;
+  yCenter = center.y;
+  xScale = 2./Domain.Width();
+  yScale = 2./Domain.Height();
+}
+
+GtransfoChebyshev::GtransfoChebyshev(const unsigned Deg, const Frame &Domain)
+  : deg(Deg), nterms((Deg+1)*(Deg+2)/2), coeffs(2*nterms, 0.)
+{
+  set_domain(Domain);
+  // x = xCenter+T_1(xn)/xScale
+  Coeff(0,0,0) = xCenter;
+  Coeff(0,0,1) = yCenter;
+  if (deg>=1)
+    {
+      Coeff(1,0,0) = 1/xScale;
+      Coeff(0,1,1) = 1/yScale;
+    }
+}
+
+GtransfoChebyshev::GtransfoChebyshev(const Gtransfo* T,
+				     const Frame &Domain,
+				     unsigned Degree,
+				     unsigned NPoint)
+  : deg(Degree), nterms((Degree+1)*(Degree+2)/2), coeffs(2*nterms, 0.)
+{
+  set_domain(Domain);
+  // same sampling as the GtransfoPoly equivalent
+  double step = sqrt(fabs(Domain.Area())/double(NPoint));
+  std::vector<double> xin, yin;
+  for (double x=Domain.xMin+step/2; x<=Domain.xMax; x+=step)
+    for (double y=Domain.yMin+step/2; y<=Domain.yMax; y+=step)
+      {
+	xin.push_back(x);
+	yin.push_back(y);
+      }
+  std::vector<double> xout(xin.size()), yout(yin.size());
+  T->TransformArrays(xin.data(), yin.data(), xout.data(), yout.data(), xin.size());
+  least_squares(xin, yin, xout, yout);
+}
+
+void GtransfoChebyshev::ComputeBasis(const Point &Where, double *B,
+				     double *Bx, double *By) const
+{
+  double tx[deg+1], ty[deg+1]; // VLA
+  double dtx[deg+1], dty[deg+1]; // VLA
+  bool der = (Bx && By);
+  chebyshev_values((Where.x-xCenter)*xScale, deg, tx, der ? dtx : NULL);
+  chebyshev_values((Where.y-yCenter)*yScale, deg, ty, der ? dty : NULL);
+  // same ordering as GtransfoPoly::compute_monomials
+  for (unsigned ix=0; ix<=deg; ++ix)
+    {
+      unsigned k = ix*(ix+1)/2;
+      for (unsigned iy=0; iy<=deg-ix; ++iy)
+	{
+	  B[k] = tx[ix]*ty[iy];
+	  if (der)
+	    {
+	      Bx[k] = dtx[ix]*xScale*ty[iy];
+	      By[k] = tx[ix]*dty[iy]*yScale;
+	    }
+	  k += ix+iy+2;
+	}
+    }
+}
+
+void GtransfoChebyshev::ApplyBasis(const double *B, double &Xout, double &Yout) const
+{
+  const double *cx = &coeffs[0];
+  const double *cy = cx+nterms;
+  double xout = 0, yout = 0;
+  for (unsigned k=0; k<nterms; ++k)
+    {
+      xout += B[k]*cx[k];
+      yout += B[k]*cy[k];
+    }
+  Xout = xout;
+  Yout = yout;
+}
+
+void GtransfoChebyshev::apply(const double Xin, const double Yin,
+			      double &Xout, double &Yout) const
+{
+  double b[nterms]; // VLA
+  ComputeBasis(Point(Xin,Yin), b);
+  ApplyBasis(b, Xout, Yout);
+}
+
+void GtransfoChebyshev::Derivative(const Point &Where, GtransfoLin &Der,
+				   const double Step) const
+{
+  double a11, a12, a21, a22;
+  DerivativeMatrix(Where, a11, a12, a21, a22);
+  Der = GtransfoLin(0, 0, a11, a12, a21, a22);
+}
+
+void GtransfoChebyshev::DerivativeMatrix(const Point &Where, double &A11, double &A12,
+					 double &A21, double &A22, const double Step) const
+{
+  double b[3*nterms]; // VLA
+  double *bx = b+nterms;
+  double *by = bx+nterms;
+  ComputeBasis(Where, b, bx, by);
+  ApplyBasis(bx, A11, A21);
+  ApplyBasis(by, A12, A22);
+}
+
+void GtransfoChebyshev::TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const
+{
+  double b[3*nterms]; // VLA
+  double *bx = b+nterms;
+  double *by = bx+nterms;
+  ComputeBasis(In, b, bx, by);
+  FatPoint res; // nothing forbids &In == &Out
+  ApplyBasis(b, res.x, res.y);
+  double a11, a12, a21, a22;
+  ApplyBasis(bx, a11, a21);
+  ApplyBasis(by, a12, a22);
+  // same as GtransfoPoly::TransformPosAndErrors
+  res.vx = a11*(a11*In.vx + 2*a12*In.vxy) + a12*a12*In.vy;
+  res.vy = a21*a21*In.vx + a22*a22*In.vy + 2.*a21*a22*In.vxy;
+  res.vxy = a21*a11*In.vx + a22*a12*In.vy + (a21*a12+a11*a22)*In.vxy;
+  Out = res;
+}
+
+double GtransfoChebyshev::Coeff(const unsigned Degx, const unsigned Degy,
+				const unsigned WhichCoord) const
+{
+  assert((Degx+Degy<=deg) && WhichCoord<2);
+  return coeffs[(Degx+Degy)*(Degx+Degy+1)/2+Degy+WhichCoord*nterms];
+}
+
+double& GtransfoChebyshev::Coeff(const unsigned Degx, const unsigned Degy,
+				 const unsigned WhichCoord)
+{
+  assert((Degx+Degy<=deg) && WhichCoord<2);
+  return coeffs[(Degx+Degy)*(Degx+Degy+1)/2+Degy+WhichCoord*nterms];
+}
+
+double GtransfoChebyshev::ParamRef(const int i) const
+{
+  assert(unsigned(i)<2*nterms);
+  return coeffs[i];
+}
+
+double& GtransfoChebyshev::ParamRef(const int i)
+{
+  assert(unsigned(i)<2*nterms);
+  return coeffs[i];
+}
+
+void GtransfoChebyshev::ParamDerivatives(const Point &Where,
+					 double *Dx, double *Dy) const
+{/* first half : dxout/dpar, second half : dyout/dpar */
+  ComputeBasis(Where, Dx);
+  for (unsigned k=0; k<nterms; ++k)
+    {
+      Dy[nterms+k] = Dx[k];
+      Dx[nterms+k] = Dy[k] = 0;
+    }
+}
+
+/* the basis is well conditioned over the domain, so that a plain
+   (unpivoted) QR of the design matrix is accurate enough. */
+double GtransfoChebyshev::least_squares(const std::vector<double> &Xin,
+					const std::vector<double> &Yin,
+					const std::vector<double> &Xout,
+					const std::vector<double> &Yout)
+{
+  unsigned n = Xin.size();
+  if (n < nterms)
+    {
+      cerr << " GtransfoChebyshev::fit : trying to fit a degree " << deg << " transfo with only " << n << " matches " << endl;
+      return -1;
+    }
+  Eigen::MatrixXd a(n, nterms);
+  Eigen::MatrixXd b(n, 2);
+  double basis[nterms]; // VLA
+  for (unsigned k=0; k<n; ++k)
+    {
+      ComputeBasis(Point(Xin[k], Yin[k]), basis);
+      for (unsigned i=0; i<nterms; ++i) a(k,i) = basis[i];
+      b(k,0) = Xout[k];
+      b(k,1) = Yout[k];
+    }
+  Eigen::HouseholderQR<Eigen::MatrixXd> qr(a);
+  Eigen::MatrixXd sol = qr.solve(b);
+  for (unsigned i=0; i<nterms; ++i)
+    {
+      coeffs[i] = sol(i,0);
+      coeffs[nterms+i] = sol(i,1);
+    }
+  if (n == nterms) return 0;
+  return (a*sol-b).squaredNorm();
+}
+
+double GtransfoChebyshev::fit(const StarMatchList &List)
+{
+  std::vector<double> xin, yin, xout, yout;
+  for (auto it = List.begin(); it != List.end(); ++it)
+    {
+      xin.push_back(it->point1.x);
+      yin.push_back(it->point1.y);
+      xout.push_back(it->point2.x);
+      yout.push_back(it->point2.y);
+    }
+  return least_squares(xin, yin, xout, yout);
+}
+
+GtransfoPoly GtransfoChebyshev::ToPoly() const
+{
+  // monomial coefficients of T_0..T_deg: cheb[n][p] multiplies x^p in T_n.
+  std::vector<std::vector<double> > cheb(deg+1, std::vector<double>(deg+1, 0.));
+  cheb[0][0] = 1;
+  if (deg >= 1) cheb[1][1] = 1;
+  for (unsigned n=2; n<=deg; ++n)
+    for (unsigned p=0; p<=n; ++p)
+      cheb[n][p] = ((p>=1) ? 2*cheb[n-1][p-1] : 0) - cheb[n-2][p];
+  GtransfoPoly poly(deg);
+  for (unsigned ic=0; ic<2; ++ic)
+    {
+      for (unsigned ix=0; ix<=deg; ++ix)
+	for (unsigned iy=0; iy<=deg-ix; ++iy)
+	  poly.Coeff(ix,iy,ic) = 0;
+      for (unsigned ix=0; ix<=deg; ++ix)
+	for (unsigned iy=0; iy<=deg-ix; ++iy)
+	  {
+	    double c = Coeff(ix,iy,ic);
+	    if (c == 0) continue;
+	    for (unsigned px=0; px<=ix; ++px)
+	      for (unsigned py=0; py<=iy; ++py)
+		poly.Coeff(px,py,ic) += c*cheb[ix][px]*cheb[iy][py];
+	  }
+    }
+  // poly acts on normalized coordinates
+  return poly*NormalizeCoordinatesTransfo(domain);
+}
+
+void GtransfoChebyshev::dump(ostream &S) const
+{
+  S << "GtransfoChebyshev of degree " << deg << " over " << domain;
+  for (unsigned ic=0; ic<2; ++ic)
+    {
+      if (ic==0)   S << "newx = ";
+      else S << "newy = ";
+      for (unsigned p = 0; p<=deg; ++p)
+	for (unsigned py=0; py<=p; ++py)
+	  {
+	    if (p+py != 0) S<< " + ";
+	    S << Coeff(p-py,py,ic) << "*T" << p-py << "(x)T" << py << "(y)";
+	  }
+      S << endl;
     }
-  if (degree>maxdeg)
-    cout << " InversePolyTransfo : Reached  max degree without reaching  requested precision = " << Prec << endl;
-  return poly;
+}
+
+void GtransfoChebyshev::Write(ostream &s) const
+{
+  s << " GtransfoChebyshev 1"<< endl;
+  s << "degree " << deg << endl;
+  int oldprec=s.precision();
+  s << setprecision(12);
+  s << "domain " << domain.xMin << ' ' << domain.yMin << ' '
+    << domain.xMax << ' ' << domain.yMax << endl;
+  for (unsigned k=0;k<2*nterms; ++k)
+    s << coeffs[k] << ' ';
+  s << endl;
+  s << setprecision(oldprec);
+}
+
+void GtransfoChebyshev::Read(istream &s)
+{
+  int format;
+  s >> format;
+  if (format != 1)
+  throw LSST_EXCEPT(pex::exceptions::InvalidParameterError, " GtransfoChebyshev::Read : format is not 1 " );
+
+  string degree, dom;
+  s >> degree >> deg;
+  if (degree != "degree")
+    throw LSST_EXCEPT(pex::exceptions::InvalidParameterError, " GtransfoChebyshev::Read : expecting \"degree\" and found "+degree );
+  double xmin, ymin, xmax, ymax;
+  s >> dom >> xmin >> ymin >> xmax >> ymax;
+  if (dom != "domain")
+    throw LSST_EXCEPT(pex::exceptions::InvalidParameterError, " GtransfoChebyshev::Read : expecting \"domain\" and found "+dom );
+  set_domain(Frame(xmin, ymin, xmax, ymax));
+  nterms = (deg+1)*(deg+2)/2;
+  coeffs.assign(2*nterms, 0.);
+  for (unsigned k=0;k<2*nterms; ++k)
+    s >> coeffs[k];
 }
 
 
@@ -1562,33 +2312,151 @@ void  BaseTanWcs::operator = (const BaseTanWcs &Original)
 }
 
 
-void BaseTanWcs::apply(const double Xin, const double Yin,
-			 double &Xout, double &Yout) const
+/* Deprojection of the tangent plane coordinates L, M (radians) to
+   (ra, dec) in degrees, for a tangent point at (Ra0, asin(Sin0)). */
+static void tan_deproject(const double L, const double M,
+			  const double Ra0, const double Cos0, const double Sin0,
+			  double &Ra, double &Dec)
 {
-  double l,m; // radians in the tangent plane
-  Pix2TP(Xin,Yin,l,m); // l, m in degrees.
-  l = deg2rad(l);
-  m = deg2rad(m); // now in radians
   // Code inspired from worldpos.c in wcssubs (ancestor of the wcslib)
   /* At variance with wcslib, it collapses the projection to a plane
      and expression of sidereal cooordinates into a single set of
      operations. */
-  double dect = cos0 - m * sin0;
+  double dect = Cos0 - M * Sin0;
   if (dect == 0)
     {
       cerr << " no sideral coordinates at pole ! " << endl;
-      Xout = 0;
-      Yout = 0;
+      Ra = 0;
+      Dec = 0;
       return;
     }
-  double rat = ra0 + atan2(l, dect);
-  dect = atan(cos(rat-ra0) * (m * cos0 + sin0) / dect);
-  if (rat - ra0 >  M_PI) rat -= (2.*M_PI);
-  if (rat - ra0 < -M_PI) rat += (2.*M_PI);
+  double rat = Ra0 + atan2(L, dect);
+  dect = atan(cos(rat-Ra0) * (M * Cos0 + Sin0) / dect);
+  if (rat - Ra0 >  M_PI) rat -= (2.*M_PI);
+  if (rat - Ra0 < -M_PI) rat += (2.*M_PI);
   if (rat < 0.0) rat += (2.*M_PI);
   // convert to deg
-  Xout = rad2deg(rat);
-  Yout = rad2deg(dect);
+  Ra = rad2deg(rat);
+  Dec = rad2deg(dect);
+}
+
+/* Derivatives of (ra, dec) w.r.t. (l, m) at L, M (radians). They
+   apply as well to angles in degrees on both sides. With dect = cos0
+   - m sin0, ra = ra0 + atan2(l, dect) and dec = atan2(m cos0 + sin0,
+   sqrt(l^2+dect^2)). */
+static void tan_deprojection_derivative(const double L, const double M,
+					const double Cos0, const double Sin0,
+					double &A11, double &A12,
+					double &A21, double &A22)
+{
+  double dect = Cos0 - M * Sin0;
+  double z = M * Cos0 + Sin0;
+  double r2 = L*L + dect*dect;
+  double r = sqrt(r2);
+  double s2 = 1 + L*L + M*M; // = r2 + z^2
+  A11 = dect/r2;
+  A12 = L*Sin0/r2;
+  A21 = -z*L/(r*s2);
+  A22 = (r2*Cos0 + z*dect*Sin0)/(r*s2);
+}
+
+void BaseTanWcs::apply(const double Xin, const double Yin,
+			 double &Xout, double &Yout) const
+{
+  double l,m; // radians in the tangent plane
+  Pix2TP(Xin,Yin,l,m); // l, m in degrees.
+  tan_deproject(deg2rad(l), deg2rad(m), ra0, cos0, sin0, Xout, Yout);
+}
+
+void BaseTanWcs::Pix2TPDerivative(const Point &Where, Point &Tp, GtransfoLin &Der) const
+{
+  const double step = 0.01;
+  Pix2TP(Where.x, Where.y, Tp.x, Tp.y);
+  double xp, yp;
+  Pix2TP(Where.x+step, Where.y, xp, yp);
+  double a11 = (xp-Tp.x)/step;
+  double a21 = (yp-Tp.y)/step;
+  Pix2TP(Where.x, Where.y+step, xp, yp);
+  Der = GtransfoLin(0, 0, a11, (xp-Tp.x)/step, a21, (yp-Tp.y)/step);
+}
+
+void BaseTanWcs::Derivative(const Point &Where, GtransfoLin &Der,
+			    const double Step) const
+{
+  if (Step) {} // warning killer
+  Point tp;
+  Pix2TPDerivative(Where, tp, Der);
+  double a11, a12, a21, a22;
+  tan_deprojection_derivative(deg2rad(tp.x), deg2rad(tp.y), cos0, sin0,
+			      a11, a12, a21, a22);
+  left_multiply_derivative(a11, a12, a21, a22, Der);
+}
+
+void BaseTanWcs::TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const
+{
+  FatPoint res; // in case In and Out are the same address...
+  Point tp;
+  GtransfoLin der;
+  Pix2TPDerivative(In, tp, der);
+  double l = deg2rad(tp.x);
+  double m = deg2rad(tp.y);
+  tan_deproject(l, m, ra0, cos0, sin0, res.x, res.y);
+  double d11, d12, d21, d22;
+  tan_deprojection_derivative(l, m, cos0, sin0, d11, d12, d21, d22);
+  left_multiply_derivative(d11, d12, d21, d22, der);
+  double a11 = der.A11();
+  double a22 = der.A22();
+  double a21 = der.A21();
+  double a12 = der.A12();
+  res.vx = a11*(a11*In.vx + 2*a12*In.vxy) + a12*a12*In.vy;
+  res.vy = a21*a21*In.vx + a22*a22*In.vy + 2.*a21*a22*In.vxy;
+  res.vxy = a21*a11*In.vx + a22*a12*In.vy + (a21*a12+a11*a22)*In.vxy;
+  Out = res;
+}
+
+/* Same conventions as tan_deproject, in place, with tangent plane
+   coordinates in degrees. The direction (1, l, m) in the tangent
+   point frame is rotated to the equatorial frame: the ra offset is
+   the azimuth of the rotated vector, and the declination its
+   elevation, which replaces the atan and cos of tan_deproject by a
+   square root. The ra rotation reduces to adding Ra0. */
+static void tan_deproject_arrays(const double Ra0, const double Cos0,
+				 const double Sin0, double *X, double *Y,
+				 const unsigned N)
+{
+  const double deg2Rad = M_PI/180.;
+  const double rad2Deg = 180./M_PI;
+  for (unsigned k=0; k<N; ++k)
+    {
+      double l = X[k]*deg2Rad;
+      double m = Y[k]*deg2Rad;
+      double dect = Cos0 - m * Sin0;
+      if (dect == 0)
+	{
+	  cerr << " no sideral coordinates at pole ! " << endl;
+	  X[k] = 0;
+	  Y[k] = 0;
+	  continue;
+	}
+      double rat = Ra0 + atan2(l, dect);
+      double dec = atan2(m * Cos0 + Sin0, sqrt(l*l + dect*dect));
+      if (rat < 0.0) rat += (2.*M_PI);
+      X[k] = rat*rad2Deg;
+      Y[k] = dec*rad2Deg;
+    }
+}
+
+void BaseTanWcs::TransformArrays(const double *Xin, const double *Yin,
+				 double *Xout, double *Yout, const unsigned N) const
+{
+  Pix2TPArrays(Xin, Yin, Xout, Yout, N); // degrees
+  tan_deproject_arrays(ra0, cos0, sin0, Xout, Yout, N);
+}
+
+void BaseTanWcs::Pix2TPArrays(const double *Xpix, const double *Ypix,
+			      double *Xtp, double *Ytp, const unsigned N) const
+{
+  for (unsigned k=0; k<N; ++k) Pix2TP(Xpix[k], Ypix[k], Xtp[k], Ytp[k]);
 }
 
 Point BaseTanWcs::TangentPoint() const
@@ -1684,6 +2552,13 @@ Gtransfo*  TanPix2RaDec::InverseTransfo(const double Precision,
   else return new GtransfoInverse(this, Precision, Region);
 }
 
+Gtransfo*  TanPix2RaDec::PolyInverseTransfo(const double Precision,
+					    const Frame& Region) const
+{
+  if (!corr) return new TanRaDec2Pix(LinPart().invert(),TangentPoint());
+  else return Gtransfo::PolyInverseTransfo(Precision, Region);
+}
+
 
 GtransfoPoly TanPix2RaDec::Pix2TangentPlane() const
 {
@@ -1703,6 +2578,27 @@ void TanPix2RaDec::Pix2TP(const double &Xin, const double &Yin,
     }
 }
 
+void TanPix2RaDec::Pix2TPDerivative(const Point &Where, Point &Tp, GtransfoLin &Der) const
+{
+  linPix2Tan.apply(Where, Tp);
+  linPix2Tan.Derivative(Where, Der);
+  if (corr)
+    {
+      GtransfoLin corrDer;
+      corr->Derivative(Tp, corrDer);
+      corr->apply(Tp, Tp);
+      left_multiply_derivative(corrDer.A11(), corrDer.A12(),
+			       corrDer.A21(), corrDer.A22(), Der);
+    }
+}
+
+void TanPix2RaDec::Pix2TPArrays(const double *Xpix, const double *Ypix,
+				double *Xtp, double *Ytp, const unsigned N) const
+{
+  linPix2Tan.TransformArrays(Xpix, Ypix, Xtp, Ytp, N);
+  if (corr) corr->TransformArrays(Xtp, Ytp, Xtp, Ytp, N);
+}
+
 
 Gtransfo *TanPix2RaDec::Clone() const
 {
@@ -1786,6 +2682,33 @@ void TanSipPix2RaDec::Pix2TP(const double &Xin, const double &Yin,
   else linPix2Tan.apply(Xin, Yin, Xtp, Ytp);
 }
 
+void TanSipPix2RaDec::Pix2TPDerivative(const Point &Where, Point &Tp, GtransfoLin &Der) const
+{
+  if (corr)
+    {
+      corr->Derivative(Where, Der);
+      linPix2Tan.apply(corr->apply(Where), Tp);
+      left_multiply_derivative(linPix2Tan.A11(), linPix2Tan.A12(),
+			       linPix2Tan.A21(), linPix2Tan.A22(), Der);
+    }
+  else
+    {
+      linPix2Tan.Derivative(Where, Der);
+      linPix2Tan.apply(Where, Tp);
+    }
+}
+
+void TanSipPix2RaDec::Pix2TPArrays(const double *Xpix, const double *Ypix,
+				   double *Xtp, double *Ytp, const unsigned N) const
+{
+  if (corr)
+    {
+      corr->TransformArrays(Xpix, Ypix, Xtp, Ytp, N);
+      linPix2Tan.TransformArrays(Xtp, Ytp, Xtp, Ytp, N);
+    }
+  else linPix2Tan.TransformArrays(Xpix, Ypix, Xtp, Ytp, N);
+}
+
 
 Gtransfo *TanSipPix2RaDec::Clone() const
 {
@@ -1858,13 +2781,10 @@ GtransfoLin TanRaDec2Pix::LinPart() const
   return linTan2Pix;
 }
 
-// Use analytic derivatives, computed at the same time as the transform itself
-void TanRaDec2Pix::TransformPosAndErrors(const FatPoint &In,
-					 FatPoint &Out) const
-{
-  /* this routine is very similar to apply, but also propagates errors.
-     The deg2rad and rad2deg are ignored for errors because they act as
-     2 global scalings that cancel each other.
+/* Projection of (ra,dec) (degrees) onto the tangent plane (l, m,
+   in radians), and derivatives of (l,m) w.r.t (ra,dec). The deg2rad
+   and rad2deg are ignored for derivatives because they act as 2
+   global scalings that cancel each other.
      Derivatives were computed using maple:
 
      l1 := sin(a - a0)*cos(d);
@@ -1876,29 +2796,53 @@ void TanRaDec2Pix::TransformPosAndErrors(const FatPoint &In,
      simplify(diff(l2/m1,d));
 
      Checked against Gtransfo::TransformPosAndErrors (dec 09)
-  */
-  double ra = deg2rad(In.x);
-  double dec = deg2rad(In.y);
-  if (ra-ra0 >  M_PI ) ra -= (2.* M_PI);
-  if (ra-ra0 < -M_PI ) ra += (2.* M_PI);
+*/
+static void tan_project_with_derivative(const double Ra, const double Dec,
+					const double Ra0, const double Cos0,
+					const double Sin0,
+					double &L, double &M, GtransfoLin &Der)
+{
+  double ra = deg2rad(Ra);
+  double dec = deg2rad(Dec);
+  if (ra-Ra0 >  M_PI ) ra -= (2.* M_PI);
+  if (ra-Ra0 < -M_PI ) ra += (2.* M_PI);
   // Code inspired from worldpos.c in wcssubs (ancestor of the wcslib)
-  // The same code is copied in ::apply()
+  // The same code is copied in TanRaDec2Pix::apply()
   
   double coss = cos(dec);
   double sins = sin(dec);
-  double sinda = sin(ra-ra0);
-  double cosda = cos(ra -ra0);
+  double sinda = sin(ra-Ra0);
+  double cosda = cos(ra -Ra0);
   double l = sinda * coss;
-  double m = sins * sin0 + coss * cos0 * cosda;
-  l = l/m;
-  m = (sins * cos0 - coss * sin0 * cosda)/ m;
+  double m = sins * Sin0 + coss * Cos0 * cosda;
+  L = l/m;
+  M = (sins * Cos0 - coss * Sin0 * cosda)/ m;
 
   // derivatives
-  double deno = sq(sin0)-sq(coss)+sq(coss*cos0)*(1+sq(cosda))+2*sins*sin0*coss*cos0*cosda;
-  double a11 = coss*(cosda*sins*sin0+coss*cos0)/deno;
-  double a12 = -sinda*sin0/deno;
+  double deno = sq(Sin0)-sq(coss)+sq(coss*Cos0)*(1+sq(cosda))+2*sins*Sin0*coss*Cos0*cosda;
+  double a11 = coss*(cosda*sins*Sin0+coss*Cos0)/deno;
+  double a12 = -sinda*Sin0/deno;
   double a21 = coss*sinda*sins/deno;
   double a22 = cosda/deno;
+  Der.Coeff(0,0,0) = Der.Coeff(0,0,1) = 0;
+  Der.Coeff(1,0,0) = a11;
+  Der.Coeff(0,1,0) = a12;
+  Der.Coeff(1,0,1) = a21;
+  Der.Coeff(0,1,1) = a22;
+}
+
+// Use analytic derivatives, computed at the same time as the transform itself
+void TanRaDec2Pix::TransformPosAndErrors(const FatPoint &In,
+					 FatPoint &Out) const
+{
+  /* this routine is very similar to apply, but also propagates errors. */
+  double l, m;
+  GtransfoLin der;
+  tan_project_with_derivative(In.x, In.y, ra0, cos0, sin0, l, m, der);
+  double a11 = der.A11();
+  double a12 = der.A12();
+  double a21 = der.A21();
+  double a22 = der.A22();
   
   FatPoint tmp;
   tmp.vx = a11*(a11*In.vx + 2*a12*In.vxy) + a12*a12*In.vy;
@@ -1912,6 +2856,16 @@ void TanRaDec2Pix::TransformPosAndErrors(const FatPoint &In,
   linTan2Pix.TransformPosAndErrors(tmp, Out);
 }
 
+void TanRaDec2Pix::Derivative(const Point &Where, GtransfoLin &Der,
+			      const double Step) const
+{
+  if (Step) {} // warning killer
+  double l, m;
+  tan_project_with_derivative(Where.x, Where.y, ra0, cos0, sin0, l, m, Der);
+  left_multiply_derivative(linTan2Pix.A11(), linTan2Pix.A12(),
+			   linTan2Pix.A21(), linTan2Pix.A22(), Der);
+}
+
 
 void TanRaDec2Pix::apply(const double Xin, const double Yin, double &Xout, double &Yout) const
 {
@@ -1934,6 +2888,43 @@ void TanRaDec2Pix::apply(const double Xin, const double Yin, double &Xout, doubl
 }
 
 
+/* Projection of (ra,dec) (degrees) to the tangent plane (degrees),
+   as in TanRaDec2Pix::apply, with sin and cos computed once per angle
+   (apply computes cos(ra-ra0) twice). Xout (Yout) may be the same
+   array as Xin (Yin). */
+static void tan_project_arrays(const double *Xin, const double *Yin,
+			       const double Ra0, const double Cos0,
+			       const double Sin0, double *Xout, double *Yout,
+			       const unsigned N)
+{
+  const double deg2Rad = M_PI/180.;
+  const double rad2Deg = 180./M_PI;
+  for (unsigned k=0; k<N; ++k)
+    {
+      double da = Xin[k]*deg2Rad - Ra0;
+      if (da >  M_PI ) da -= (2.* M_PI);
+      if (da < -M_PI ) da += (2.* M_PI);
+      double dec = Yin[k]*deg2Rad;
+      double coss = cos(dec);
+      double sins = sin(dec);
+      double cosda = cos(da);
+      double sinda = sin(da);
+      double inv = 1./(sins * Sin0 + coss * Cos0 * cosda);
+      Xout[k] = (sinda * coss)*inv*rad2Deg;
+      Yout[k] = (sins * Cos0 - coss * Sin0 * cosda)*inv*rad2Deg;
+    }
+}
+
+/* Same as apply, with the tangent point trigonometry from the
+   constructor, and the linear part applied to all points at once. */
+void TanRaDec2Pix::TransformArrays(const double *Xin, const double *Yin,
+				   double *Xout, double *Yout, const unsigned N) const
+{
+  tan_project_arrays(Xin, Yin, ra0, cos0, sin0, Xout, Yout, N);
+  linTan2Pix.TransformArrays(Xout, Yout, Xout, Yout, N);
+}
+
+
 TanPix2RaDec TanRaDec2Pix::invert() const
 {
   return TanPix2RaDec(LinPart().invert(),TangentPoint());
@@ -1972,6 +2963,406 @@ double TanRaDec2Pix::fit(const StarMatchList &List)
   return -1;
 }
 
+/*************** GtransfoFlatten ********************/
+
+/* One stage of a flattened transfo. Tangent plane coordinates are in
+   degrees, as everywhere else. */
+struct FlatStage
+{
+  enum Kind {Poly, Deproject, Project, Homography, Other};
+  Kind kind;
+  CountedRef<GtransfoPoly> poly; // for Poly
+  GtransfoRef other; // for Other
+  double ra0, dec0, cos0, sin0; // tangent point (radians) for (De)Project
+  double h[9]; // row-major, for Homography (degrees on both sides)
+
+  explicit FlatStage(const GtransfoPoly &P) :
+    kind(Poly), poly(new GtransfoPoly(P)) {}
+  explicit FlatStage(const Gtransfo &T) : kind(Other), other(T.Clone()) {}
+  FlatStage(const Kind K, const Point &TangentPoint) : kind(K)
+  {
+    ra0 = deg2rad(TangentPoint.x);
+    dec0 = deg2rad(TangentPoint.y);
+    cos0 = cos(dec0);
+    sin0 = sin(dec0);
+  }
+
+  bool IsLinear() const { return kind == Poly && poly->Degree() == 1;}
+};
+
+
+/* The (l,m) of tangent plane A, as a direction (l,m,1), is rotated to
+   the tangent point frame of B. The result, divided by its third
+   component, is the projection on tangent plane B: a projective
+   transformation. The basis of a tangent point frame is (east, north,
+   tangent point). */
+static void tangent_point_basis(const FlatStage &S, double B[3][3])
+{
+  double ca = cos(S.ra0), sa = sin(S.ra0);
+  B[0][0] = -sa;            B[1][0] = ca;             B[2][0] = 0;
+  B[0][1] = -S.sin0*ca;     B[1][1] = -S.sin0*sa;     B[2][1] = S.cos0;
+  B[0][2] = S.cos0*ca;      B[1][2] = S.cos0*sa;      B[2][2] = S.sin0;
+}
+
+static void tangent_plane_homography(const FlatStage &From, const FlatStage &To,
+				     double H[9])
+{
+  double a[3][3], b[3][3];
+  tangent_point_basis(From, a);
+  tangent_point_basis(To, b);
+  for (unsigned i=0; i<3; ++i)
+    for (unsigned j=0; j<3; ++j)
+      {
+	double sum = 0;
+	for (unsigned k=0; k<3; ++k) sum += b[k][i]*a[k][j];
+	H[3*i+j] = sum;
+      }
+  // the rotation acts on radians, H on degrees.
+  H[2] *= rad2deg(1.); H[5] *= rad2deg(1.);
+  H[6] *= deg2rad(1.); H[7] *= deg2rad(1.);
+}
+
+// H = Left*Right, for 3x3 row-major matrices.
+static void multiply_homographies(const double Left[9], const double Right[9],
+				  double H[9])
+{
+  double res[9];
+  for (unsigned i=0; i<3; ++i)
+    for (unsigned j=0; j<3; ++j)
+      res[3*i+j] = Left[3*i]*Right[j] + Left[3*i+1]*Right[3+j]
+	+ Left[3*i+2]*Right[6+j];
+  for (unsigned k=0; k<9; ++k) H[k] = res[k];
+}
+
+static void linear_homography(const GtransfoPoly &Lin, double H[9])
+{
+  H[0] = Lin.Coeff(1,0,0); H[1] = Lin.Coeff(0,1,0); H[2] = Lin.Coeff(0,0,0);
+  H[3] = Lin.Coeff(1,0,1); H[4] = Lin.Coeff(0,1,1); H[5] = Lin.Coeff(0,0,1);
+  H[6] = 0; H[7] = 0; H[8] = 1;
+}
+
+static bool is_identity_poly(const GtransfoPoly &P)
+{
+  return P.Degree() == 1 &&
+    P.Coeff(0,0,0) == 0 && P.Coeff(1,0,0) == 1 && P.Coeff(0,1,0) == 0 &&
+    P.Coeff(0,0,1) == 0 && P.Coeff(1,0,1) == 0 && P.Coeff(0,1,1) == 1;
+}
+
+/* Appends the stages of T (in the order they apply) to Stages,
+   reducing the tail of Stages each time a stage is appended. */
+static void append_flat_stage(std::vector<FlatStage> &Stages, const FlatStage &S);
+
+static void flatten_stages(const Gtransfo *T, std::vector<FlatStage> &Stages)
+{
+  if (IsIdentity(T)) return;
+  const GtransfoComposition *compo = dynamic_cast<const GtransfoComposition *>(T);
+  if (compo)
+    {
+      flatten_stages(compo->First(), Stages);
+      flatten_stages(compo->Second(), Stages);
+      return;
+    }
+  const GtransfoPoly *poly = dynamic_cast<const GtransfoPoly *>(T);
+  if (poly)
+    {
+      append_flat_stage(Stages, FlatStage(*poly));
+      return;
+    }
+  const BaseTanWcs *wcs = dynamic_cast<const BaseTanWcs *>(T);
+  if (wcs)
+    {
+      append_flat_stage(Stages, FlatStage(wcs->Pix2TangentPlane()));
+      append_flat_stage(Stages, FlatStage(FlatStage::Deproject, wcs->TangentPoint()));
+      return;
+    }
+  const TanRaDec2Pix *proj = dynamic_cast<const TanRaDec2Pix *>(T);
+  if (proj)
+    {
+      append_flat_stage(Stages, FlatStage(FlatStage::Project, proj->TangentPoint()));
+      append_flat_stage(Stages, FlatStage(proj->LinPart()));
+      return;
+    }
+  append_flat_stage(Stages, FlatStage(*T));
+}
+
+/* Polynomials are only composed when one of them is linear, so that
+   the degree does not grow. */
+static void append_flat_stage(std::vector<FlatStage> &Stages, const FlatStage &S)
+{
+  if (S.kind == FlatStage::Poly && is_identity_poly(*S.poly)) return;
+  Stages.push_back(S);
+  while (Stages.size() >= 2)
+    {
+      FlatStage &first = Stages[Stages.size()-2];
+      const FlatStage &second = Stages.back();
+      if (first.kind == FlatStage::Poly && second.kind == FlatStage::Poly
+	  && (first.IsLinear() || second.IsLinear()))
+	first.poly = new GtransfoPoly((*second.poly)*(*first.poly));
+      else if (first.kind == FlatStage::Deproject && second.kind == FlatStage::Project)
+	{
+	  if (first.ra0 == second.ra0 && first.dec0 == second.dec0)
+	    {// the projection undoes the deprojection
+	      Stages.pop_back();
+	      Stages.pop_back();
+	      continue;
+	    }
+	  tangent_plane_homography(first, second, first.h);
+	  first.kind = FlatStage::Homography;
+	}
+      else if (first.kind == FlatStage::Homography && second.IsLinear())
+	{
+	  double lin[9];
+	  linear_homography(*second.poly, lin);
+	  multiply_homographies(lin, first.h, first.h);
+	}
+      else if (first.IsLinear() && second.kind == FlatStage::Homography)
+	{
+	  double lin[9];
+	  linear_homography(*first.poly, lin);
+	  multiply_homographies(second.h, lin, first.h);
+	  first.kind = FlatStage::Homography;
+	  first.poly.reset();
+	}
+      else if (first.kind == FlatStage::Homography && second.kind == FlatStage::Homography)
+	multiply_homographies(second.h, first.h, first.h);
+      else break;
+      Stages.pop_back();
+      if (Stages.back().kind == FlatStage::Poly && is_identity_poly(*Stages.back().poly))
+	Stages.pop_back();
+    }
+}
+
+
+//! Private class to evaluate a flattened chain of transfos. Use the routine GtransfoFlatten to get one.
+class GtransfoFlat : public Gtransfo {
+  private :
+    std::vector<FlatStage> stages;
+
+    void apply_stage(const FlatStage &S, const double Xin, const double Yin,
+		     double &Xout, double &Yout) const;
+
+    // position and derivative at the same time
+    void apply_with_derivative(const Point &Where, Point &Out,
+			       GtransfoLin &Der, const double Step) const;
+
+  public :
+    using Gtransfo::apply;
+
+    GtransfoFlat(const std::vector<FlatStage> &Stages) : stages(Stages) {}
+
+    void apply(const double Xin, const double Yin, double &Xout, double &Yout) const;
+
+    //! stage by stage over the whole arrays.
+    void TransformArrays(const double *Xin, const double *Yin,
+			 double *Xout, double *Yout, const unsigned N) const;
+
+    //! chain rule over the stages, analytic except for non-reduced stages.
+    void Derivative(const Point &Where, GtransfoLin &Der,
+		    const double Step = 0.01) const;
+
+    //! a mix of apply and Derivative
+    void TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const;
+
+    void dump(ostream &stream = cout) const;
+
+    double fit(const StarMatchList &List);
+
+    Gtransfo *Clone() const { return new GtransfoFlat(*this);}
+};
+
+
+void GtransfoFlat::apply_stage(const FlatStage &S, const double Xin, const double Yin,
+			       double &Xout, double &Yout) const
+{
+  switch (S.kind)
+    {
+    case FlatStage::Poly :
+      S.poly->GtransfoPoly::apply(Xin, Yin, Xout, Yout);
+      break;
+    case FlatStage::Deproject :
+      tan_deproject(deg2rad(Xin), deg2rad(Yin), S.ra0, S.cos0, S.sin0, Xout, Yout);
+      break;
+    case FlatStage::Project :
+      tan_project_arrays(&Xin, &Yin, S.ra0, S.cos0, S.sin0, &Xout, &Yout, 1);
+      break;
+    case FlatStage::Homography :
+      {
+	const double *h = S.h;
+	double inv = 1./(h[6]*Xin + h[7]*Yin + h[8]);
+	double x = (h[0]*Xin + h[1]*Yin + h[2])*inv;
+	Yout = (h[3]*Xin + h[4]*Yin + h[5])*inv;
+	Xout = x;
+      }
+      break;
+    case FlatStage::Other :
+      S.other->apply(Xin, Yin, Xout, Yout);
+      break;
+    }
+}
+
+void GtransfoFlat::apply(const double Xin, const double Yin,
+			 double &Xout, double &Yout) const
+{
+  Xout = Xin;
+  Yout = Yin;
+  for (auto s = stages.begin(); s != stages.end(); ++s)
+    apply_stage(*s, Xout, Yout, Xout, Yout);
+}
+
+void GtransfoFlat::TransformArrays(const double *Xin, const double *Yin,
+				   double *Xout, double *Yout, const unsigned N) const
+{
+  if (Xout != Xin) std::copy(Xin, Xin+N, Xout);
+  if (Yout != Yin) std::copy(Yin, Yin+N, Yout);
+  for (auto s = stages.begin(); s != stages.end(); ++s)
+    switch (s->kind)
+      {
+      case FlatStage::Poly :
+	s->poly->GtransfoPoly::TransformArrays(Xout, Yout, Xout, Yout, N);
+	break;
+      case FlatStage::Deproject :
+	tan_deproject_arrays(s->ra0, s->cos0, s->sin0, Xout, Yout, N);
+	break;
+      case FlatStage::Project :
+	tan_project_arrays(Xout, Yout, s->ra0, s->cos0, s->sin0, Xout, Yout, N);
+	break;
+      case FlatStage::Homography :
+	for (unsigned k=0; k<N; ++k) apply_stage(*s, Xout[k], Yout[k], Xout[k], Yout[k]);
+	break;
+      case FlatStage::Other :
+	s->other->TransformArrays(Xout, Yout, Xout, Yout, N);
+	break;
+      }
+}
+
+/* The Jacobian is accumulated in plain doubles: Der only serves as
+   scratch for the stages that provide their derivative as a
+   GtransfoLin. */
+void GtransfoFlat::apply_with_derivative(const Point &Where, Point &Out,
+					 GtransfoLin &Der, const double Step) const
+{
+  double j11 = 1, j12 = 0, j21 = 0, j22 = 1;
+  Point p = Where;
+  for (auto s = stages.begin(); s != stages.end(); ++s)
+    {
+      double a11, a12, a21, a22;
+      Point next;
+      switch (s->kind)
+	{
+	case FlatStage::Poly :
+	  s->poly->GtransfoPoly::Derivative(p, Der);
+	  a11 = Der.A11(); a12 = Der.A12(); a21 = Der.A21(); a22 = Der.A22();
+	  apply_stage(*s, p.x, p.y, next.x, next.y);
+	  break;
+	case FlatStage::Deproject :
+	  tan_deprojection_derivative(deg2rad(p.x), deg2rad(p.y), s->cos0, s->sin0,
+				      a11, a12, a21, a22);
+	  apply_stage(*s, p.x, p.y, next.x, next.y);
+	  break;
+	case FlatStage::Project :
+	  tan_project_with_derivative(p.x, p.y, s->ra0, s->cos0, s->sin0,
+				      next.x, next.y, Der);
+	  next.x = rad2deg(next.x);
+	  next.y = rad2deg(next.y);
+	  a11 = Der.A11(); a12 = Der.A12(); a21 = Der.A21(); a22 = Der.A22();
+	  break;
+	case FlatStage::Homography :
+	  {
+	    const double *h = s->h;
+	    double inv = 1./(h[6]*p.x + h[7]*p.y + h[8]);
+	    apply_stage(*s, p.x, p.y, next.x, next.y);
+	    a11 = (h[0] - next.x*h[6])*inv;
+	    a12 = (h[1] - next.x*h[7])*inv;
+	    a21 = (h[3] - next.y*h[6])*inv;
+	    a22 = (h[4] - next.y*h[7])*inv;
+	  }
+	  break;
+	default : // Other
+	  s->other->Derivative(p, Der, Step);
+	  a11 = Der.A11(); a12 = Der.A12(); a21 = Der.A21(); a22 = Der.A22();
+	  apply_stage(*s, p.x, p.y, next.x, next.y);
+	  break;
+	}
+      double t11 = a11*j11 + a12*j21;
+      double t12 = a11*j12 + a12*j22;
+      double t21 = a21*j11 + a22*j21;
+      double t22 = a21*j12 + a22*j22;
+      j11 = t11; j12 = t12; j21 = t21; j22 = t22;
+      p = next;
+    }
+  Out = p;
+  Der.Coeff(0,0,0) = Der.Coeff(0,0,1) = 0;
+  Der.Coeff(1,0,0) = j11;
+  Der.Coeff(0,1,0) = j12;
+  Der.Coeff(1,0,1) = j21;
+  Der.Coeff(0,1,1) = j22;
+}
+
+void GtransfoFlat::Derivative(const Point &Where, GtransfoLin &Der,
+			      const double Step) const
+{
+  Point out;
+  apply_with_derivative(Where, out, Der, Step);
+}
+
+void GtransfoFlat::TransformPosAndErrors(const FatPoint &In, FatPoint &Out) const
+{
+  FatPoint res; // in case In and Out are the same address...
+  GtransfoLin der;
+  apply_with_derivative(In, res, der, 0.01);
+  double a11 = der.A11();
+  double a22 = der.A22();
+  double a21 = der.A21();
+  double a12 = der.A12();
+  res.vx = a11*(a11*In.vx + 2*a12*In.vxy) + a12*a12*In.vy;
+  res.vy = a21*a21*In.vx + a22*a22*In.vy + 2.*a21*a22*In.vxy;
+  res.vxy = a21*a11*In.vx + a22*a12*In.vy + (a21*a12+a11*a22)*In.vxy;
+  Out = res;
+}
+
+void GtransfoFlat::dump(ostream &stream) const
+{
+  for (auto s = stages.begin(); s != stages.end(); ++s)
+    switch (s->kind)
+      {
+      case FlatStage::Poly : s->poly->dump(stream); break;
+      case FlatStage::Deproject :
+	stream << " deprojection, tangent point " << rad2deg(s->ra0) << ' '
+	       << rad2deg(s->dec0) << endl;
+	break;
+      case FlatStage::Project :
+	stream << " projection, tangent point " << rad2deg(s->ra0) << ' '
+	       << rad2deg(s->dec0) << endl;
+	break;
+      case FlatStage::Homography :
+	stream << " tangent plane to tangent plane :";
+	for (unsigned k=0; k<9; ++k) stream << ' ' << s->h[k];
+	stream << endl;
+	break;
+      case FlatStage::Other : s->other->dump(stream); break;
+      }
+}
+
+double GtransfoFlat::fit(const StarMatchList &List)
+{
+  if (&List) {} // warning killer
+  throw LSST_EXCEPT(pex::exceptions::InvalidParameterError, "GtransfoFlat::fit is NOT implemented: fit the original transfo");
+  return -1;
+}
+
+
+Gtransfo *GtransfoFlatten(const Gtransfo *T)
+{
+  std::vector<FlatStage> stages;
+  flatten_stages(T, stages);
+  if (stages.empty()) return new GtransfoIdentity;
+  if (stages.size() == 1 && stages[0].kind == FlatStage::Poly)
+    return stages[0].poly->Clone();
+  if (stages.size() == 1 && stages[0].kind == FlatStage::Other)
+    return stages[0].other->Clone();
+  return new GtransfoFlat(stages);
+}
+
 /*************  a "run-time" transfo, that does not require to
 modify this file */
 
@@ -2035,6 +3426,8 @@ Gtransfo* GtransfoRead(istream &s)
     {GtransfoIdentity* res = new GtransfoIdentity(); res->Read(s); return res;}
   else if (type == "GtransfoPoly")
     {GtransfoPoly* res = new GtransfoPoly(); res->Read(s); return res;}
+  else if (type == "GtransfoChebyshev")
+    {GtransfoChebyshev* res = new GtransfoChebyshev(1, Frame(-1,-1,1,1)); res->Read(s); return res;}
   else
     throw LSST_EXCEPT(pex::exceptions::InvalidParameterError, " GtransfoRead : No reader for Gtransfo type "+ type);
 }
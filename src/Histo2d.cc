@@ -55,6 +55,13 @@ void Histo2d::Fill(float X, float Y, float Weight)
   if (indices(X,Y,ix,iy)) data[iy + ny*ix] += Weight;
 }
 
+int Histo2d::BinCode(float X, float Y) const
+{
+  int ix, iy;
+  if (indices(X,Y,ix,iy)) return iy + ny*ix;
+  return -1;
+}
+
 double Histo2d::MaxBin(double &X, double &Y) const
 {
   float *p, *pend;
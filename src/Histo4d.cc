@@ -1,7 +1,6 @@
 #include <iostream>
 #include <math.h> /* for floor */
-#include <string.h> /* for memset*/
-#include <algorithm> /* for sort */
+#include <algorithm> /* for make_heap */
 #include <limits.h>
 
 #include "lsst/jointcal/Histo4d.h"
@@ -17,8 +16,7 @@ SparseHisto4d::SparseHisto4d(const int N1, double Min1, double Max1,
 			     const int N4, double Min4, double Max4,
 			     const int nEntries)
 {
-  double indexMax = N1*N2*N3*N4;
-  data = NULL;
+  double indexMax = double(N1)*N2*N3*N4;
   if (indexMax > double(INT_MAX))
     {
       cerr << " cannot hold a 4D histo with more than " << INT_MAX 	   << " values " <<  endl;
@@ -38,10 +36,10 @@ SparseHisto4d::SparseHisto4d(const int N1, double Min1, double Max1,
   
   for (int i =0; i < 4; ++i)
     scale[i] = n[i]/(maxVal[i]-minVal[i]);
-  data = new int[nEntries];
-  dataSize = nEntries;
+  // there are usually much fewer non-empty bins than entries.
+  counts.reserve(nEntries);
   ndata = 0;
-  sorted = false;
+  heapValid = false;
 }
 
 int SparseHisto4d::code_value(const double X[4]) const
@@ -68,76 +66,74 @@ void SparseHisto4d::inverse_code(const int ACode, double X[4]) const
 }
 
 
-void SparseHisto4d::sort()
+void SparseHisto4d::add_code(const int Code)
 {
-  if (!sorted)
-    {
-      std::sort(data, data+ndata);
-      sorted = true;
-    }
+  counts[Code]++;
+  ndata++;
+  heapValid = false;
 }
 
-
 void SparseHisto4d::Fill(const double X[4])
-
 {
   int code = code_value(X);
   if (code <0) return;
-  if (ndata == dataSize)
-    {
-      int* newData = new int[dataSize*2];
-      memcpy(newData, data, dataSize*sizeof(data[0]));
-      delete [] data;
-      data = newData;
-      dataSize *= 2;
-    }
-  data[ndata++] = code;
-  sorted = false;
+  add_code(code);
 }
 
 void SparseHisto4d::Fill(const double X1, const double X2, const double X3, const double X4)
 {
-  static double X[4];
+  double X[4];
   X[0] = X1; X[1] = X2; X[2] = X3; X[3] = X4; Fill(X);
 }
 
+void SparseHisto4d::FillCodes(const int *Codes, const int N)
+{
+  for (int i=0; i<N; ++i)
+    if (Codes[i] >= 0) add_code(Codes[i]);
+}
+
+/* heap order : largest content first, then lowest code (which is
+   what the former sort-based implementation returned). */
+static bool HeapLess(const std::pair<int,int> &L, const std::pair<int,int> &R)
+{
+  return (L.first != R.first) ? (L.first < R.first) : (L.second > R.second);
+}
+
+void SparseHisto4d::build_heap()
+{
+  heap.clear();
+  heap.reserve(counts.size());
+  for (auto i = counts.begin(); i != counts.end(); ++i)
+    if (i->second > 0) heap.push_back(std::make_pair(i->second, i->first));
+  std::make_heap(heap.begin(), heap.end(), HeapLess);
+  heapValid = true;
+}
+
 int SparseHisto4d::MaxBin(double X[4])
 {
-  sort();
-  if (ndata == 0) return 0;
-  int maxval=data[0];
-  int maxCount=1;
-  int oldval = data[0];
-  int currentCount = 1;
-  for (int i=1; i < ndata; ++i)
+  if (!heapValid) build_heap();
+  // discard entries of bins zeroed since the heap was built
+  while (!heap.empty())
     {
-      if (data[i] == oldval) currentCount++;
-      else currentCount = 1;
-      if (currentCount > maxCount)
-	{
-	  maxCount = currentCount;
-	  maxval = data[i];
-	}
-      oldval = data[i];
+      const std::pair<int,int> &top = heap.front();
+      auto it = counts.find(top.second);
+      if (it != counts.end() && it->second == top.first) break;
+      std::pop_heap(heap.begin(), heap.end(), HeapLess);
+      heap.pop_back();
     }
-  inverse_code(maxval, X);
-  return maxCount;
+  if (heap.empty()) return 0;
+  inverse_code(heap.front().second, X);
+  return heap.front().first;
 }
 
 void SparseHisto4d::ZeroBin(double X[4])
 {
-  sort();
   int code = code_value(X);
-  // inefficient locator...
-  int start = 0;
-  while ((data[start] < code) && start < ndata) start++;
-  // find how many identical entries we have
-  int end = min(start+1,ndata);
-  while (end < ndata && data[start] == data[end]) end++;
-  int shift = end-start;
-  int lastShift = ndata - (end-start);
-  for (int i=start; i< lastShift; ++i) data[i] = data[i+shift];
-  ndata -= shift;
+  auto it = counts.find(code);
+  if (it == counts.end()) return;
+  ndata -= it->second;
+  counts.erase(it);
+  // the heap entry of this bin is now stale, and will be skipped.
 }
 
 void SparseHisto4d::BinLimits(const double X[4], const int Idim, double &Xmin, double &Xmax) const
@@ -151,8 +147,8 @@ void SparseHisto4d::BinLimits(const double X[4], const int Idim, double &Xmin, d
 
 void SparseHisto4d::dump() const
 {
-  for (int i=0; i<ndata; ++i) // DEBUG
-    std::cout << data[i] << ' ';
+  for (auto i = counts.begin(); i != counts.end(); ++i) // DEBUG
+    std::cout << i->first << ':' << i->second << ' ';
   std::cout << std::endl;
 }
 
@@ -3,6 +3,9 @@
 #include <list>
 #include <memory>
 #include <algorithm>
+#include <vector>
+#include <array>
+#include <thread>
 #ifndef M_PI
 #define     M_PI            3.14159265358979323846  /* pi */
 #endif
@@ -10,6 +13,7 @@
 #include "lsst/jointcal/BaseStar.h"
 #include "lsst/jointcal/StarMatch.h"
 #include "lsst/jointcal/Gtransfo.h"
+#include "lsst/jointcal/Frame.h"
 #include "lsst/jointcal/Histo2d.h"
 #include "lsst/jointcal/Histo4d.h"
 #include "lsst/jointcal/FastFinder.h"
@@ -50,6 +54,8 @@ MatchConditions::MatchConditions()
   MinMatchRatio = 1./3.;
   PrintLevel = 0;
   Algorithm = 2;
+  NThreads = 1;
+  AcceptNSigmas = 5;
   /*
   if (DatacardsName != "")
     {
@@ -206,6 +212,78 @@ static void dump_input_list(const BaseStarList &L, const int NStars,
 
 
 
+/* Cheap check of a candidate match list, meant to stop the trials
+   as soon as a candidate is clearly right. The candidate pairs are
+   fitted with a linear transfo (no outlier rejection), which maps a
+   subsample of L1 onto L2 : the stars that follow (in flux order)
+   the ones the candidates are built from, so that they are
+   independent of the candidate. We count how many of these land
+   within a small radius of an L2 star. The radius is a tenth of the
+   typical separation of L2 stars, so that a wrong transfo only
+   collects chance coincidences (Poisson-distributed), and the
+   candidate is accepted when the count exceeds their expectation by
+   NSigmas standard deviations (and a fraction MinMatchRatio of the
+   subsample matches). A rejected candidate is not discarded:
+   it goes through the usual refinement and ranking. */
+class CandidateVerifier
+{
+  BaseStarList check1, bright2;
+  std::unique_ptr<FastFinder> finder2;
+  Frame frame2;
+  double radius;
+  double nSigmas, minMatchRatio;
+  double minRatio, maxRatio;
+
+public :
+  CandidateVerifier(const BaseStarList &L1, const BaseStarList &L2,
+		    const MatchConditions &Conditions) :
+    radius(0), nSigmas(Conditions.AcceptNSigmas),
+    minMatchRatio(Conditions.MinMatchRatio),
+    minRatio(Conditions.MinSizeRatio()), maxRatio(Conditions.MaxSizeRatio())
+  {
+    if (nSigmas <= 0) return;
+    FluxOrderedView(L1, check1, 3*Conditions.NStarsL1);
+    for (int k = 0; k < Conditions.NStarsL1 && !check1.empty(); ++k) check1.pop_front();
+    FluxOrderedView(L2, bright2, 3*Conditions.NStarsL2);
+    if (check1.size() < 10 || bright2.size() < 10) return;
+    const BaseStar &first = **bright2.begin();
+    frame2 = Frame(first.x, first.y, first.x, first.y);
+    for (auto si = bright2.begin(); si != bright2.end(); ++si)
+      frame2 += Frame((*si)->x, (*si)->y, (*si)->x, (*si)->y);
+    if (frame2.Area() <= 0) return;
+    radius = 0.1*sqrt(frame2.Area()/bright2.size());
+    finder2.reset(new FastFinder(bright2));
+  }
+
+  bool Accept(const StarMatchList &Candidate, const int PrintLevel) const
+  {
+    if (radius <= 0 || Candidate.size() < 3) return false;
+    GtransfoLin guess;
+    if (guess.fit(Candidate) < 0) return false;
+    // a wrong fit often shrinks the field, which inflates coincidences
+    double scale2 = fabs(guess.Determinant());
+    if (scale2 < sqr(minRatio) || scale2 > sqr(maxRatio)) return false;
+    unsigned nInside = 0, nHits = 0;
+    for (auto si = check1.begin(); si != check1.end(); ++si)
+      {
+	Point p = guess.apply(**si);
+	if (!frame2.InFrame(p)) continue;
+	nInside++;
+	if (finder2->FindClosest(p, radius)) nHits++;
+      }
+    // expected number of chance coincidences
+    double expected = nInside*bright2.size()*M_PI*radius*radius/frame2.Area();
+    bool accept = (nHits >= 10) && (nHits >= minMatchRatio*nInside)
+      && (nHits > expected + nSigmas*sqrt(expected));
+    if (PrintLevel >= 1)
+      std::cout << " candidate check : " << nHits << " hits out of " << nInside
+		<< " (" << expected << " expected by chance)"
+		<< (accept ? " : accepted" : "") << std::endl;
+    return accept;
+  }
+};
+
+
 /* This one searches a general transformation by histogramming the relative size and orientation
 of star pairs ( Segment's) built from the 2 lists */
 
@@ -327,6 +405,110 @@ for (int i = 0; i<Conditions.MaxTrialCount; ++i)
 
 
 
+/* The segments of a SegmentList in an array, with their lengths,
+   coordinates and ranks in contiguous arrays, so that the range of
+   segments compatible with the ratio cut can be located with a binary
+   search, and the pair quantities computed with loops the compiler can
+   vectorize. */
+struct SegmentArray
+{
+  std::vector<Segment *> segs;
+  std::vector<double> r, dx, dy, rank;
+
+  SegmentArray(SegmentList &L)
+  {
+    segs.reserve(L.size());
+    r.reserve(L.size()); dx.reserve(L.size()); dy.reserve(L.size());
+    rank.reserve(L.size());
+    for (auto i = L.begin(); i != L.end(); ++i)
+      {
+	segs.push_back(&(*i));
+	r.push_back(i->r);
+	dx.push_back(i->dx);
+	dy.push_back(i->dy);
+	rank.push_back(i->s1rank + 0.5);
+      }
+  }
+
+  size_t size() const { return segs.size();}
+};
+
+
+/* A segment pair that contributes to the histogram : its histogram
+   code and the indices of both segments in their SegmentArray. Sorting
+   these by code indexes the pairs by histogram bin. */
+struct VotedPair
+{
+  int code;
+  unsigned i1, i2;
+
+  VotedPair(const int Code, const unsigned I1, const unsigned I2) :
+    code(Code), i1(I1), i2(I2) {};
+  // sorting on indices as well provides the order of the segment lists
+  bool operator < (const VotedPair &R) const
+  { return (code != R.code) ? (code < R.code) :
+      (i1 != R.i1) ? (i1 < R.i1) : (i2 < R.i2);}
+};
+
+static bool CodeLess(const VotedPair &P, const int Code) { return P.code < Code;}
+static bool CodeGreater(const int Code, const VotedPair &P) { return Code < P.code;}
+
+/* Computes the histogram codes of segment pairs (segment Start, Start+Stride, ...
+   of S1, with all segments of S2). The cuts and the arithmetics are
+   the ones of the original double loop (see Segment::relative_angle),
+   so that the codes are identical. */
+static void vote_segment_pairs(const SegmentArray &S1, const SegmentArray &S2,
+			       const unsigned Start, const unsigned Stride,
+			       const double MinRatio, const double MaxRatio,
+			       const double AngleOffset,
+			       const SparseHisto4d &Histo,
+			       std::vector<VotedPair> &Votes)
+{
+  // scratch for the pairs of one S1 segment
+  std::vector<double> ratios(S2.size()), sines(S2.size()), cosines(S2.size());
+  double x[4];
+  for (size_t i = Start; i < S1.size(); i += Stride)
+    {
+      double r1 = S1.r[i];
+      if (r1 == 0) continue;
+      double dx1 = S1.dx[i];
+      double dy1 = S1.dy[i];
+      x[2] = S1.rank[i];
+      /* S2 is sorted by decreasing length, so that the ratio decreases
+	 along S2 : the segments that pass both ratio cuts are
+	 contiguous. */
+      auto first = std::partition_point(S2.r.begin(), S2.r.end(),
+					[r1, MaxRatio](double r2) {return r2/r1 > MaxRatio;});
+      auto last = std::partition_point(first, S2.r.end(),
+				       [r1, MinRatio](double r2) {return !(r2/r1 < MinRatio);});
+      size_t j0 = first - S2.r.begin();
+      size_t n = last - first;
+      /* if one considers the 2 segments as complex numbers z1 and z2,
+	 ratio=mod(z2/z1) and angle = arg(z2/z1). No branches : this
+	 loop vectorizes. */
+      const double *r2 = &S2.r[j0];
+      const double *dx2 = &S2.dx[j0];
+      const double *dy2 = &S2.dy[j0];
+      for (size_t k = 0; k < n; ++k)
+	{
+	  ratios[k] = r2[k]/r1;
+	  sines[k] = dx2[k]*dy1 - dx1*dy2[k];
+	  cosines[k] = dx1*dx2[k] + dy1*dy2[k];
+	}
+      for (size_t k = 0; k < n; ++k)
+	{
+	  double angle = atan2(sines[k], cosines[k]);
+	  if (angle > M_PI - AngleOffset) angle -= 2.*M_PI;
+	  x[0] = ratios[k];
+	  x[1] = angle;
+	  x[3] = S2.rank[j0+k];
+	  int code = Histo.code_value(x);
+	  if (code >= 0) Votes.push_back(VotedPair(code, i, j0+k));
+	}
+    }
+}
+
+
 /* this matching routine searches brutally a match between lists in
     the 4 parameter space: size ratio, rotation angle, x and y
     shifts. This is done by histogramming where combinations of four
@@ -371,39 +553,60 @@ double maxRatio = Conditions.MaxSizeRatio();
 		     nBinsAngle, -M_PI- angleOffset, M_PI - angleOffset,
 		     Conditions.NStarsL1, 0., Conditions.NStarsL1,
 		     Conditions.NStarsL2, 0., Conditions.NStarsL2,
-		     sList1.size()*sList2.size());
+		     1); // filled at once from the votes
 
-SegmentIterator segi1,segi2;
 Segment *seg1,*seg2;
-double ratio, angle;
 
-for (segi1 = sList1.begin(); segi1 != sList1.end(); ++segi1)
-  {
-  seg1 = &(*segi1);
-  if (seg1->r == 0) continue;
-  for (segi2 = sList2.begin(); segi2 != sList2.end(); ++segi2)
-    {
-    seg2 = &(*segi2);
-      /* if one considers the 2 segments as complex numbers z1 and z2, ratio=mod(z1/z2) and angle = arg(z1/z2) */
-      /* I did not put a member function in Segment to compute both because we apply a cut on ratio before actually
-         computing the angle (which involves a call to atan2 (expensive)) */
-    ratio = seg2->r/seg1->r;
-    if (ratio > maxRatio) continue;
-    if (ratio < minRatio) break;  /* use th fact that segment lists are sorted by decresing length */
-    angle = seg1->relative_angle(seg2);
-    if (angle > M_PI - angleOffset) angle -= 2.*M_PI;
-    histo.Fill(ratio,angle,seg1->s1rank + 0.5 , seg2->s1rank+0.5);
-    }
-  }
+ SegmentArray segs1(sList1);
+ SegmentArray segs2(sList2);
+ unsigned nThreads = (Conditions.NThreads > 0) ? Conditions.NThreads :
+   std::max(std::thread::hardware_concurrency(), 1u);
+ nThreads = std::min(nThreads, unsigned(segs1.size()));
+ std::vector<VotedPair> votes;
+ if (nThreads <= 1)
+   vote_segment_pairs(segs1, segs2, 0, 1, minRatio, maxRatio, angleOffset,
+		      histo, votes);
+ else
+   {
+     /* every thread handles one segment out of nThreads in L1, and
+	collects its votes on its own. Once merged and sorted, the
+	votes are the same as the ones of the serial loop. */
+     std::vector<std::vector<VotedPair> > threadVotes(nThreads);
+     std::vector<std::thread> threads;
+     for (unsigned t=0; t<nThreads; ++t)
+       threads.push_back(std::thread(vote_segment_pairs,
+				     std::cref(segs1), std::cref(segs2),
+				     t, nThreads, minRatio, maxRatio, angleOffset,
+				     std::cref(histo), std::ref(threadVotes[t])));
+     size_t nVotes = 0;
+     for (unsigned t=0; t<nThreads; ++t)
+       {
+	 threads[t].join();
+	 nVotes += threadVotes[t].size();
+       }
+     votes.reserve(nVotes);
+     for (unsigned t=0; t<nThreads; ++t)
+       {
+	 votes.insert(votes.end(), threadVotes[t].begin(), threadVotes[t].end());
+	 std::vector<VotedPair>().swap(threadVotes[t]);
+       }
+   }
+ // index the segment pairs by bin
+ std::sort(votes.begin(), votes.end());
+ {
+   std::vector<int> codes(votes.size());
+   for (size_t k=0; k<votes.size(); ++k) codes[k] = votes[k].code;
+   histo.FillCodes(codes.data(), codes.size());
+ }
 
 
 SolList Solutions;
-/* now we find the highest bins of the histogram, and recover the original objects.
-   This involves actually re-looping on the combinations, but it is much
-   faster that the original histogram filling loop, since we only compute
-   angle and ratio for Segments that have the right first object
+/* now we find the highest bins of the histogram, and recover the
+   original objects from the votes, which are sorted by bin.
 */
 
+ CandidateVerifier verifier(L1, L2, Conditions);
+
  int oldMaxContent = 0;
 
  for (int i = 0; i<4*Conditions.MaxTrialCount; ++i) // leave a limit to make avoid (almost)  infinite loops
@@ -425,40 +628,23 @@ SolList Solutions;
 
        }
      oldMaxContent = maxContent;
-     /* reloop on segment pairs to select the ones in this specific bin */
-     int rank1L1 = int(pars[2]);
-     int rank1L2 = int(pars[3]);
-     double minAngle, maxAngle;
-     histo.BinLimits(pars,0, minRatio, maxRatio);
-     histo.BinLimits(pars,1, minAngle, maxAngle);
+     /* the segment pairs in this specific bin are contiguous in the
+	sorted votes. They all share the same first objects, and the
+	objects on the end number 2 are the actual matches. */
+     histo.BinLimits(pars,0, minRatio, maxRatio); // for the printout below
+     int maxCode = histo.code_value(pars);
+     auto first = std::lower_bound(votes.begin(), votes.end(), maxCode, CodeLess);
+     auto last = std::upper_bound(first, votes.end(), maxCode, CodeGreater);
 
      StarMatchList *a_list = new StarMatchList;
-     
-     for (segi1 = sList1.begin(); segi1 != sList1.end(); ++segi1)
+     for (auto v = first; v != last; ++v)
        {
-	 seg1 = &(*segi1);
-	 if (seg1->s1rank != rank1L1) continue;
-	 if (seg1->r == 0) continue;
-	 for (segi2 = sList2.begin(); segi2 != sList2.end(); ++segi2)
-	   {
-	     seg2 = &(*segi2);
-	     if (seg2->s1rank != rank1L2) continue;
-	     // push in the list the match corresponding to end number 1 of segments
-	     if (a_list->size() == 0)
-	       a_list->push_back(StarMatch(*(seg1->s1), *(seg2->s1), seg1->s1, seg2->s1));
-	     ratio = seg2->r/seg1->r;
-	     if (ratio > maxRatio) continue;
-	     if (ratio < minRatio) break;  /* use the fact that segment lists are sorted by decresing length */
-	     angle = seg1->relative_angle(seg2);
-	     if (angle > M_PI - angleOffset) angle -= 2.*M_PI;
-	     if (angle < minAngle || angle > maxAngle) continue;
-	     /* here we have 2 segments which have the right
-		- length ratio
-		- relative angle
-		- first objects (objects on the end number 1).
-		The objects on the end number 2 are the actual matches : */
-	     a_list->push_back(StarMatch(*(seg1->s2), *(seg2->s2), seg1->s2, seg2->s2));
-	   }
+	 seg1 = segs1.segs[v->i1];
+	 seg2 = segs2.segs[v->i2];
+	 // push in the list the match corresponding to end number 1 of segments
+	 if (a_list->size() == 0)
+	   a_list->push_back(StarMatch(*(seg1->s1), *(seg2->s1), seg1->s1, seg2->s1));
+	 a_list->push_back(StarMatch(*(seg1->s2), *(seg2->s2), seg1->s2, seg2->s2));
        }
 
      // a basic check for sanity of the algorithm :
@@ -470,8 +656,10 @@ SolList Solutions;
 	      << " matches->size() = " << a_list->size() << std::endl;
 	 std::cerr << "please store the involved images and contact the developpers" << std::endl;
        }
+     bool accepted = verifier.Accept(*a_list, Conditions.PrintLevel);
      a_list->RefineTransfo(Conditions.NSigmas);
      Solutions.push_back(a_list);
+     if (accepted) break;
     }
 
   if (Solutions.size() == 0)
@@ -497,10 +685,317 @@ SolList Solutions;
 }
 
 
+/* Geometric hashing on star triangles ("asterisms"). Each star of
+   the bright subset of a list is associated with its nearest
+   neighbours, and every triangle it forms with 2 of them is coded by
+   its side ratios (b/a, c/a, with a>=b>=c), which are invariant under
+   shifts, rotations and scalings. Triangles of L2 are sorted along the
+   first invariant, so that the candidates for a triangle of L1 are
+   found by a binary search. Every candidate pair of triangles provides
+   a scale ratio and a rotation angle, which are histogrammed as in the
+   segment algorithms above. The cost is O(N log N) in the number of
+   stars (at fixed number of neighbours), rather than quadratic. */
+
+struct Asterism
+{
+  double x, y; // invariants : b/a, c/a
+  double a; // longest side
+  double angle; // orientation of the longest side
+  bool direct; // orientation of the triangle, so that mirror images do not match
+  unsigned v[3]; // star indices; v[i] is opposite to the i-th longest side
+};
+
+static bool IncreasingX(const Asterism &L, const Asterism &R) { return L.x < R.x;}
+
+/* stars within (possibly) transformed coordinates, as used to code
+   triangles, and the original stars, used to build matches */
+struct AsterismStars
+{
+  std::vector<Point> pos;
+  std::vector<const BaseStar*> stars;
+
+  AsterismStars(const BaseStarList &L, const int NStars, const Gtransfo &Tin)
+  {
+    size_t n = std::min(size_t(NStars), L.size());
+    pos.reserve(n);
+    stars.reserve(n);
+    for (auto si = L.begin(); si != L.end() && stars.size() < n; ++si)
+      {
+	const BaseStar &s = **si;
+	stars.push_back(&s);
+	pos.push_back(Tin.apply(s));
+      }
+  }
+
+  size_t size() const { return stars.size();}
+};
+
+
+/* the NNeighbours closest stars of every star, found by scanning
+   rings of cells of a grid with about 2 stars per cell. */
+static void nearest_neighbours(const std::vector<Point> &Pos, const unsigned NNeighbours,
+			       std::vector<std::vector<unsigned> > &Neighbours)
+{
+  size_t n = Pos.size();
+  Neighbours.assign(n, std::vector<unsigned>());
+  if (n < 2) return;
+  double xmin = Pos[0].x, xmax = xmin, ymin = Pos[0].y, ymax = ymin;
+  for (auto &p : Pos)
+    {
+      xmin = std::min(xmin, p.x); xmax = std::max(xmax, p.x);
+      ymin = std::min(ymin, p.y); ymax = std::max(ymax, p.y);
+    }
+  int nside = std::max(1, int(sqrt(n/2.)));
+  double cellx = (xmax-xmin)/nside; if (cellx <= 0) cellx = 1;
+  double celly = (ymax-ymin)/nside; if (celly <= 0) celly = 1;
+  // the radius guaranteed to be covered by one more ring of cells
+  double cell = std::min(cellx, celly);
+  std::vector<std::vector<unsigned> > grid(nside*nside);
+  auto cell_index = [&](const Point &P, int &ix, int &iy)
+    {
+      ix = std::min(nside-1, int((P.x-xmin)/cellx));
+      iy = std::min(nside-1, int((P.y-ymin)/celly));
+    };
+  for (unsigned k=0; k<n; ++k)
+    {
+      int ix, iy;
+      cell_index(Pos[k], ix, iy);
+      grid[ix*nside+iy].push_back(k);
+    }
+  unsigned nWanted = std::min(size_t(NNeighbours), n-1);
+  std::vector<std::pair<double,unsigned> > cand;
+  for (unsigned k=0; k<n; ++k)
+    {
+      int ix, iy;
+      cell_index(Pos[k], ix, iy);
+      cand.clear();
+      /* once ring "ring" is scanned, all stars closer than ring*cell
+	 are in the candidates (cells are not square in general, hence
+	 the smallest side). */
+      for (int ring = 0; ring < nside; ++ring)
+	{
+	  for (int jx = ix-ring; jx <= ix+ring; ++jx)
+	    for (int jy = iy-ring; jy <= iy+ring; ++jy)
+	      {
+		if (std::max(abs(jx-ix), abs(jy-iy)) != ring) continue;
+		if (jx < 0 || jx >= nside || jy < 0 || jy >= nside) continue;
+		for (unsigned j : grid[jx*nside+jy])
+		  if (j != k) cand.push_back(std::make_pair(Pos[k].Dist2(Pos[j]), j));
+	      }
+	  if (cand.size() < nWanted) continue;
+	  std::nth_element(cand.begin(), cand.begin()+nWanted-1, cand.end());
+	  if (cand[nWanted-1].first <= sqr(ring*cell)) break;
+	}
+      std::partial_sort(cand.begin(), cand.begin()+nWanted, cand.end());
+      for (unsigned j=0; j<nWanted; ++j) Neighbours[k].push_back(cand[j].second);
+    }
+}
+
+/* triangles made of every star and 2 of its neighbours. Triangles
+   with (almost) equal sides are dropped, because their vertices
+   cannot be labelled reliably. */
+static void build_asterisms(const AsterismStars &S, const unsigned NNeighbours,
+			    const double Tolerance, std::vector<Asterism> &Asterisms)
+{
+  std::vector<std::vector<unsigned> > neighbours;
+  nearest_neighbours(S.pos, NNeighbours, neighbours);
+  std::vector<std::array<unsigned,3> > triplets;
+  for (unsigned i=0; i<S.size(); ++i)
+    {
+      const std::vector<unsigned> &nb = neighbours[i];
+      for (unsigned j=0; j<nb.size(); ++j)
+	for (unsigned k=j+1; k<nb.size(); ++k)
+	  {
+	    std::array<unsigned,3> t = {{i, nb[j], nb[k]}};
+	    std::sort(t.begin(), t.end());
+	    triplets.push_back(t);
+	  }
+    }
+  std::sort(triplets.begin(), triplets.end());
+  triplets.erase(std::unique(triplets.begin(), triplets.end()), triplets.end());
+  Asterisms.clear();
+  Asterisms.reserve(triplets.size());
+  for (auto &t : triplets)
+    {
+      // side i is opposite to vertex t[i]
+      std::pair<double,unsigned> sides[3];
+      for (unsigned i=0; i<3; ++i)
+	sides[i] = std::make_pair(sqrt(S.pos[t[(i+1)%3]].Dist2(S.pos[t[(i+2)%3]])), t[i]);
+      std::sort(sides, sides+3, [](const std::pair<double,unsigned> &L,
+				   const std::pair<double,unsigned> &R) {return L.first > R.first;});
+      double a = sides[0].first;
+      if (sides[2].first == 0) continue;
+      if (sides[0].first - sides[1].first < Tolerance*a ||
+	  sides[1].first - sides[2].first < Tolerance*a) continue;
+      Asterism ast;
+      ast.x = sides[1].first/a;
+      ast.y = sides[2].first/a;
+      ast.a = a;
+      for (unsigned i=0; i<3; ++i) ast.v[i] = sides[i].second;
+      const Point &p0 = S.pos[ast.v[0]];
+      const Point &p1 = S.pos[ast.v[1]];
+      const Point &p2 = S.pos[ast.v[2]];
+      // the longest side joins v[1] and v[2]
+      ast.angle = atan2(p2.y-p1.y, p2.x-p1.x);
+      ast.direct = ((p1.x-p0.x)*(p2.y-p0.y) - (p1.y-p0.y)*(p2.x-p0.x)) > 0;
+      Asterisms.push_back(ast);
+    }
+}
+
+/* a pair of triangles with compatible invariants */
+/* Same idea as VotedPair: the histogram bin of a triangle pair, and
+   the indices of both triangles in their lists. Sorting by bin makes
+   the pairs of a bin contiguous. */
+struct AsterismPair
+{
+  int code;
+  unsigned a1, a2; // indices in the asterism lists
+
+  AsterismPair(const int Code, const unsigned A1, const unsigned A2) :
+    code(Code), a1(A1), a2(A2) {};
+  bool operator < (const AsterismPair &R) const
+  { return (code != R.code) ? (code < R.code) :
+      (a1 != R.a1) ? (a1 < R.a1) : (a2 < R.a2);}
+};
+
+static StarMatchList *ListMatchupAsterisms(BaseStarList &L1, BaseStarList &L2,
+					   const Gtransfo &Tin,
+					   const MatchConditions &Conditions)
+{
+  const unsigned nNeighbours = 6;
+  const double tolerance = 0.01; // on invariants
+
+  AsterismStars stars1(L1, Conditions.NStarsL1, Tin);
+  AsterismStars stars2(L2, Conditions.NStarsL2, GtransfoIdentity());
+  if (stars1.size() < 3 || stars2.size() < 3)
+    {
+      std::cout << " ListMatchupAsterisms : (at least) one of the lists is too short " << std::endl;
+      return NULL;
+    }
+  std::vector<Asterism> ast1, ast2;
+  build_asterisms(stars1, nNeighbours, tolerance, ast1);
+  build_asterisms(stars2, nNeighbours, tolerance, ast2);
+  std::sort(ast2.begin(), ast2.end(), IncreasingX);
+
+  // same histogram as the segment algorithms
+  int nBinsR = 21;
+  int nBinsAngle = 180; /* can be divided by 4 */
+  double angleOffset = M_PI/nBinsAngle;
+  double minRatio = Conditions.MinSizeRatio();
+  double maxRatio = Conditions.MaxSizeRatio();
+  Histo2d histo(nBinsR, minRatio, maxRatio,
+		nBinsAngle, -M_PI- angleOffset, M_PI - angleOffset);
+
+  std::vector<AsterismPair> pairs;
+  Asterism probe;
+  for (unsigned i=0; i<ast1.size(); ++i)
+    {
+      const Asterism &t1 = ast1[i];
+      probe.x = t1.x - tolerance;
+      auto first = std::lower_bound(ast2.begin(), ast2.end(), probe, IncreasingX);
+      for (auto t2 = first; t2 != ast2.end() && t2->x <= t1.x + tolerance; ++t2)
+	{
+	  if (fabs(t2->y - t1.y) > tolerance || t2->direct != t1.direct) continue;
+	  double ratio = t2->a/t1.a;
+	  if (ratio < minRatio || ratio > maxRatio) continue;
+	  double angle = t2->angle - t1.angle;
+	  if (angle > M_PI) angle -= 2.*M_PI;
+	  if (angle < -M_PI) angle += 2.*M_PI;
+	  if (angle > M_PI - angleOffset) angle -= 2.*M_PI;
+	  int code = histo.BinCode(ratio, angle);
+	  if (code < 0) continue;
+	  pairs.push_back(AsterismPair(code, i, t2 - ast2.begin()));
+	  histo.Fill(ratio, angle);
+	}
+    }
+  std::sort(pairs.begin(), pairs.end());
+  if (Conditions.PrintLevel >= 1)
+    std::cout << " ListMatchupAsterisms : " << ast1.size() << " and "
+	      << ast2.size() << " triangles, " << pairs.size()
+	      << " candidate pairs" << std::endl;
+
+  SolList Solutions;
+  CandidateVerifier verifier(L1, L2, Conditions);
+  for (int i = 0; i<Conditions.MaxTrialCount; ++i)
+    {
+      double ratioMax, angleMax;
+      double maxContent = histo.MaxBin(ratioMax, angleMax);
+      if (maxContent <= 0) break;
+      histo.ZeroBin(ratioMax, angleMax);
+      if (Conditions.PrintLevel >= 1)
+	std::cout << " valMax " << maxContent
+		  << " ratio " << ratioMax
+		  << " angle " << angleMax << std::endl;
+      /* every triangle pair in this bin votes for its 3 star pairs.
+	 Every star of L1 is then matched to the star of L2 it was
+	 most often paired with. */
+      int maxCode = histo.BinCode(ratioMax, angleMax);
+      auto first = std::lower_bound(pairs.begin(), pairs.end(), maxCode,
+				    [](const AsterismPair &P, const int Code)
+				    { return P.code < Code;});
+      auto last = std::upper_bound(first, pairs.end(), maxCode,
+				   [](const int Code, const AsterismPair &P)
+				   { return Code < P.code;});
+      std::vector<std::pair<unsigned,unsigned> > starPairs;
+      for (auto p = first; p != last; ++p)
+	{
+	  const Asterism &t1 = ast1[p->a1];
+	  const Asterism &t2 = ast2[p->a2];
+	  for (unsigned k=0; k<3; ++k)
+	    starPairs.push_back(std::make_pair(t1.v[k], t2.v[k]));
+	}
+      std::sort(starPairs.begin(), starPairs.end());
+      StarMatchList *a_list = new StarMatchList;
+      for (size_t k = 0; k < starPairs.size(); )
+	{
+	  unsigned i1 = starPairs[k].first;
+	  unsigned bestI2 = starPairs[k].second;
+	  unsigned bestCount = 0;
+	  while (k < starPairs.size() && starPairs[k].first == i1)
+	    {
+	      size_t end = k;
+	      while (end < starPairs.size() && starPairs[end] == starPairs[k]) ++end;
+	      if (end-k > bestCount) { bestCount = end-k; bestI2 = starPairs[k].second;}
+	      k = end;
+	    }
+	  const BaseStar *s1 = stars1.stars[i1];
+	  const BaseStar *s2 = stars2.stars[bestI2];
+	  a_list->push_back(StarMatch(*s1, *s2, s1, s2));
+	}
+      if (a_list->size() < 3)
+	{
+	  delete a_list;
+	  continue;
+	}
+      bool accepted = verifier.Accept(*a_list, Conditions.PrintLevel);
+      a_list->RefineTransfo(Conditions.NSigmas);
+      Solutions.push_back(a_list);
+      if (accepted) break;
+    }
+
+  if (Solutions.size() == 0)
+    {
+      std::cout << " error In ListMatchupAsterisms : not a single triangle match " << std::endl;
+      return NULL;
+    }
+  Solutions.sort(DecreasingQuality);
+  StarMatchList *best = *Solutions.begin();
+  Solutions.pop_front();
+  if (Conditions.PrintLevel >=1)
+    {
+      std::cout << " best solution " << best->Residual() << " npairs " << best->size() << std::endl << *(best->Transfo());
+      std::cout << " Chi2 " << best->Chi2() << ','
+		<< " Number of solutions " << Solutions.size() << std::endl;
+    }
+  return best;
+}
+
+
 static StarMatchList *ListMatchupRotShift(BaseStarList &L1, BaseStarList &L2,
                                           const Gtransfo &Tin, const MatchConditions &Conditions)
 {
   if (Conditions.Algorithm == 1) return ListMatchupRotShift_Old(L1, L2, Tin, Conditions);
+  else if (Conditions.Algorithm == 3) return ListMatchupAsterisms(L1, L2, Tin, Conditions);
   else return ListMatchupRotShift_New(L1, L2, Tin, Conditions);
 }
 
@@ -666,30 +1161,48 @@ StarMatchList *ListMatchCollect_Slow(const BaseStarList &L1, const BaseStarList
 
 // here is the real active routine:
 
-StarMatchList *ListMatchCollect(const BaseStarList &L1,
-				const BaseStarList &L2,
-				const Gtransfo *Guess, const double MaxDist)
+void ListMatchCollect(const BaseStarList &L1, const FastFinder &Finder2,
+		      const Gtransfo *Guess, const double MaxDist,
+		      StarMatchList &Matches)
 {
-  StarMatchList *matches = new StarMatchList;
-  /****** Collect ***********/
-  FastFinder finder(L2);
+  Matches.clear();
+  /* transform all positions at once: for flattened or TAN transfos,
+     this is much faster than calling apply for every star. */
+  std::vector<double> x, y;
+  x.reserve(L1.size()); y.reserve(L1.size());
   for (BaseStarCIterator si = L1.begin(); si != L1.end(); ++si)
+    {
+      x.push_back((*si)->x);
+      y.push_back((*si)->y);
+    }
+  Guess->TransformArrays(x.data(), y.data(), x.data(), y.data(), x.size());
+  /****** Collect ***********/
+  unsigned k = 0;
+  for (BaseStarCIterator si = L1.begin(); si != L1.end(); ++si, ++k)
     {
       const BaseStarRef &p1 = (*si);
-      Point p2 = Guess->apply(*p1);
-      const BaseStar *neighbour = finder.FindClosest(p2,MaxDist);
+      Point p2(x[k], y[k]);
+      const BaseStar *neighbour = Finder2.FindClosest(p2,MaxDist);
       if (!neighbour) continue;
       double distance =p2.Distance(*neighbour);
       if (distance < MaxDist)
 	{
-	  matches->push_back(StarMatch(*p1,*neighbour,&(*p1),neighbour));
+	  Matches.push_back(StarMatch(*p1,*neighbour,&(*p1),neighbour));
 	  // assign the distance, since we have it in hand:
-	  matches->back().distance = distance;
+	  Matches.back().distance = distance;
 	}
 
     }
-  matches->SetTransfo(Guess);
+  Matches.SetTransfo(Guess);
+}
 
+StarMatchList *ListMatchCollect(const BaseStarList &L1,
+				const BaseStarList &L2,
+				const Gtransfo *Guess, const double MaxDist)
+{
+  StarMatchList *matches = new StarMatchList;
+  FastFinder finder(L2);
+  ListMatchCollect(L1, finder, Guess, MaxDist, *matches);
   return matches;
 }
 
@@ -796,12 +1309,37 @@ static double median_distance(const StarMatchList* match, const Gtransfo* transf
 }
 
 
+void FluxOrderedView(const BaseStarList &L, BaseStarList &View, const size_t NKeep)
+{
+  std::vector<std::pair<const BaseStarRef*, unsigned> > refs;
+  refs.reserve(L.size());
+  for (auto si = L.begin(); si != L.end(); ++si) refs.push_back(std::make_pair(&(*si), refs.size()));
+  size_t nKeep = (NKeep && NKeep < refs.size()) ? NKeep : refs.size();
+  // ties are resolved by the input order, as FluxSort does
+  auto decreasingFlux = [](const std::pair<const BaseStarRef*, unsigned> &S1,
+			   const std::pair<const BaseStarRef*, unsigned> &S2)
+    { double f1 = (*S1.first)->flux, f2 = (*S2.first)->flux;
+      return (f1 != f2) ? (f1 > f2) : (S1.second < S2.second);};
+  if (nKeep < refs.size())
+    {
+      std::nth_element(refs.begin(), refs.begin()+nKeep, refs.end(), decreasingFlux);
+      refs.resize(nKeep);
+    }
+  std::sort(refs.begin(), refs.end(), decreasingFlux);
+  View.clear();
+  for (auto &r : refs) View.push_back(*r.first);
+}
+
 Gtransfo* ListMatchCombinatorial(const BaseStarList &List1, const BaseStarList &List2, const MatchConditions& Conditions) {
+  /* the searches only use the brightest stars of both lists (and
+     may swap the lists), and the candidate checks the next ones */
+  size_t nKeep = std::max(Conditions.NStarsL1, Conditions.NStarsL2);
+  if (Conditions.AcceptNSigmas > 0) nKeep *= 3;
   BaseStarList L1, L2;
-  List1.CopyTo(L1); L1.FluxSort();
-  List2.CopyTo(L2); L2.FluxSort();
+  FluxOrderedView(List1, L1, nKeep);
+  FluxOrderedView(List2, L2, nKeep);
 
-  std::cout << " ListMatchCombinatorial: find match between " << L1.size() << " and " << L2.size() << " stars...";
+  std::cout << " ListMatchCombinatorial: find match between " << List1.size() << " and " << List2.size() << " stars...";
   StarMatchList *match = MatchSearchRotShiftFlip(L1, L2, Conditions);
   Gtransfo *transfo = 0;
   double pixSizeRatio2 = sqr(Conditions.SizeRatio);
@@ -845,52 +1383,53 @@ Gtransfo* ListMatchRefine(const BaseStarList& List1, const BaseStarList& List2,
   int order = 1;
   size_t nstarmin = 3;
 
+  /* the bright subsets are views (no star is copied), and the
+     locators, match lists and chi2 arrays are reused all along */
   BaseStarList L1, L2;
-  List1.CopyTo(L1); L1.FluxSort(); L1.CutTail(nStars);
-  List2.CopyTo(L2); L2.FluxSort(); L2.CutTail(nStars);
+  FluxOrderedView(List1, L1, nStars);
+  FluxOrderedView(List2, L2, nStars);
+  FastFinder fullFinder(List2);
+  FastFinder brightFinder(L2);
 
-  StarMatchList *fullMatch = ListMatchCollect(List1, List2, transfo, fullDist);
-  StarMatchList *brightMatch = ListMatchCollect(L1, L2, transfo, brightDist);
-  double curChi2 = ComputeChi2(*brightMatch, *transfo) / brightMatch->size();
+  StarMatchList fullMatch, brightMatch;
+  StarMatchArrays brightArrays;
+  ListMatchCollect(List1, fullFinder, transfo, fullDist, fullMatch);
+  ListMatchCollect(L1, brightFinder, transfo, brightDist, brightMatch);
+  double curChi2 = ComputeChi2(brightMatch, *transfo, brightArrays) / brightMatch.size();
 
   std::cout << " ListMatchRefine: start  "
-       << " med.resid "  << median_distance(fullMatch, transfo)
-       << " #match " << fullMatch->size()
+       << " med.resid "  << median_distance(&fullMatch, transfo)
+       << " #match " << fullMatch.size()
        << std::endl;
 
   do { // loop on transfo order on full list of stars
-    Gtransfo* curTransfo = brightMatch->Transfo()->Clone();
+    std::unique_ptr<Gtransfo> curTransfo(brightMatch.Transfo()->Clone());
     unsigned iter = 0;
     double transDiff;
     do { // loop on transfo diff only on bright stars
-      brightMatch->SetTransfoOrder(order);
-      brightMatch->RefineTransfo(nSigmas);
-      transDiff = transfo_diff(L1, brightMatch->Transfo(), curTransfo);
-      curTransfo = brightMatch->Transfo()->Clone();
-      delete brightMatch;
-      brightMatch = ListMatchCollect(L1, L2, curTransfo, brightDist);
-    } while (brightMatch->size() > nstarmin && transDiff > 0.05 && ++iter < 5);
+      brightMatch.SetTransfoOrder(order);
+      brightMatch.RefineTransfo(nSigmas);
+      transDiff = transfo_diff(L1, brightMatch.Transfo(), curTransfo.get());
+      curTransfo.reset(brightMatch.Transfo()->Clone());
+      ListMatchCollect(L1, brightFinder, curTransfo.get(), brightDist, brightMatch);
+    } while (brightMatch.size() > nstarmin && transDiff > 0.05 && ++iter < 5);
     
     double prevChi2 = curChi2;
-    curChi2 = ComputeChi2(*brightMatch, *curTransfo) / brightMatch->size();
+    curChi2 = ComputeChi2(brightMatch, *curTransfo, brightArrays) / brightMatch.size();
 
-    delete fullMatch;
-    fullMatch = ListMatchCollect(List1, List2, curTransfo, fullDist);
+    ListMatchCollect(List1, fullFinder, curTransfo.get(), fullDist, fullMatch);
     std::cout << " ListMatchRefine: order " << order
-	 << " med.resid "  << median_distance(fullMatch, curTransfo)
-	 << " #match " << fullMatch->size()
+	 << " med.resid "  << median_distance(&fullMatch, curTransfo.get())
+	 << " #match " << fullMatch.size()
 	 << std::endl;
     if (((prevChi2 - curChi2) > 0.01*curChi2) && curChi2 > 0) {
       std::cout << " ListMatchRefine: order " << order << " was a better guess\n";
       delete transfo;
-      transfo = brightMatch->Transfo()->Clone();
+      transfo = brightMatch.Transfo()->Clone();
     }
-    nstarmin = brightMatch->Transfo()->Npar();
+    nstarmin = brightMatch.Transfo()->Npar();
   } while (++order <= maxOrder);
 
-  delete brightMatch;
-  delete fullMatch;
-
   return transfo;
 }
 
@@ -1,6 +1,7 @@
 #include "lsst/jointcal/MatchExposure.h"
 #include "lsst/jointcal/ExposureCatalog.h"
 #include "lsst/jointcal/AstroUtils.h"
+#include "lsst/jointcal/RefCatalog.h"
 #include "lsst/jointcal/Frame.h"
 #include "lsst/jointcal/Gtransfo.h"
 #include "lsst/jointcal/ListMatch.h"
@@ -11,6 +12,9 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <exception>
 using namespace std;
 
 namespace lsst {
@@ -49,10 +53,37 @@ static bool accept_star_for_fit(const ExposureStar &S)
   return true;
 }
 
+/* from the shared catalog if provided and if it covers SkyFrame, from
+   the files otherwise, so that we never match against a truncated
+   reference list. */
+static void collect_reference(const Frame &SkyFrame, const TanPix2RaDec &Tp2Sky,
+			      const RefCatalog *RefCat, BaseStarList &Out)
+{
+  if (RefCat && RefCat->Covers(SkyFrame))
+    {
+      RefCat->Collect(SkyFrame, Tp2Sky, Out);
+      return;
+    }
+  if (RefCat)
+    cout << "WARNING: the reference catalog does not cover " << SkyFrame
+	 << " : reading the reference files" << endl;
+  UsnoCollect(SkyFrame, Tp2Sky, Out);
+}
+
+// the sky region where reference stars are collected, with a 10% margin.
+static Frame sky_frame(const Frame &CoveredTpFrame, const TanPix2RaDec &Tp2Sky)
+{
+  // OK, there are cases where this will not work,
+  // in particular close to the poles....
+  return ApplyTransfo(CoveredTpFrame.Rescale(1.1), Tp2Sky, LargeFrame);
+}
 
 
 // This is the routine that does the job
- ExposureSolutionType MatchExposure(ExposureCatalog &EC, const Point &TangentPoint, const JointcalControl &Control)
+static ExposureSolutionType match_exposure(ExposureCatalog &EC, const Point &TangentPoint,
+					   const JointcalControl &Control,
+					   const RefCatalog *RefCat,
+					   const int MatchThreads)
 {
   // The arrangement has to be known by ExposureCatalog:
   const ChipArrangement &arrangement = EC.Arrangement(); 
@@ -69,13 +100,11 @@ static bool accept_star_for_fit(const ExposureStar &S)
   // this is the tangent plane here, so:
   TanPix2RaDec tp2Sky(GtransfoLin(), TangentPoint);
 
-  // OK, there are cases where this will not work, 
-  // in particular close to the poles....
-  Frame skyFrame = ApplyTransfo(tpFrame, tp2Sky, LargeFrame);
+  Frame skyFrame = sky_frame(coveredTpFrame, tp2Sky);
 
   // grab the reference catalog, from the provided file if any.
   BaseStarList refCat;
-  UsnoCollect(skyFrame, tp2Sky, refCat);
+  collect_reference(skyFrame, tp2Sky, RefCat, refCat);
   cout << "INFO: " << tpCat.size() << " objects in total in image" << endl;
 
   const std::vector<int> chips = EC.Chips();
@@ -88,6 +117,7 @@ static bool accept_star_for_fit(const ExposureStar &S)
   conditions.SizeRatio = 1;
   // variations of plate scale due to focus are of the order of 1e-3.
   conditions.DeltaSizeRatio = 0.02; 
+  conditions.NThreads = MatchThreads;
   cout << " INFO: running combinatorics: it takes a few seconds... " << endl;
   StarMatchList *match = MatchSearchRotShiftFlip((BaseStarList&)tpCat, refCat, conditions);
   if (!match) return ExposureSolutionType();
@@ -113,7 +143,7 @@ static bool accept_star_for_fit(const ExposureStar &S)
       skyFrame = ApplyTransfo(actualTpFrame, tp2Sky, LargeFrame);
       refCat.clear();
       cout << " INFO: too large a shift: we recollect the reference catalog " << endl;
-      UsnoCollect(skyFrame, tp2Sky, refCat);
+      collect_reference(skyFrame, tp2Sky, RefCat, refCat);
     }
 
 
@@ -195,6 +225,72 @@ arrangement file contains other stuff than polynomials. But there could be a way
   return res;
 }
 
+Frame ExposureSkyFrame(ExposureCatalog &EC, const Point &TangentPoint)
+{
+  ExposureStarList tpCat;
+  EC.TangentPlaneCatalog(tpCat);
+  TanPix2RaDec tp2Sky(GtransfoLin(), TangentPoint);
+  return sky_frame(get_bounding_box(tpCat), tp2Sky);
+}
+
+/* a single exposure at a time: the segment pair votes may use all
+   cores (MatchConditions::NThreads defaults to 1) */
+ExposureSolutionType MatchExposure(ExposureCatalog &EC, const Point &TangentPoint, const JointcalControl &Control)
+{
+  return match_exposure(EC, TangentPoint, Control, NULL, 0);
+}
+
+ExposureSolutionType MatchExposure(ExposureCatalog &EC, const Point &TangentPoint, const JointcalControl &Control,
+				   const RefCatalog &RefCat)
+{
+  return match_exposure(EC, TangentPoint, Control, &RefCat, 0);
+}
+
+std::vector<ExposureSolutionType> MatchExposures(const std::vector<ExposureCatalog*> &ECs,
+						 const std::vector<Point> &TangentPoints,
+						 const JointcalControl &Control,
+						 const RefCatalog &RefCat,
+						 const unsigned NThreads)
+{
+  if (ECs.size() != TangentPoints.size())
+    throw LSST_EXCEPT(lsst::pex::exceptions::InvalidParameterError,
+		      "MatchExposures: expects as many tangent points as exposures");
+  std::vector<ExposureSolutionType> res(ECs.size());
+  unsigned nThreads = (NThreads > 0) ? NThreads :
+    std::max(std::thread::hardware_concurrency(), 1u);
+  nThreads = std::min(nThreads, unsigned(ECs.size()));
+  /* every thread picks the next exposure to match. Exposures are
+     independent: the arrangement and the reference catalog are only
+     read. The combinatorial searches run serially in every thread,
+     since the exposures already keep all threads busy. A failure only
+     affects its own exposure, which gets an empty solution. */
+  std::atomic<unsigned> next(0);
+  auto worker = [&]()
+    {
+      for (unsigned k = next++; k < ECs.size(); k = next++)
+	{
+	  try
+	    {
+	      res[k] = match_exposure(*ECs[k], TangentPoints[k], Control, &RefCat,
+				      (nThreads > 1) ? 1 : 0);
+	    }
+	  catch (std::exception &e)
+	    {
+	      std::cout << "ERROR: MatchExposures: exposure " << k << " failed: "
+			<< e.what() << std::endl;
+	    }
+	}
+    };
+  if (nThreads <= 1) worker();
+  else
+    {
+      std::vector<std::thread> threads;
+      for (unsigned t=0; t<nThreads; ++t) threads.push_back(std::thread(worker));
+      for (auto &t : threads) t.join();
+    }
+  return res;
+}
+
 /*
   This code matches several CCDs from the same exposure to a reference
   catalog.  In fact, it works poorly for a small numbers of CCDs,
@@ -198,6 +198,17 @@ void  MeasuredStarList::SetCcdImage(const CcdImage *C)
   for (MeasuredStarIterator i= begin(); i != end(); ++i)
       (*i)->SetCcdImage(C);
 }
+
+void MeasuredStarList::RemoveFromFits()
+{
+  for (MeasuredStarIterator i= begin(); i != end(); ++i)
+    {
+      MeasuredStar &ms = **i;
+      FittedStar *fs = const_cast<FittedStar *>(ms.GetFittedStar());
+      ms.SetValid(false);
+      fs->MeasurementCount()--; // could be put in SetValid
+    }
+}
   
 
 
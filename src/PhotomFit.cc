@@ -11,6 +11,7 @@
 #include "lsst/pex/exceptions.h"
 #include <fstream>
 #include "lsst/jointcal/Tripletlist.h"
+#include "lsst/jointcal/SparseAssembler.h"
 
 typedef Eigen::SparseMatrix<double> SpMat;
 
@@ -25,7 +26,6 @@ namespace jointcal {
 PhotomFit::PhotomFit(Associations &A, PhotomModel *M, double FluxError) :
   _assoc(A),  _photomModel(M), _fluxError(FluxError)
 {
-  _LastNTrip = 0;
 
   //  _posError = PosError;
 
@@ -136,6 +136,31 @@ void PhotomFit::LSDerivatives(const CcdImage &Ccd,
   TList.SetNextFreeIndex(kTriplets);
 }
 
+/*! Counting pre-pass for the Jacobian staging, for the current
+  WhatToFit setting : every valid measurement is a block of
+  GetNpar(ccd) model terms plus its flux term. */
+void PhotomFit::CountTriplets(size_t &NEntries, size_t &NBlocks) const
+{
+  NEntries = 0;
+  NBlocks = 0;
+  auto L = _assoc.TheCcdImageList();
+  for (auto im=L.cbegin(); im!=L.end() ; ++im)
+    {
+      const CcdImage &ccd = **im;
+      // same counts as in LSDerivatives
+      unsigned npar_tot = ((_fittingModel) ? _photomModel->GetNpar(ccd) : 0)
+	+ ((_fittingFluxes) ? 1 : 0);
+      if (npar_tot == 0) continue;
+      const MeasuredStarList &catalog = ccd.CatalogForFit();
+      for (auto i = catalog.cbegin(); i!= catalog.end(); ++i)
+	if ((*i)->IsValid())
+	  {
+	    NEntries += npar_tot;
+	    NBlocks++;
+	  }
+    }
+}
+
 // This is almost a selection of lines of LSDerivatives(CcdImage ...)
 /* This routine is template because it is used
 both with its first argument as "const CcdImageList &" and "CcdImageList &",
@@ -447,16 +472,16 @@ bool PhotomFit::Minimize(const std::string &WhatToFit)
 {
   AssignIndices(WhatToFit);
 
-  // TODO : write a guesser for the number of triplets
-  unsigned nTrip = (_LastNTrip) ? _LastNTrip: 1e6;
-  TripletList tList(nTrip);
+  size_t nEntries, nBlocks;
+  CountTriplets(nEntries, nBlocks);
+  TripletList tList(0);
+  tList.Reserve(nEntries, nBlocks);
   Eigen::VectorXd grad(_nParTot);  grad.setZero();
 
   //Fill the triplets
   clock_t tstart = clock();
   LSDerivatives(tList, grad);
   clock_t tend = clock();
-  _LastNTrip = tList.size();
 
   cout << " INFO: End of triplet filling, ntrip = " << tList.size()
        << " CPU = " << float(tend-tstart)/float(CLOCKS_PER_SEC)
@@ -464,12 +489,14 @@ bool PhotomFit::Minimize(const std::string &WhatToFit)
 
   SpMat hessian;
   {
-    SpMat jacobian(_nParTot,tList.NextFreeIndex());
-    jacobian.setFromTriplets(tList.begin(), tList.end());
+    const SpMat &jacobian = _jacobianAssembler.Assemble(tList, _nParTot,
+							tList.NextFreeIndex());
     // release memory shrink_to_fit is C++11
     tList.clear(); //tList.shrink_to_fit();
     clock_t tstart = clock();
     hessian = jacobian*jacobian.transpose();
+    // a factorization follows : only keep the pattern
+    _jacobianAssembler.ReleaseMatrix();
     clock_t tend = clock();
     std::cout << "INFO: CPU for J*Jt "
 	      << float(tend-tstart)/float(CLOCKS_PER_SEC) << std::endl;
@@ -499,6 +526,48 @@ bool PhotomFit::Minimize(const std::string &WhatToFit)
   return true;
 }
 
+void PhotomFit::HessianAndGradient(SpMat &Hessian, Eigen::VectorXd &Grad)
+{
+  size_t nEntries, nBlocks;
+  CountTriplets(nEntries, nBlocks);
+  TripletList tList(0);
+  tList.Reserve(nEntries, nBlocks);
+  LSDerivatives(tList, Grad);
+  const SpMat &jacobian = _jacobianAssembler.Assemble(tList, _nParTot,
+						      tList.NextFreeIndex());
+  tList.clear();
+  Hessian = jacobian*jacobian.transpose();
+  _jacobianAssembler.ReleaseMatrix();
+}
+
+/*! Levenberg-Marquardt iterations with outlier rejection in between
+  iterations, driven by LevenbergMarquardt (in SparseAssembler.h), as
+  AstromFit::MinimizeLM. Same return codes and convergence criteria. */
+unsigned PhotomFit::MinimizeLM(const std::string &WhatToFit,
+			       const double NSigRejCut,
+			       const unsigned MaxIter,
+			       const double Chi2Tol)
+{
+  AssignIndices(WhatToFit);
+
+  LMFitCallbacks fit;
+  fit.HessianAndGradient = [this](SpMat &H, Eigen::VectorXd &G)
+    { HessianAndGradient(H, G);};
+  fit.ComputeChi2 = [this]() { return ComputeChi2();};
+  fit.OffsetParams = [this](const Eigen::VectorXd &Delta) { OffsetParams(Delta);};
+  fit.RemoveOutliers = [this](const double NSigCut)
+    {
+      MeasuredStarList outliers;
+      FindOutliers(NSigCut, outliers);
+      unsigned n_outliers = outliers.size();
+      outliers.RemoveFromFits();
+      return n_outliers;
+    };
+  return LevenbergMarquardt<Eigen::SimplicialLDLT<SpMat> >(fit, _nParTot,
+							     "PhotomFit::MinimizeLM",
+							     NSigRejCut, MaxIter, Chi2Tol);
+}
+
 
 void PhotomFit::MakeResTuple(const std::string &TupleName) const
 {
@@ -0,0 +1,176 @@
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#include "lsst/jointcal/RefCatalog.h"
+#include "lsst/jointcal/AstroUtils.h"
+#include "lsst/jointcal/Gtransfo.h"
+#include "lsst/pex/exceptions.h"
+
+namespace lsst {
+namespace jointcal {
+
+
+RefCatalog::RefCatalog(const double RaMin, const double RaMax,
+		       const double DecMin, const double DecMax)
+{
+  BaseStarList skyStars;
+  UsnoRead(Frame(RaMin, DecMin, RaMax, DecMax), RColor, skyStars);
+  if (skyStars.size() == 0)
+    {
+      std::cerr << "ERROR: Could not collect anything from a ref catalog : giving up" << std::endl;
+      throw LSST_EXCEPT(lsst::pex::exceptions::DomainError, "No objects grabbed in the reference catalog.");
+    }
+  ConvertMagToFlux(skyStars, 0.);
+  build_index(skyStars);
+  _frame = Frame(RaMin, DecMin, RaMax, DecMax);
+}
+
+RefCatalog::RefCatalog(const BaseStarList &SkyStars)
+{
+  build_index(SkyStars);
+}
+
+
+/* about 100 stars per band, which keeps the bands narrow compared to
+   the usual query frames. ra's are brought back to [0,360[ (the
+   readers shift them when the read region crosses ra=0). */
+void RefCatalog::build_index(const BaseStarList &SkyStars)
+{
+  _stars.clear();
+  _stars.reserve(SkyStars.size());
+  for (auto si = SkyStars.begin(); si != SkyStars.end(); ++si)
+    {
+      const BaseStar &s = **si;
+      if (s.x >= 0 && s.x < 360.)
+	{
+	  _stars.push_back(*si);
+	  continue;
+	}
+      BaseStar *copy = new BaseStar(s);
+      copy->x -= 360.*floor(copy->x/360.);
+      _stars.push_back(copy);
+    }
+  if (_stars.empty())
+    {
+      _frame = Frame();
+      _decMin = 0; _bandHeight = 1;
+      _bandStart.assign(2, 0);
+      _ra.clear();
+      return;
+    }
+  // the covered frame, in the coordinates of the input stars
+  const BaseStar &first = **SkyStars.begin();
+  double raMin = first.x, raMax = raMin;
+  for (auto si = SkyStars.begin(); si != SkyStars.end(); ++si)
+    {
+      raMin = std::min(raMin, (*si)->x); raMax = std::max(raMax, (*si)->x);
+    }
+  double decMin = _stars[0]->y, decMax = decMin;
+  for (auto &s : _stars)
+    {
+      decMin = std::min(decMin, s->y); decMax = std::max(decMax, s->y);
+    }
+  _frame = Frame(raMin, decMin, raMax, decMax);
+  unsigned nBands = std::max(size_t(1), _stars.size()/100);
+  _decMin = decMin;
+  _bandHeight = (decMax > decMin) ? (decMax-decMin)/nBands : 1;
+  auto band = [this, nBands](const BaseStar &S)
+    { return std::min(nBands-1, unsigned((S.y-_decMin)/_bandHeight));};
+  std::sort(_stars.begin(), _stars.end(),
+	    [&band](const CountedRef<BaseStar> &L, const CountedRef<BaseStar> &R)
+	    { unsigned bl = band(*L), br = band(*R);
+	      return (bl != br) ? (bl < br) : (L->x < R->x);});
+  _ra.resize(_stars.size());
+  _bandStart.assign(nBands+1, _stars.size());
+  for (unsigned k = _stars.size(); k-- > 0; )
+    {
+      _ra[k] = _stars[k]->x;
+      _bandStart[band(*_stars[k])] = k;
+    }
+  // empty bands start where the next one does
+  for (unsigned b = nBands; b-- > 0; )
+    _bandStart[b] = std::min(_bandStart[b], _bandStart[b+1]);
+  std::cout << "INFO: RefCatalog indexed " << _stars.size() << " stars in "
+	    << nBands << " declination bands" << std::endl;
+}
+
+
+/* appends copies of the stars with ra in [RaMin,RaMax] and dec in
+   [DecMin,DecMax], with RaShift added to their ra. */
+void RefCatalog::query_ra_range(const double RaMin, const double RaMax,
+				const double DecMin, const double DecMax,
+				const double RaShift, BaseStarList &Out) const
+{
+  if (_stars.empty() || RaMin > RaMax) return;
+  int nBands = _bandStart.size()-1;
+  int b0 = std::max(0, int(floor((DecMin-_decMin)/_bandHeight)));
+  int b1 = std::min(nBands-1, int(floor((DecMax-_decMin)/_bandHeight)));
+  for (int b = b0; b <= b1; ++b)
+    {
+      auto begin = _ra.begin()+_bandStart[b];
+      auto end = _ra.begin()+_bandStart[b+1];
+      auto first = std::lower_bound(begin, end, RaMin);
+      auto last = std::upper_bound(first, end, RaMax);
+      for (auto k = first - _ra.begin(); k < last - _ra.begin(); ++k)
+	{
+	  const BaseStar &s = *_stars[k];
+	  if (s.y < DecMin || s.y > DecMax) continue;
+	  BaseStar *copy = new BaseStar(s);
+	  copy->x += RaShift;
+	  Out.push_back(copy);
+	}
+    }
+}
+
+bool RefCatalog::Covers(const Frame &SkyFrame) const
+{
+  double covered = 0;
+  for (int shift = -1; shift <= 1; ++shift)
+    covered += (SkyFrame*Frame(_frame.xMin+360.*shift, _frame.yMin,
+			       _frame.xMax+360.*shift, _frame.yMax)).Area();
+  // allow for rounding errors only
+  return (covered >= (1-1e-9)*SkyFrame.Area());
+}
+
+void RefCatalog::Query(const Frame &SkyFrame, BaseStarList &Out) const
+{
+  Out.clear();
+  if (!Covers(SkyFrame))
+    {
+      std::cerr << "ERROR: RefCatalog queried in " << SkyFrame
+		<< " , outside of the region it covers " << _frame << std::endl;
+      throw LSST_EXCEPT(lsst::pex::exceptions::DomainError,
+			"RefCatalog::Query : the requested region is not covered by the catalog");
+    }
+  double minra = SkyFrame.xMin, maxra = SkyFrame.xMax;
+  double mindec = SkyFrame.yMin, maxdec = SkyFrame.yMax;
+  // same conventions as the catalog readers (see AstroUtils.cc)
+  if (minra < 0)
+    {
+      query_ra_range(minra+360., 360., mindec, maxdec, -360., Out);
+      query_ra_range(0., maxra, mindec, maxdec, 0., Out);
+    }
+  else if (maxra > 360.)
+    {
+      query_ra_range(minra, 360., mindec, maxdec, 0., Out);
+      query_ra_range(0., maxra-360., mindec, maxdec, 360., Out);
+    }
+  else query_ra_range(minra, maxra, mindec, maxdec, 0., Out);
+  Out.FluxSort();
+}
+
+bool RefCatalog::Collect(const Frame &SkyFrame, const TanPix2RaDec &Wcs, BaseStarList &Out) const
+{
+  Query(SkyFrame, Out);
+  if (Out.size() == 0)
+    {
+      std::cerr << "ERROR: Could not collect anything from a ref catalog : giving up" << std::endl;
+      throw LSST_EXCEPT(lsst::pex::exceptions::DomainError, "No objects grabbed in the reference catalog.");
+    }
+  TanRaDec2Pix sky2Pix = Wcs.invert();
+  Out.ApplyTransfo(sky2Pix);
+  return true;
+}
+
+}} // end of namespaces
@@ -15,11 +15,16 @@ SimplePhotomModel::SimplePhotomModel(const CcdImageList &L)
   for (auto i = L.begin(); i !=L.end(); ++i)
     {
       const CcdImage &im = **i;
+      if (im.Index() < 0)
+	throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePhotomModel : CcdImage "+im.Name()+" has no index");
+      if (unsigned(im.Index()) >= _myMap.size()) _myMap.resize(im.Index()+1);
+      PhotomStuff &pf = _myMap[im.Index()];
+      pf.ccdImage = &im;
       unsigned shoot = im.Shoot();
       if (refShoot == -1) refShoot = shoot;
       if (shoot==refShoot)
-	  _myMap[&im].fixed=true;
-      else _myMap[&im].fixed=false;
+	  pf.fixed=true;
+      else pf.fixed=false;
     }
   std::cout << "INFO: SimplePhotomModel : using exposure " << refShoot << " as photometric reference " << std::endl;
 }
@@ -29,8 +34,8 @@ unsigned SimplePhotomModel::AssignIndices(const std::string &WhatToFit,  unsigne
   unsigned ipar = FirstIndex;
   for (auto i = _myMap.begin(); i!= _myMap.end(); ++i)
     {
-      PhotomStuff& pf=i->second;
-      if (pf.fixed) continue;
+      PhotomStuff& pf=*i;
+      if (pf.fixed || !pf.ccdImage) continue;
       pf.index=ipar;
       ipar++;
     }
@@ -41,23 +46,23 @@ unsigned SimplePhotomModel::AssignIndices(const std::string &WhatToFit,  unsigne
  {
    for (auto i = _myMap.begin(); i!= _myMap.end(); ++i)
      {
-       PhotomStuff& pf=i->second;
-       if (!pf.fixed) pf.factor += Delta[pf.index];
+       PhotomStuff& pf=*i;
+       if (pf.ccdImage && !pf.fixed) pf.factor += Delta[pf.index];
      }
  }
 
  SimplePhotomModel::PhotomStuff& SimplePhotomModel::find(const CcdImage &C)
    {
-     auto i = _myMap.find(&C);
-     if  (i==_myMap.end()) throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel::find, never heard of CcdImage "+C.Name());
-     return (i->second);
+     unsigned k = C.Index(); // -1 wraps around
+     if  (k >= _myMap.size() || _myMap[k].ccdImage != &C) throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel::find, never heard of CcdImage "+C.Name());
+     return _myMap[k];
    }
 
  const SimplePhotomModel::PhotomStuff& SimplePhotomModel::find(const CcdImage &C)  const
    {
-     auto i = _myMap.find(&C);
-     if  (i==_myMap.end()) throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel::find, never heard of CcdImage "+C.Name());
-     return (i->second);
+     unsigned k = C.Index(); // -1 wraps around
+     if  (k >= _myMap.size() || _myMap[k].ccdImage != &C) throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel::find, never heard of CcdImage "+C.Name());
+     return _myMap[k];
    }
 
 
@@ -67,6 +72,11 @@ unsigned SimplePhotomModel::AssignIndices(const std::string &WhatToFit,  unsigne
    return pf.factor;
  }
      
+ unsigned SimplePhotomModel::GetNpar(const CcdImage &Ccd) const
+ {
+   return (find(Ccd).fixed) ? 0 : 1;
+ }
+
  void SimplePhotomModel::GetIndicesAndDerivatives(const MeasuredStar &M,
 						  const CcdImage &Ccd,
 						  std::vector<unsigned> &Indices,
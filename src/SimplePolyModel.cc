@@ -18,7 +18,8 @@ SimplePolyModel::SimplePolyModel(const CcdImageList &L,
 				 const ProjectionHandler* ProjH,
 				 bool InitFromWCS,
 				 unsigned NNotFit,
-				 unsigned degree) : _sky2TP(ProjH)
+				 unsigned degree,
+				 bool Chebyshev) : _sky2TP(ProjH)
 
 {
   // from datacards (or default)
@@ -28,11 +29,20 @@ SimplePolyModel::SimplePolyModel(const CcdImageList &L,
   for (auto i=L.cbegin(); i!= L.end(); ++i, ++count)
     {
       const CcdImage &im = **i;
+      if (im.Index() < 0)
+	throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel : CcdImage "+im.Name()+" has no index");
+      if (unsigned(im.Index()) >= _myMap.size())
+	{
+	  _myMap.resize(im.Index()+1);
+	  _owners.resize(im.Index()+1, NULL);
+	}
+      _owners[im.Index()] = &im;
+      std::unique_ptr<SimpleGtransfoMapping> &mapping = _myMap[im.Index()];
       if (count < NNotFit)
 	{
 	  SimpleGtransfoMapping * id = new SimpleGtransfoMapping(GtransfoIdentity());
 	  id->SetIndex(-1); // non sense, because it has no parameters
-	  _myMap[&im] = std::unique_ptr<SimpleGtransfoMapping>(id);
+	  mapping.reset(id);
 	}
       else
 	// Given how AssignIndices works, only the SimplePolyMapping's
@@ -51,6 +61,19 @@ SimplePolyModel::SimplePolyModel(const CcdImageList &L,
 		if (pol.Degree() > 0) // if not, it cannot be decreased
 	    while (unsigned(pol.Npar()) > 2*nObj)
 	      pol.SetDegree(pol.Degree() - 1);
+	  const Frame &frame  = im.ImageFrame();
+	  if (Chebyshev)
+	    {
+	      /* the Chebyshev basis handles the normalization of
+		 coordinates by itself */
+	      GtransfoChebyshev cheb(pol.Degree(), frame);
+	      if (InitFromWCS)
+		cheb = GtransfoChebyshev(im.Pix2TangentPlane(), frame, pol.Degree());
+	      SimpleChebyshevMapping *chebMapping = new SimpleChebyshevMapping(cheb);
+	      chebMapping->CacheBasis(im.CatalogForFit());
+	      mapping.reset(chebMapping);
+	      continue;
+	    }
 	  /* We have to center and normalize the coordinates so that
 	     the fit matrix is not too ill-conditionned. Basically, x
 	     and y in pixels are mapped to [-1,1]. When the
@@ -59,7 +82,6 @@ SimplePolyModel::SimplePolyModel(const CcdImageList &L,
 	     fitted transformation is returned, so that the trick
 	     remains hidden
 	   */
-	  const Frame &frame  = im.ImageFrame();
 	  GtransfoLin shiftAndNormalize = NormalizeCoordinatesTransfo(frame);
 	  if (InitFromWCS)
 	    {
@@ -69,17 +91,27 @@ SimplePolyModel::SimplePolyModel(const CcdImageList &L,
 	      pol = pol*shiftAndNormalize.invert();
 
 	    }
-	  _myMap[&im] = std::unique_ptr<SimpleGtransfoMapping>(new SimplePolyMapping(shiftAndNormalize, pol));
+	  mapping.reset(new SimplePolyMapping(shiftAndNormalize, pol));
 	}
     }
 }
 
 
+SimpleGtransfoMapping* SimplePolyModel::find_mapping(const CcdImage &C) const
+{
+  unsigned k = C.Index(); // -1 wraps around
+  if (k >= _myMap.size()) return NULL;
+  /* Index() is only unique within one Associations */
+  if (_owners[k] != &C)
+    throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel : never heard of CcdImage "+C.Name()+" (another CcdImage has the same index)");
+  return _myMap[k].get();
+}
+
 const Mapping* SimplePolyModel::GetMapping(const CcdImage &C) const
 {
-  mapType::const_iterator i = _myMap.find(&C);
-  if  (i==_myMap.end()) throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel::GetMapping, never heard of CcdImage "+C.Name());
-  return (i->second.get());
+  const Mapping *m = find_mapping(C);
+  if  (!m) throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel::GetMapping, never heard of CcdImage "+C.Name());
+  return m;
 }
 
 unsigned SimplePolyModel::AssignIndices(unsigned FirstIndex, std::string &WhatToFit)
@@ -92,8 +124,8 @@ unsigned SimplePolyModel::AssignIndices(unsigned FirstIndex, std::string &WhatTo
   unsigned index = FirstIndex;
   for (auto i = _myMap.begin(); i!=_myMap.end(); ++i)
     {
-      SimplePolyMapping *p = dynamic_cast<SimplePolyMapping *>(&*(i->second));
-      if (!p) continue; // it should be GtransfoIdentity
+      SimpleGtransfoMapping *p = i->get();
+      if (!p || p->Npar() == 0) continue; // it should be GtransfoIdentity
       p->SetIndex(index);
       index+= p->Npar();
     }
@@ -104,8 +136,8 @@ void SimplePolyModel::OffsetParams(const Eigen::VectorXd &Delta)
 {
   for (auto i = _myMap.begin(); i!=_myMap.end(); ++i)
     {
-      SimplePolyMapping *p = dynamic_cast<SimplePolyMapping *>(&*(i->second));
-      if (!p) continue; // it should be GtransfoIdentity
+      SimpleGtransfoMapping *p = i->get();
+      if (!p || p->Npar() == 0) continue; // it should be GtransfoIdentity
       p->OffsetParams(&Delta(p->Index()));
     }
 }
@@ -113,21 +145,26 @@ void SimplePolyModel::OffsetParams(const Eigen::VectorXd &Delta)
 void SimplePolyModel::FreezeErrorScales()
 {
   for (auto i = _myMap.begin(); i!=_myMap.end(); ++i)
-    i->second->FreezeErrorScales();
+    if (*i) (*i)->FreezeErrorScales();
 }
 
 
 const Gtransfo& SimplePolyModel::GetTransfo(const CcdImage &Ccd) const
 {
   // return GetMapping(Ccd)->Transfo(); // cannot do that
-  auto p = _myMap.find(&Ccd);
-  if  (p==_myMap.end()) throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel::GetTransfo, never heard of CcdImage "+Ccd.Name());
-  return p->second->Transfo();
+  const SimpleGtransfoMapping *p = find_mapping(Ccd);
+  if  (!p) throw LSST_EXCEPT(pex::exceptions::InvalidParameterError,"SimplePolyModel::GetTransfo, never heard of CcdImage "+Ccd.Name());
+  return p->Transfo();
 }
 
 PTR(TanSipPix2RaDec) SimplePolyModel::ProduceSipWcs(const CcdImage &Ccd) const
 {
-  const GtransfoPoly &pix2Tp=dynamic_cast<const GtransfoPoly&>(GetTransfo(Ccd));
+  const Gtransfo &fitted = GetTransfo(Ccd);
+  const GtransfoChebyshev *cheb = dynamic_cast<const GtransfoChebyshev*>(&fitted);
+  // SIP wants monomials
+  GtransfoPoly chebAsPoly;
+  if (cheb) chebAsPoly = cheb->ToPoly();
+  const GtransfoPoly &pix2Tp= (cheb) ? chebAsPoly : dynamic_cast<const GtransfoPoly&>(fitted);
   const TanRaDec2Pix *proj=dynamic_cast<const TanRaDec2Pix*>(Sky2TP(Ccd));
   if (!(&pix2Tp)  || ! proj) return NULL;
 
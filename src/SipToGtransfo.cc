@@ -1,7 +1,15 @@
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <map>
+#include <vector>
 
 #include "Eigen/Core"
 #include "lsst/jointcal/SipToGtransfo.h"
+#include "lsst/jointcal/DistortionModel.h"
+#include "lsst/jointcal/CcdImage.h"
 #include "lsst/afw/image/ImageUtils.h"
 #include "lsst/jointcal/Point.h"
 #include "lsst/jointcal/Frame.h"
@@ -18,7 +26,65 @@ static const int lsstToFitsPixels = +1;
 static const int fitsToLsstPixels = -1;
 
 typedef boost::shared_ptr<jointcal::GtransfoPoly> GtPoly_Ptr;
-	
+
+
+/* A thread-safe cache of conversion results, keyed on all the numbers
+   that define a conversion. The same WCS's are often converted
+   several times (e.g. a calexp contributing to several tracts), as
+   distinct objects, hence the keying on content. When full, the cache
+   is simply cleared. */
+template <class Value> class ConversionCache
+{
+  std::map<std::vector<double>, boost::shared_ptr<const Value> > _entries;
+  std::mutex _mutex;
+
+ public :
+  //! NULL if not there.
+  boost::shared_ptr<const Value> Find(const std::vector<double> &Key)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto i = _entries.find(Key);
+    if (i == _entries.end()) return boost::shared_ptr<const Value>();
+    return i->second;
+  }
+
+  //! returns the stored copy of V.
+  boost::shared_ptr<const Value> Insert(const std::vector<double> &Key, const Value &V)
+  {
+    boost::shared_ptr<const Value> entry(new Value(V));
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_entries.size() >= 10000) _entries.clear();
+    _entries[Key] = entry;
+    return entry;
+  }
+
+  void Clear()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries.clear();
+  }
+};
+
+static void append_to_key(const Eigen::MatrixXd &M, std::vector<double> &Key)
+{
+  Key.push_back(M.rows());
+  Key.push_back(M.cols());
+  Key.insert(Key.end(), M.data(), M.data()+M.size());
+}
+
+static void append_to_key(const GtransfoPoly &P, std::vector<double> &Key)
+{
+  Key.push_back(P.Degree());
+  for (unsigned i=0; i<=P.Degree(); ++i)
+    for (unsigned j=0; j<=P.Degree()-i; ++j)
+      {
+	Key.push_back(P.Coeff(i,j,0));
+	Key.push_back(P.Coeff(i,j,1));
+      }
+}
+
+static ConversionCache<TanSipPix2RaDec> convertTanWcsCache;
+
 
 jointcal::TanSipPix2RaDec ConvertTanWcs(const boost::shared_ptr<lsst::afw::image::TanWcs> wcs)
 {
@@ -33,15 +99,32 @@ jointcal::TanSipPix2RaDec ConvertTanWcs(const boost::shared_ptr<lsst::afw::image
 
   lsst::daf::base::PropertyList::Ptr wcsMeta = wcs->getFitsMetadata();
 
+  Eigen::Matrix2d cdMat = wcs->getCDMatrix();
+  //  lsst::afw::coord::Coord tp = wcs->getSkyOrigin()->getPosition(lsst::afw::geom::degrees);
+  // the above line returns radians ?!
+  double ra  = wcsMeta->get<double>("CRVAL1");
+  double dec = wcsMeta->get<double>("CRVAL2");
+
+  // the key: everything the result depends on
+  std::vector<double> key = {crpix_lsst[0], crpix_lsst[1], ra, dec,
+			     cdMat(0,0), cdMat(0,1), cdMat(1,0), cdMat(1,1)};
+  Eigen::MatrixXd sipA;
+  Eigen::MatrixXd sipB;
+  int sipOrder = 0;
   if (wcs->hasDistortion())
     {
-      Eigen::MatrixXd sipA;
-      Eigen::MatrixXd sipB;
       lsst::afw::image::TanWcs::decodeSipHeader(*wcsMeta, "A", sipA);
       lsst::afw::image::TanWcs::decodeSipHeader(*wcsMeta, "B", sipB);
-  
-      int sipOrder = std::max(wcsMeta->get<int>("A_ORDER"), wcsMeta->get<int>("B_ORDER"));
+      sipOrder = std::max(wcsMeta->get<int>("A_ORDER"), wcsMeta->get<int>("B_ORDER"));
+      key.push_back(sipOrder);
+      append_to_key(sipA, key);
+      append_to_key(sipB, key);
+    }
+  boost::shared_ptr<const TanSipPix2RaDec> cached = convertTanWcsCache.Find(key);
+  if (cached) return *cached;
 
+  if (wcs->hasDistortion())
+    {
       jointcal::GtransfoPoly sipPoly(sipOrder);
       for (int i=0; i<=sipOrder; ++i)
         {
@@ -72,7 +155,6 @@ jointcal::TanSipPix2RaDec ConvertTanWcs(const boost::shared_ptr<lsst::afw::image
     }
 
   // now compute the lin part (nothing to do with SIP) */
-  Eigen::Matrix2d cdMat = wcs->getCDMatrix();
   jointcal::GtransfoLin cdTrans;
   cdTrans.Coeff(1,0,0) = cdMat(0,0); // CD1_1
   cdTrans.Coeff(0,1,0) = cdMat(0,1); // CD1_2
@@ -84,28 +166,47 @@ jointcal::TanSipPix2RaDec ConvertTanWcs(const boost::shared_ptr<lsst::afw::image
   // CD's apply to CRPIX-shifted coordinate
   jointcal::GtransfoLin linPart = cdTrans * crpixShift;
 
-  //  lsst::afw::coord::Coord tp = wcs->getSkyOrigin()->getPosition(lsst::afw::geom::degrees);
-  // the above line returns radians ?!
-  double ra  = wcsMeta->get<double>("CRVAL1");
-  double dec = wcsMeta->get<double>("CRVAL2");
-  
   jointcal::Point tangentPoint(ra,dec);
 
   // return jointcal::TanSipPix2RaDec(linPart, tangentPoint, sipCorr->get());
-  return jointcal::TanSipPix2RaDec(linPart, tangentPoint, (const jointcal::GtransfoPoly*) sipCorr.get());
-
+  jointcal::TanSipPix2RaDec result(linPart, tangentPoint, (const jointcal::GtransfoPoly*) sipCorr.get());
+  convertTanWcsCache.Insert(key, result);
+  return result;
 }
 
 
 
+/* What GtransfoToTanWcs hands over to the TanWcs constructor. Computing
+   it only involves jointcal and Eigen, so that it can be done in
+   several threads at once (see ProduceTanWcsList). */
+struct SipWcsParameters
+{
+  afwGeom::Point2D crval, crpix_lsst;
+  Eigen::Matrix2d cdMat;
+  bool hasSip;
+  Eigen::MatrixXd sipA, sipB, sipAp, sipBp;
+};
+
+static PTR(afwImg::TanWcs) make_tan_wcs(const SipWcsParameters &P)
+{
+  if (!P.hasSip)
+    return boost::shared_ptr<afwImg::TanWcs>(new afwImg::TanWcs(P.crval, P.crpix_lsst, P.cdMat));
+  return boost::shared_ptr<afwImg::TanWcs>(new afwImg::TanWcs(P.crval, P.crpix_lsst, P.cdMat,
+							      P.sipA, P.sipB, P.sipAp, P.sipBp));
+}
+
 /* The inverse transformation i.e. convert from the fit result to the SIP
    convention. */
-PTR(afwImg::TanWcs) GtransfoToTanWcs(const jointcal::TanSipPix2RaDec WcsTransfo,
-				     const jointcal::Frame &CcdFrame,
-				     const bool NoLowOrderSipTerms)
+static void sip_wcs_parameters(const jointcal::TanSipPix2RaDec &WcsTransfo,
+			       const jointcal::Frame &CcdFrame,
+			       const bool NoLowOrderSipTerms,
+			       SipWcsParameters &P)
 {
+  afwGeom::Point2D &crpix_lsst = P.crpix_lsst;
+  afwGeom::Point2D &crval = P.crval;
+  Eigen::Matrix2d &cdMat = P.cdMat;
   GtransfoLin linPart = WcsTransfo.LinPart();
-  afwGeom::Point2D crpix_lsst; // in LSST "frame"
+  // crpix_lsst is in LSST "frame"
   /* In order to remove the low order sip terms, one has to
      define the linear WCS transformation as the expansion of
      the total pix-to-tangent plane (or focal plane) at the
@@ -136,19 +237,17 @@ PTR(afwImg::TanWcs) GtransfoToTanWcs(const jointcal::TanSipPix2RaDec WcsTransfo,
      units */
 
   // crval from type conversion
-  afwGeom::Point2D crval;
   crval[0] = WcsTransfo.TangentPoint().x;
   crval[1] = WcsTransfo.TangentPoint().y;
 
   // CD matrix:
-  Eigen::Matrix2d cdMat;
   cdMat(0,0) = linPart.Coeff(1,0,0); // CD1_1
   cdMat(0,1) = linPart.Coeff(0,1,0); // CD1_2
   cdMat(1,0) = linPart.Coeff(1,0,1); // CD2_1
   cdMat(1,1) = linPart.Coeff(0,1,1); // CD2_2
   
-  if (!WcsTransfo.Corr()) // the WCS has no distortions
-    return boost::shared_ptr<afwImg::TanWcs>(new afwImg::TanWcs(crval,crpix_lsst,cdMat));
+  P.hasSip = (WcsTransfo.Corr() != NULL);
+  if (!P.hasSip) return; // the WCS has no distortions
 
   /* We are now given:
      - CRPIX
@@ -181,8 +280,10 @@ PTR(afwImg::TanWcs) GtransfoToTanWcs(const jointcal::TanSipPix2RaDec WcsTransfo,
   
   // now extract sip coefficients. First forward ones:
   int sipOrder = sipPoly.Degree();
-  Eigen::MatrixXd sipA(Eigen::MatrixXd::Zero(sipOrder+1,sipOrder+1));
-  Eigen::MatrixXd sipB(Eigen::MatrixXd::Zero(sipOrder+1,sipOrder+1));
+  Eigen::MatrixXd &sipA = P.sipA;
+  Eigen::MatrixXd &sipB = P.sipB;
+  sipA = Eigen::MatrixXd::Zero(sipOrder+1,sipOrder+1);
+  sipB = Eigen::MatrixXd::Zero(sipOrder+1,sipOrder+1);
   for (int i=0; i<=sipOrder; ++i)
     for (int j=0; j<=sipOrder-i; ++j)
       {
@@ -194,8 +295,10 @@ PTR(afwImg::TanWcs) GtransfoToTanWcs(const jointcal::TanSipPix2RaDec WcsTransfo,
 
   // now backwards coefficients
   sipOrder = sipPolyInv.Degree();
-  Eigen::MatrixXd sipAp(Eigen::MatrixXd::Zero(sipOrder+1,sipOrder+1));
-  Eigen::MatrixXd sipBp(Eigen::MatrixXd::Zero(sipOrder+1,sipOrder+1));
+  Eigen::MatrixXd &sipAp = P.sipAp;
+  Eigen::MatrixXd &sipBp = P.sipBp;
+  sipAp = Eigen::MatrixXd::Zero(sipOrder+1,sipOrder+1);
+  sipBp = Eigen::MatrixXd::Zero(sipOrder+1,sipOrder+1);
   for (int i=0; i<=sipOrder; ++i)
     for (int j=0; j<=sipOrder-i; ++j)
       {
@@ -203,8 +306,97 @@ PTR(afwImg::TanWcs) GtransfoToTanWcs(const jointcal::TanSipPix2RaDec WcsTransfo,
 	sipBp(i,j) = sipPolyInv.Coeff(i,j,1);
       }
 
-  return boost::shared_ptr<afwImg::TanWcs>(new afwImg::TanWcs(crval, crpix_lsst, cdMat, sipA, sipB, sipAp, sipBp));
-  
+}
+
+static ConversionCache<SipWcsParameters> gtransfoToTanWcsCache;
+
+// sip_wcs_parameters, through gtransfoToTanWcsCache
+static boost::shared_ptr<const SipWcsParameters>
+  cached_sip_wcs_parameters(const jointcal::TanSipPix2RaDec &WcsTransfo,
+			    const jointcal::Frame &CcdFrame,
+			    const bool NoLowOrderSipTerms)
+{
+  GtransfoLin linPart = WcsTransfo.LinPart();
+  Point tangentPoint = WcsTransfo.TangentPoint();
+  std::vector<double> key = {double(NoLowOrderSipTerms),
+			     CcdFrame.xMin, CcdFrame.yMin, CcdFrame.xMax, CcdFrame.yMax,
+			     tangentPoint.x, tangentPoint.y};
+  append_to_key(linPart, key);
+  if (WcsTransfo.Corr()) append_to_key(*WcsTransfo.Corr(), key);
+  boost::shared_ptr<const SipWcsParameters> cached = gtransfoToTanWcsCache.Find(key);
+  if (cached) return cached;
+  SipWcsParameters p;
+  sip_wcs_parameters(WcsTransfo, CcdFrame, NoLowOrderSipTerms, p);
+  return gtransfoToTanWcsCache.Insert(key, p);
+}
+
+PTR(afwImg::TanWcs) GtransfoToTanWcs(const jointcal::TanSipPix2RaDec WcsTransfo,
+				     const jointcal::Frame &CcdFrame,
+				     const bool NoLowOrderSipTerms)
+{
+  return make_tan_wcs(*cached_sip_wcs_parameters(WcsTransfo, CcdFrame, NoLowOrderSipTerms));
+}
+
+void ClearWcsConversionCaches()
+{
+  convertTanWcsCache.Clear();
+  gtransfoToTanWcsCache.Clear();
+}
+
+std::vector<PTR(afwImg::TanWcs)> ProduceTanWcsList(const DistortionModel &Model,
+						   const CcdImageList &L,
+						   const bool NoLowOrderSipTerms,
+						   const unsigned NThreads)
+{
+  /* ProduceSipWcs goes through the model mappings, which may update
+     internal state (e.g. SimplePolyMapping::Transfo()). So the
+     TanSipPix2RaDec's are all produced here, by the calling thread,
+     and only the SIP parameters (and the inverse polynomials) are
+     computed concurrently. */
+  std::vector<const CcdImage*> ccds;
+  std::vector<PTR(TanSipPix2RaDec)> sips;
+  for (auto i = L.begin(); i != L.end(); ++i)
+    {
+      ccds.push_back(&(**i));
+      sips.push_back(Model.ProduceSipWcs(**i));
+    }
+  std::vector<boost::shared_ptr<const SipWcsParameters> > params(ccds.size());
+  unsigned nThreads = (NThreads > 0) ? NThreads :
+    std::max(std::thread::hardware_concurrency(), 1u);
+  nThreads = std::max(1u, std::min(nThreads, unsigned(ccds.size())));
+  /* every thread picks the next CcdImage. The first failure is handed
+     over to the caller, once all threads are done. */
+  std::atomic<unsigned> next(0);
+  std::mutex failureMutex;
+  std::exception_ptr failure;
+  auto worker = [&]()
+    {
+      for (unsigned k = next++; k < ccds.size(); k = next++)
+	{
+	  try
+	    {
+	      if (!sips[k]) continue;
+	      params[k] = cached_sip_wcs_parameters(*sips[k], ccds[k]->ImageFrame(), NoLowOrderSipTerms);
+	    }
+	  catch (...)
+	    {
+	      std::lock_guard<std::mutex> lock(failureMutex);
+	      if (!failure) failure = std::current_exception();
+	    }
+	}
+    };
+  if (nThreads <= 1) worker();
+  else
+    {
+      std::vector<std::thread> threads;
+      for (unsigned t=0; t<nThreads; ++t) threads.push_back(std::thread(worker));
+      for (auto &t : threads) t.join();
+    }
+  if (failure) std::rethrow_exception(failure);
+  std::vector<PTR(afwImg::TanWcs)> res(ccds.size());
+  for (unsigned k=0; k<ccds.size(); ++k)
+    if (params[k]) res[k] = make_tan_wcs(*params[k]);
+  return res;
 }
 
 }} // end of namespaces
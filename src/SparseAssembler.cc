@@ -0,0 +1,103 @@
+#include <algorithm>
+
+#include "lsst/jointcal/SparseAssembler.h"
+
+namespace lsst {
+namespace jointcal {
+
+
+void SparseAssembler::Build(const TripletList &TList,
+			    const unsigned NRows, const unsigned NCols)
+{
+  _matrix.resize(NRows, NCols);
+  _matrix.setFromTriplets(TList.begin(), TList.end());
+  _matrix.makeCompressed();
+  const int *outer = _matrix.outerIndexPtr();
+  const int *inner = _matrix.innerIndexPtr();
+  _rows = NRows;
+  _cols = NCols;
+  _outer.assign(outer, outer+_matrix.outerSize()+1);
+  _inner.assign(inner, inner+_matrix.nonZeros());
+  // locate every triplet in the compressed storage
+  _slots.resize(TList.size());
+  unsigned k = 0;
+  for (auto t = TList.begin(); t != TList.end(); ++t, ++k)
+    {
+      int o = (MatrixType::IsRowMajor) ? t->row() : t->col();
+      int in = (MatrixType::IsRowMajor) ? t->col() : t->row();
+      const int *pos = std::lower_bound(inner+outer[o], inner+outer[o+1], in);
+      _slots[k] = pos-inner;
+    }
+}
+
+/* rebuilds _matrix from the cached pattern. Returns false if the
+   pattern does not accommodate the triplets. _matrix values are then
+   garbage. When the matrix was not released, resize() keeps its
+   storage, so that nothing gets reallocated. */
+bool SparseAssembler::Refill(const TripletList &TList)
+{
+  _matrix.resize(_rows, _cols);
+  _matrix.resizeNonZeros(_inner.size());
+  std::copy(_outer.begin(), _outer.end(), _matrix.outerIndexPtr());
+  std::copy(_inner.begin(), _inner.end(), _matrix.innerIndexPtr());
+  const int *outer = &_outer[0];
+  const int *inner = &_inner[0];
+  double *values = _matrix.valuePtr();
+  std::fill(values, values+_inner.size(), 0.);
+  unsigned k = 0;
+  for (auto t = TList.begin(); t != TList.end(); ++t, ++k)
+    {
+      int o = (MatrixType::IsRowMajor) ? t->row() : t->col();
+      int in = (MatrixType::IsRowMajor) ? t->col() : t->row();
+      int slot = _slots[k];
+      if (slot < outer[o] || slot >= outer[o+1] || inner[slot] != in)
+	return false;
+      values[slot] += t->value();
+    }
+  return true;
+}
+
+const SparseAssembler::MatrixType&
+SparseAssembler::Assemble(const TripletList &TList,
+			  const unsigned NRows, const unsigned NCols)
+{
+  if (_slots.size() == TList.size() && TList.size() != 0
+      && _rows == NRows && _cols == NCols
+      && Refill(TList))
+    {
+      _nRecycled++;
+      return _matrix;
+    }
+  Build(TList, NRows, NCols);
+  return _matrix;
+}
+
+void SparseAssembler::ReleaseMatrix()
+{
+  MatrixType().swap(_matrix);
+}
+
+void SparseAssembler::Release()
+{
+  ReleaseMatrix();
+  _rows = _cols = 0;
+  std::vector<int>().swap(_outer);
+  std::vector<int>().swap(_inner);
+  std::vector<int>().swap(_slots);
+}
+
+
+/* absolute, rather than relative to the largest term: parameters
+   of very different scales (positions, distortion coefficients, ...)
+   are fitted together. */
+static const double diagFloor = 1e-10;
+
+void DampDiagonal(Eigen::SparseMatrix<double> &H, const Eigen::VectorXd &Diag,
+		  const double Lambda)
+{
+  for (int k=0; k<H.outerSize(); ++k)
+    H.coeffRef(k,k) = std::max(Diag(k), diagFloor)*(1+Lambda);
+}
+
+
+}} // end of namespaces
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <cmath>
 
 #include "lsst/jointcal/Gtransfo.h"
 #include "lsst/jointcal/StarMatch.h"
@@ -47,21 +48,9 @@ std::ostream& operator << (std::ostream &stream, const StarMatch &Match)
   return stream;
 }
 
-static double* chi2_array(const StarMatchList &L,const Gtransfo &T)
+static unsigned chi2_cleanup(StarMatchList &L,  const double Chi2Cut)
 {
-  unsigned s = L.size();
-  double *res = new double[s];
-  unsigned count = 0;
-  for (auto it= L.begin(); it!= L.end(); ++it)
-    res[count++] = it->Chi2(T);
-  return res;
-}
-
-
-static unsigned chi2_cleanup(StarMatchList &L,  const double Chi2Cut,
-			     const Gtransfo &T)
-{
-  unsigned erased = L.RemoveAmbiguities(T);
+  unsigned erased = 0;
   for (auto  smi = L.begin(); smi != L.end(); )
     {
       if (smi->chi2  > Chi2Cut)
@@ -75,23 +64,141 @@ static unsigned chi2_cleanup(StarMatchList &L,  const double Chi2Cut,
 }
   
 
-#ifdef DO_WE_NEED_IT
-static double *get_dist2_array(const StarMatchList &L, const Gtransfo &T)
+void StarMatchArrays::Load(const StarMatchList &L)
+{
+  unsigned n = L.size();
+  std::vector<double> *all[] = {&x1, &y1, &vx1, &vy1, &vxy1,
+				&x2, &y2, &vx2, &vy2, &vxy2,
+				&tx, &ty, &tvx, &tvy, &tvxy};
+  for (auto v : all) v->resize(n);
+  unsigned k = 0;
+  for (auto it = L.begin(); it != L.end(); ++it, ++k)
+    {
+      const FatPoint &p1 = it->point1;
+      const FatPoint &p2 = it->point2;
+      x1[k] = p1.x; y1[k] = p1.y; vx1[k] = p1.vx; vy1[k] = p1.vy; vxy1[k] = p1.vxy;
+      x2[k] = p2.x; y2[k] = p2.y; vx2[k] = p2.vx; vy2[k] = p2.vy; vxy2[k] = p2.vxy;
+    }
+}
+
+/* Linear transformations (the usual case in matching and refine
+   loops) propagate errors with constant derivatives, and are done
+   in plain loops over the arrays. Other transformations go through
+   TransformPosAndErrors, as StarMatch::Chi2 does. */
+void StarMatchArrays::transform(const Gtransfo &T, const bool WithErrors)
+{
+  unsigned n = size();
+  if (n == 0) return;
+  if (!WithErrors)
+    {
+      T.TransformArrays(&x1[0], &y1[0], &tx[0], &ty[0], n);
+      return;
+    }
+  const GtransfoPoly *poly = dynamic_cast<const GtransfoPoly *>(&T);
+  if (poly && poly->Degree() == 1)
+    {
+      T.TransformArrays(&x1[0], &y1[0], &tx[0], &ty[0], n);
+      const double a11 = poly->Coeff(1,0,0);
+      const double a12 = poly->Coeff(0,1,0);
+      const double a21 = poly->Coeff(1,0,1);
+      const double a22 = poly->Coeff(0,1,1);
+      for (unsigned k=0; k<n; ++k)
+	{
+	  tvx[k] = a11*(a11*vx1[k] + 2*a12*vxy1[k]) + a12*a12*vy1[k];
+	  tvy[k] = a21*a21*vx1[k] + a22*a22*vy1[k] + 2.*a21*a22*vxy1[k];
+	  tvxy[k] = a21*a11*vx1[k] + a22*a12*vy1[k] + (a21*a12+a11*a22)*vxy1[k];
+	}
+      return;
+    }
+  FatPoint in, out;
+  for (unsigned k=0; k<n; ++k)
+    {
+      in.x = x1[k]; in.y = y1[k];
+      in.vx = vx1[k]; in.vy = vy1[k]; in.vxy = vxy1[k];
+      T.TransformPosAndErrors(in, out);
+      tx[k] = out.x; ty[k] = out.y;
+      tvx[k] = out.vx; tvy[k] = out.vy; tvxy[k] = out.vxy;
+    }
+}
+
+void StarMatchArrays::Dist2(const Gtransfo &T, std::vector<double> &Out)
+{
+  transform(T, false);
+  unsigned n = size();
+  Out.resize(n);
+  for (unsigned k=0; k<n; ++k)
+    Out[k] = (tx[k]-x2[k])*(tx[k]-x2[k]) + (ty[k]-y2[k])*(ty[k]-y2[k]);
+}
+
+void StarMatchArrays::Chi2(const Gtransfo &T, std::vector<double> &Out)
+{
+  transform(T, true);
+  unsigned n = size();
+  Out.resize(n);
+  for (unsigned k=0; k<n; ++k)
+    {
+      double vxx = tvx[k] + vx2[k];
+      double vyy = tvy[k] + vy2[k];
+      double vxy = tvxy[k] + vxy2[k];
+      double det = vxx*vyy-vxy*vxy;
+      double dx = tx[k]-x2[k];
+      double dy = ty[k]-y2[k];
+      Out[k] = (vyy*sq(dx) + vxx*sq(dy) -2*vxy*dx*dy)/det;
+    }
+}
+
+void StarMatchArrays::Chi2AndDist2(const Gtransfo &T,
+				   std::vector<double> &Chi2s,
+				   std::vector<double> &Dist2s)
 {
-  unsigned npair = L.size();
-  if (npair == 0) return NULL;
-  double *dist = new double [npair];
+  Chi2(T, Chi2s);
+  unsigned n = size();
+  Dist2s.resize(n);
+  for (unsigned k=0; k<n; ++k)
+    Dist2s[k] = (tx[k]-x2[k])*(tx[k]-x2[k]) + (ty[k]-y2[k])*(ty[k]-y2[k]);
+}
 
-  unsigned i=0;
-  for (auto smi = L.begin(); smi != L.end(); ++smi, ++i)
+double StarMatchArrays::SumDist2(const Gtransfo &T)
+{
+  transform(T, false);
+  double dist2 = 0;
+  for (unsigned k=0, n=size(); k<n; ++k)
+    dist2 += (tx[k]-x2[k])*(tx[k]-x2[k]) + (ty[k]-y2[k])*(ty[k]-y2[k]);
+  return dist2;
+}
+
+double StarMatchArrays::SumChi2(const Gtransfo &T)
+{
+  transform(T, true);
+  double chi2 = 0;
+  for (unsigned k=0, n=size(); k<n; ++k)
     {
-      const Point &p1 = smi->point1;
-      const Point &p2 = smi->point2;
-      dist[i] = p2.Dist2(T.apply(p1));
+      double vxx = tvx[k] + vx2[k];
+      double vyy = tvy[k] + vy2[k];
+      double vxy = tvxy[k] + vxy2[k];
+      double det = vxx*vyy-vxy*vxy;
+      double dx = tx[k]-x2[k];
+      double dy = ty[k]-y2[k];
+      chi2 += (vyy*sq(dx) + vxx*sq(dy) -2*vxy*dx*dy)/det;
     }
-  return dist;
+  return chi2;
 }
-#endif
+
+
+/* nth_element is linear on average, where the full sort used
+   before was n log(n). For even sizes, the lower middle value is the
+   largest one of the lower half. */
+double Median(const std::vector<double> &Values, std::vector<double> &Work)
+{
+  unsigned n = Values.size();
+  if (n == 0) return 0;
+  Work.assign(Values.begin(), Values.end());
+  auto mid = Work.begin()+n/2;
+  std::nth_element(Work.begin(), mid, Work.end());
+  if (n&1) return *mid;
+  return (*std::max_element(Work.begin(), mid) + *mid)*0.5;
+}
+
 
 int StarMatchList::Dof(const Gtransfo* T) const
 {
@@ -112,6 +219,10 @@ void StarMatchList::RefineTransfo(const double &NSigmas)
   double cut;
   unsigned nremoved;
   if (!transfo) transfo = new GtransfoLin;
+  /* the arrays follow the list : they are only reloaded when the
+     cleanup removed pairs (sorting does not matter, because results
+     are copied back in list order right after computing them). */
+  bool loaded = false;
   do
     {
       int nused = size();
@@ -130,23 +241,26 @@ void StarMatchList::RefineTransfo(const double &NSigmas)
       unsigned npair = int(size());
       if (npair == 0) break; // should never happen
 
-      // compute some chi2 statistics
-      double *chi2_array = new double[npair];
+      // compute some chi2 statistics, and the distances for RemoveAmbiguities
+      if (!loaded) { arrays.Load(*this); loaded = true;}
+      arrays.Chi2AndDist2(*transfo, chi2s, dist2s);
       unsigned count = 0;
-      for (auto it= begin(); it!= end(); ++it)
-	chi2_array[count++] = it->chi2 = it->Chi2(*transfo);
-      std::sort(chi2_array, chi2_array+npair);
-      double median =  (npair&1)? chi2_array[npair/2] :
-	(chi2_array[npair/2-1] + chi2_array[npair/2])*0.5;
-
-      delete [] chi2_array;
+      for (auto it= begin(); it!= end(); ++it, ++count)
+	{
+	  it->chi2 = chi2s[count];
+	  it->distance = sqrt(dist2s[count]);
+	}
+      double median = Median(chi2s, work);
 
       // discard outliers : the cut is understood as a "distance" cut
       cut = sq(NSigmas)*median;
-      nremoved = chi2_cleanup(*this, cut, *transfo);
+      nremoved = remove_ambiguities(3);
+      nremoved += chi2_cleanup(*this, cut);
+      if (nremoved) loaded = false;
     }
   while (nremoved);
-  dist2 = ComputeDist2(*this, *transfo);
+  if (!loaded) arrays.Load(*this);
+  dist2 = arrays.SumDist2(*transfo);
 }
 
 
@@ -160,7 +274,10 @@ double StarMatchList::Residual() const
 
 void StarMatchList::SetDistance(const Gtransfo &Transfo)
 {
-  for (auto smi = begin(); smi != end(); smi++) (*smi).SetDistance(Transfo); // c'est compact
+  arrays.Load(*this);
+  arrays.Dist2(Transfo, dist2s);
+  unsigned k = 0;
+  for (auto smi = begin(); smi != end(); ++smi) smi->distance = sqrt(dist2s[k++]);
 }
 
 
@@ -169,6 +286,12 @@ unsigned StarMatchList::RemoveAmbiguities(const Gtransfo &Transfo,
 {
   if (!Which) return 0;
   SetDistance(Transfo);
+  return remove_ambiguities(Which);
+}
+
+
+unsigned StarMatchList::remove_ambiguities(const int Which)
+{
   int initial_count = size();
   if (Which & 1)
     {
@@ -354,10 +477,13 @@ void StarMatchList::ApplyTransfo(StarMatchList &Transformed,
 
 void StarMatchList::SetChi2()
 {
+  arrays.Load(*this);
+  arrays.Chi2(*transfo, chi2s);
   chi2 = 0;
+  unsigned k = 0;
   for (auto  i= begin(); i != end(); ++i)
     {
-      i->chi2 = i->Chi2(*transfo);
+      i->chi2 = chi2s[k++];
       chi2 += i->chi2;
     }
 }
@@ -386,20 +512,21 @@ double FitResidual(const StarMatchList &S, const Gtransfo &T)
 
 double ComputeDist2(const StarMatchList &S, const Gtransfo &T)
 {
-  double dist2 = 0;
-  for (auto i = S.begin(); i != S.end(); ++i)
-    dist2 += T.apply(i->point1).Dist2(i->point2);
-  return dist2;
+  StarMatchArrays arrays(S);
+  return arrays.SumDist2(T);
 }
 
 double ComputeChi2(const StarMatchList &L, const Gtransfo &T)
 {
-  unsigned s= L.size();
-  double *chi2s = chi2_array(L,T);
-  double chi2 = 0;
-  for (unsigned k=0; k<s; ++k) chi2 += chi2s[k];
-  delete [] chi2s;
-  return chi2;
+  StarMatchArrays arrays;
+  return ComputeChi2(L, T, arrays);
+}
+
+double ComputeChi2(const StarMatchList &L, const Gtransfo &T,
+		   StarMatchArrays &Arrays)
+{
+  Arrays.Load(L);
+  return Arrays.SumChi2(T);
 }
 
 
@@ -8,14 +8,28 @@ namespace lsst {
 namespace jointcal {
 
 
+/* The first NPar1 rows of H hold the derivatives of T1 (x and y);
+   turns them into the ones of T2 o T1, in place, row by row:
+   H.block(0,0,NPar1,2) = H.block(0,0,NPar1,2)*Dt2dx */
+static void chain_rule(const Eigen::Matrix2d &Dt2dx, const unsigned NPar1,
+		       Eigen::MatrixX2d &H)
+{
+  for (unsigned k=0; k<NPar1; ++k)
+    {
+      double hx = H(k,0);
+      double hy = H(k,1);
+      H(k,0) = hx*Dt2dx(0,0)+hy*Dt2dx(1,0);
+      H(k,1) = hx*Dt2dx(0,1)+hy*Dt2dx(1,1);
+    }
+}
+
 TwoTransfoMapping::TwoTransfoMapping(SimpleGtransfoMapping *M1,
 				     SimpleGtransfoMapping *M2):
   _m1(M1), _m2(M2)
 {
-  /* Allocate the record of temporary variables, so that they are not
-     allocated at every call. This is hidden behind a pointer in order
-     to be allowed to alter them in a const routine. */
-  tmp = std::unique_ptr<tmpVars>(new tmpVars);
+  _poly1 = dynamic_cast<const SimplePolyMapping*>(M1);
+  _poly2 = dynamic_cast<const SimplePolyMapping*>(M2);
+  if (!_poly1 || !_poly2) _poly1 = _poly2 = NULL;
   SetWhatToFit(true,true);
 }
 
@@ -46,46 +60,59 @@ void TwoTransfoMapping::ComputeTransformAndDerivatives(const FatPoint &Where,
 {
   // not true in general. Will crash if H is too small.
   //  assert(H.cols()==Npar());
+  if (_poly1)
+    {
+      poly_transform_and_derivatives(Where, OutPos, H);
+      return;
+    }
 
   FatPoint pMid;
   // don't need errors there but no Mapping::Transform() routine.
 
   if (_nPar1)
     {
-      _m1->ComputeTransformAndDerivatives(Where, pMid,  tmp->h1);
+      _m1->TransformAndParamDerivatives(Where, pMid, &H(0,0), &H(0,1));
       // the last argument is epsilon and is not used for polynomials
-      _m2->PosDerivative(pMid, tmp->dt2dx, 1e-4);
-      H.block(0,0,_nPar1,2) = tmp->h1*tmp->dt2dx;
+      Eigen::Matrix2d dt2dx;
+      _m2->PosDerivative(pMid, dt2dx, 1e-4);
+      chain_rule(dt2dx, _nPar1, H);
     }
   else _m1->TransformPosAndErrors(Where, pMid);
   if (_nPar2)
-    {
-      _m2->ComputeTransformAndDerivatives(pMid,OutPos, tmp->h2);
-      H.block(_nPar1,0,_nPar2,2) = tmp->h2;
-    }
+    _m2->TransformAndParamDerivatives(pMid, OutPos, &H(_nPar1,0), &H(_nPar1,1));
   else _m2->TransformPosAndErrors(pMid, OutPos);
 
 }
 
-  /*! Sets the _nPar{1,2} and allocates H matrices accordingly, to
-     avoid allocation at every call. If we did not care about dynamic
-     allocation, we could just put the information of what moves and
-     what doesn't into the SimpleGtransfoMapping. */
-void TwoTransfoMapping::SetWhatToFit(const bool FittingT1, const bool FittingT2)
+/* The polynomial o polynomial case (i.e. all CcdImage's but the
+   ones of the reference shoot in ConstrainedPolyModel): the parameter
+   derivatives are written straight into H, and the chain rule for the
+   T1 parameters is applied in place, with a fixed-size 2x2 derivative,
+   so that nothing is allocated nor stored in the mapping. T2 is
+   differentiated w.r.t. position at the same time as it is applied. */
+void TwoTransfoMapping::poly_transform_and_derivatives(const FatPoint &Where,
+							FatPoint &OutPos,
+							Eigen::MatrixX2d &H) const
 {
+  FatPoint pMid;
+  if (_nPar1) _poly1->TransformAndDerivatives(Where, pMid, &H(0,0), &H(0,1), NULL);
+  else _poly1->TransformAndDerivatives(Where, pMid, NULL, NULL, NULL);
+  Eigen::Matrix2d dt2dx;
+  if (_nPar2)
+    _poly2->TransformAndDerivatives(pMid, OutPos, &H(_nPar1,0), &H(_nPar1,1),
+				    (_nPar1) ? &dt2dx : NULL);
+  else
+    _poly2->TransformAndDerivatives(pMid, OutPos, NULL, NULL,
+				    (_nPar1) ? &dt2dx : NULL);
+  chain_rule(dt2dx, _nPar1, H);
+}
 
-  if (FittingT1)
-    {
-      _nPar1 = _m1->Npar();
-      tmp->h1 = Eigen::MatrixX2d(_nPar1,2);
-    }
-  else _nPar1 = 0;
-  if (FittingT2)
-    {
-      _nPar2 = _m2->Npar();
-      tmp->h2 = Eigen::MatrixX2d(_nPar2,2);
-    }
-  else _nPar2 = 0;
+  /*! Sets the _nPar{1,2}. We could as well put the information of
+     what moves and what doesn't into the SimpleGtransfoMapping. */
+void TwoTransfoMapping::SetWhatToFit(const bool FittingT1, const bool FittingT2)
+{
+  _nPar1 = (FittingT1) ? _m1->Npar() : 0;
+  _nPar2 = (FittingT2) ? _m2->Npar() : 0;
 }
 
 
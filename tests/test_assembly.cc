@@ -0,0 +1,194 @@
+#define BOOST_TEST_DYN_LINK
+
+#define BOOST_TEST_MODULE test_assembly
+
+//The boost unit test header
+#include "boost/test/unit_test.hpp"
+
+#include "lsst/jointcal/Tripletlist.h"
+#include "lsst/jointcal/SparseAssembler.h"
+
+#include "Eigen/Sparse"
+
+#include <cmath>
+#include <vector>
+
+namespace jointcal = lsst::jointcal;
+
+typedef Eigen::SparseMatrix<double> SpMat;
+
+/* Fills TList and Plain with the same entries: blocks of 2 columns
+   (as written by the LSDerivatives routines), a block whose entries
+   come back to its first column, single-column blocks and a block
+   that starts before the previous one. Duplicates are included. */
+static void fill_lists(jointcal::TripletList &TList,
+		       std::vector<Eigen::Triplet<double> > &Plain,
+		       const double Scale)
+{
+  struct Entry { unsigned i, j; double v;};
+  const Entry entries[] = {
+    {0, 0, 1.}, {3, 0, 2.}, {1, 1, 3.}, {4, 1, 4.},  // column change inside a block
+    {2, 1, 5.}, {5, 0, 6.},                           // back to the first column of the block
+    {0, 2, 7.}, {6, 2, 8.},                           // new block (next column)
+    {1, 5, 9.}, {2, 6, 10.}, {1, 5, 11.},             // new block (column jump), with a duplicate
+    {3, 3, 12.}, {7, 4, 13.},                         // new block, before the previous one
+    {7, 7, 14.}                                       // new block (column jump)
+  };
+  for (const Entry &e : entries)
+    {
+      TList.AddTriplet(e.i, e.j, Scale*e.v);
+      Plain.push_back(Eigen::Triplet<double>(e.i, e.j, Scale*e.v));
+    }
+}
+
+static double max_abs_difference(const SpMat &A, const SpMat &B)
+{
+  BOOST_REQUIRE_EQUAL(A.rows(), B.rows());
+  BOOST_REQUIRE_EQUAL(A.cols(), B.cols());
+  return Eigen::MatrixXd(A-B).cwiseAbs().maxCoeff();
+}
+
+BOOST_AUTO_TEST_SUITE(test_assembly)
+
+/* the compact TripletList should feed setFromTriplets with the same
+   entries as a plain vector of Eigen::Triplet */
+BOOST_AUTO_TEST_CASE(test_tripletlist)
+{
+  jointcal::TripletList tList(100);
+  std::vector<Eigen::Triplet<double> > plain;
+  fill_lists(tList, plain, 1.);
+  BOOST_CHECK_EQUAL(tList.size(), plain.size());
+
+  // entry by entry
+  unsigned k = 0;
+  for (auto i = tList.begin(); i != tList.end(); ++i, ++k)
+    {
+      BOOST_CHECK_EQUAL(i->row(), plain[k].row());
+      BOOST_CHECK_EQUAL(i->col(), plain[k].col());
+      BOOST_CHECK_EQUAL(i->value(), plain[k].value());
+    }
+  BOOST_CHECK_EQUAL(k, plain.size());
+
+  SpMat fromList(8,8), fromPlain(8,8);
+  fromList.setFromTriplets(tList.begin(), tList.end());
+  fromPlain.setFromTriplets(plain.begin(), plain.end());
+  BOOST_CHECK_EQUAL(fromList.nonZeros(), fromPlain.nonZeros());
+  BOOST_CHECK_EQUAL(max_abs_difference(fromList, fromPlain), 0.);
+}
+
+/* refilling the cached pattern should provide the same matrix as
+   a rebuild, and a pattern change should trigger a rebuild */
+BOOST_AUTO_TEST_CASE(test_sparse_assembler)
+{
+  jointcal::SparseAssembler assembler;
+  jointcal::TripletList tList(100);
+  std::vector<Eigen::Triplet<double> > plain;
+  SpMat expected(8,8);
+
+  fill_lists(tList, plain, 1.);
+  expected.setFromTriplets(plain.begin(), plain.end());
+  BOOST_CHECK_EQUAL(max_abs_difference(assembler.Assemble(tList, 8, 8), expected), 0.);
+  BOOST_CHECK_EQUAL(assembler.NRecycled(), 0u);
+
+  // same pattern, other values : refill
+  tList.clear(); plain.clear();
+  fill_lists(tList, plain, -2.5);
+  expected.setFromTriplets(plain.begin(), plain.end());
+  BOOST_CHECK_EQUAL(max_abs_difference(assembler.Assemble(tList, 8, 8), expected), 0.);
+  BOOST_CHECK_EQUAL(assembler.NRecycled(), 1u);
+
+  // the pattern survives ReleaseMatrix
+  assembler.ReleaseMatrix();
+  BOOST_CHECK_EQUAL(assembler.Matrix().nonZeros(), 0);
+  BOOST_CHECK_EQUAL(max_abs_difference(assembler.Assemble(tList, 8, 8), expected), 0.);
+  BOOST_CHECK_EQUAL(assembler.NRecycled(), 2u);
+
+  // same number of triplets, but one of them moved : rebuild
+  tList.clear(); plain.clear();
+  fill_lists(tList, plain, 1.);
+  tList.AddTriplet(6, 7, 1.);
+  plain.push_back(Eigen::Triplet<double>(6, 7, 1.));
+  jointcal::TripletList moved(100);
+  std::vector<Eigen::Triplet<double> > movedPlain;
+  fill_lists(moved, movedPlain, 1.);
+  moved.AddTriplet(0, 7, 1.);
+  movedPlain.push_back(Eigen::Triplet<double>(0, 7, 1.));
+  expected.setFromTriplets(plain.begin(), plain.end());
+  BOOST_CHECK_EQUAL(max_abs_difference(assembler.Assemble(tList, 8, 8), expected), 0.);
+  expected.setFromTriplets(movedPlain.begin(), movedPlain.end());
+  BOOST_CHECK_EQUAL(max_abs_difference(assembler.Assemble(moved, 8, 8), expected), 0.);
+  BOOST_CHECK_EQUAL(assembler.NRecycled(), 2u);
+
+  // dimensions change : rebuild
+  SpMat larger(9,8);
+  larger.setFromTriplets(movedPlain.begin(), movedPlain.end());
+  BOOST_CHECK_EQUAL(max_abs_difference(assembler.Assemble(moved, 9, 8), larger), 0.);
+  BOOST_CHECK_EQUAL(assembler.NRecycled(), 2u);
+
+  // and the new pattern is then recycled
+  BOOST_CHECK_EQUAL(max_abs_difference(assembler.Assemble(moved, 9, 8), larger), 0.);
+  BOOST_CHECK_EQUAL(assembler.NRecycled(), 3u);
+}
+
+/* the Levenberg-Marquardt driver on a straight line fit, with one
+   outlier to be removed along the way */
+BOOST_AUTO_TEST_CASE(test_levenberg_marquardt)
+{
+  std::vector<double> x, y;
+  for (unsigned k=0; k<20; ++k)
+    {
+      x.push_back(k);
+      y.push_back(2.+0.5*k+((k%2) ? 0.1 : -0.1));
+    }
+  y[7] += 10.; // the outlier
+  std::vector<bool> valid(x.size(), true);
+  Eigen::VectorXd params(2); params << 0., 0.;
+
+  auto residual = [&](const unsigned k) { return y[k]-params[0]-params[1]*x[k];};
+  jointcal::LMFitCallbacks fit;
+  fit.HessianAndGradient = [&](SpMat &H, Eigen::VectorXd &G)
+    {
+      std::vector<Eigen::Triplet<double> > hTerms;
+      for (unsigned k=0; k<x.size(); ++k)
+	{
+	  if (!valid[k]) continue;
+	  const double h[2] = {1., x[k]};
+	  for (unsigned i=0; i<2; ++i)
+	    {
+	      G[i] += h[i]*residual(k);
+	      for (unsigned j=0; j<2; ++j)
+		hTerms.push_back(Eigen::Triplet<double>(i, j, h[i]*h[j]));
+	    }
+	}
+      H.resize(2,2);
+      H.setFromTriplets(hTerms.begin(), hTerms.end());
+    };
+  fit.ComputeChi2 = [&]()
+    {
+      jointcal::Chi2 chi2;
+      for (unsigned k=0; k<x.size(); ++k)
+	if (valid[k]) { chi2.chi2 += residual(k)*residual(k); chi2.ndof++;}
+      chi2.ndof -= 2;
+      return chi2;
+    };
+  fit.OffsetParams = [&](const Eigen::VectorXd &Delta) { params += Delta;};
+  fit.RemoveOutliers = [&](const double NSigCut)
+    {
+      unsigned removed = 0;
+      jointcal::Chi2 chi2 = fit.ComputeChi2();
+      double sigma = std::sqrt(chi2.chi2/chi2.ndof);
+      for (unsigned k=0; k<x.size(); ++k)
+	if (valid[k] && std::fabs(residual(k)) > NSigCut*sigma)
+	  { valid[k] = false; removed++;}
+      return removed;
+    };
+
+  unsigned status = jointcal::LevenbergMarquardt<Eigen::SimplicialLDLT<SpMat> >
+    (fit, 2, "test_levenberg_marquardt", 3., 20, 1e-6);
+  BOOST_CHECK_EQUAL(status, 0u);
+  BOOST_CHECK(!valid[7]);
+  BOOST_CHECK_SMALL(params[0]-2., 0.05);
+  BOOST_CHECK_SMALL(params[1]-0.5, 0.01);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
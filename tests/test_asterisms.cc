@@ -0,0 +1,66 @@
+#define BOOST_TEST_DYN_LINK
+
+#define BOOST_TEST_MODULE test_asterisms
+
+//The boost unit test header
+#include "boost/test/unit_test.hpp"
+
+#include "lsst/jointcal/BaseStar.h"
+#include "lsst/jointcal/StarMatch.h"
+#include "lsst/jointcal/ListMatch.h"
+#include "lsst/jointcal/Gtransfo.h"
+
+#include <cstdlib>
+
+namespace jointcal = lsst::jointcal;
+
+static double uniform(const double Min, const double Max)
+{
+  return Min + (Max-Min)*double(rand())/RAND_MAX;
+}
+
+BOOST_AUTO_TEST_SUITE(test_asterisms)
+
+/* Triangle matching (MatchConditions::Algorithm = 3) on a synthetic
+   field: the second list is the first one rotated and shifted, with
+   missing stars and spurious ones. */
+BOOST_AUTO_TEST_CASE(test_asterism_match)
+{
+  srand(4321);
+  const double angle = 0.3; // radians
+  jointcal::GtransfoLin rotShift = jointcal::GtransfoLinShift(35., -20.)
+    *jointcal::GtransfoLinRot(angle);
+
+  jointcal::BaseStarList l1, l2;
+  for (unsigned k=0; k<300; ++k)
+    {
+      jointcal::BaseStar *s1 = new jointcal::BaseStar(uniform(0., 2000.),
+						      uniform(0., 2000.),
+						      1000.-k);
+      l1.push_back(s1);
+      if (k%10 == 3) continue; // missing in the second list
+      l2.push_back(new jointcal::BaseStar(rotShift.apply(*s1), s1->flux));
+      if (k%15 == 7) // spurious, about as bright
+	l2.push_back(new jointcal::BaseStar(uniform(0., 2000.),
+					    uniform(0., 2000.),
+					    s1->flux-0.5));
+    }
+
+  jointcal::MatchConditions conditions;
+  conditions.Algorithm = 3;
+  conditions.NThreads = 1;
+  jointcal::StarMatchList *match = jointcal::MatchSearchRotShift(l1, l2, conditions);
+  BOOST_REQUIRE(match != NULL);
+  BOOST_CHECK(match->size() >= 10);
+
+  const jointcal::Gtransfo *found = match->Transfo();
+  for (auto si = l1.begin(); si != l1.end(); ++si)
+    {
+      jointcal::Point expected = rotShift.apply(**si);
+      jointcal::Point obtained = found->apply(**si);
+      BOOST_CHECK_SMALL(expected.Distance(obtained), 1e-3);
+    }
+  delete match;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,84 @@
+#define BOOST_TEST_DYN_LINK
+
+#define BOOST_TEST_MODULE test_refcatalog
+
+//The boost unit test header
+#include "boost/test/unit_test.hpp"
+
+#include "lsst/jointcal/BaseStar.h"
+#include "lsst/jointcal/RefCatalog.h"
+#include "lsst/jointcal/Frame.h"
+#include "lsst/pex/exceptions.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+namespace jointcal = lsst::jointcal;
+
+static double uniform(const double Min, const double Max)
+{
+  return Min + (Max-Min)*double(rand())/RAND_MAX;
+}
+
+/* the fluxes (the star numbers) of the stars of L, sorted */
+static std::vector<double> fluxes(const jointcal::BaseStarList &L)
+{
+  std::vector<double> res;
+  for (auto si = L.begin(); si != L.end(); ++si) res.push_back((*si)->flux);
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+BOOST_AUTO_TEST_SUITE(test_refcatalog)
+
+/* A catalog read across ra=0 (ra's in [-10,10], as the catalog
+   readers provide them) is queried on both sides of ra=0 and 360. */
+BOOST_AUTO_TEST_CASE(test_refcatalog_ra_wrap)
+{
+  srand(12345);
+  jointcal::BaseStarList skyStars;
+  std::vector<jointcal::Point> positions;
+  for (unsigned k=0; k<2000; ++k)
+    {
+      jointcal::Point p(uniform(-10., 10.), uniform(20., 30.));
+      positions.push_back(p);
+      skyStars.push_back(new jointcal::BaseStar(p, k));
+    }
+  jointcal::RefCatalog refCat(skyStars);
+  BOOST_CHECK_EQUAL(refCat.size(), skyStars.size());
+
+  // the same region, expressed around ra=0 and around ra=360
+  const double raShifts[] = {0., 360.};
+  for (double raShift : raShifts)
+    {
+      jointcal::Frame query(-3.+raShift, 22., 4.+raShift, 27.);
+      BOOST_CHECK(refCat.Covers(query));
+      jointcal::BaseStarList out;
+      refCat.Query(query, out);
+
+      std::vector<double> expected;
+      for (unsigned k=0; k<positions.size(); ++k)
+	if (query.InFrame(jointcal::Point(positions[k].x+raShift, positions[k].y)))
+	  expected.push_back(k);
+      BOOST_CHECK(expected.size() > 0);
+      BOOST_CHECK(fluxes(out) == expected);
+      // returned in the coordinates of the query
+      for (auto si = out.begin(); si != out.end(); ++si)
+	BOOST_CHECK(query.InFrame(**si));
+      // and sorted by decreasing flux
+      for (auto si = out.begin(); si != out.end(); ++si)
+	{
+	  auto next = si; ++next;
+	  if (next != out.end()) BOOST_CHECK((*si)->flux >= (*next)->flux);
+	}
+    }
+
+  // partially covered regions are refused
+  jointcal::BaseStarList out;
+  jointcal::Frame partial(5., 22., 15., 27.);
+  BOOST_CHECK(!refCat.Covers(partial));
+  BOOST_CHECK_THROW(refCat.Query(partial, out), lsst::pex::exceptions::DomainError);
+}
+
+BOOST_AUTO_TEST_SUITE_END()